@@ -0,0 +1,111 @@
+/*
+CPU kernels for the AdamW optimizer step.
+All versions come from train_gpt2.c.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/adamw.c -lm -o adamw
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference, adamw_update, as one scalar pass over all parameters
+OMP_NUM_THREADS=8 ./adamw 1
+
+version 2 is gpt2_update: blocks of ADAMW_BLOCK parameters split over the threads,
+each running the SIMD adamw_update of kernels_init
+OMP_NUM_THREADS=8 ./adamw 2
+
+version 3 and 4 are gpt2_update with the m and v state in bf16 and in 8-bit blocks,
+which are checked against the reference with looser tolerances
+OMP_NUM_THREADS=8 ./adamw 4
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int N = 50 * 1024 * 1024; // parameters
+    int steps = 10;
+    float learning_rate = 1e-3f, beta1 = 0.9f, beta2 = 0.999f, eps = 1e-8f, weight_decay = 0.01f;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    printf("Using kernel %d\n", kernel_num);
+    if (kernel_num < 1 || kernel_num > 4) {
+        printf("Invalid kernel number\n");
+        exit(1);
+    }
+    kernels_init();
+
+    float* params = make_random_float(N);
+    float* params_ref = (float*)malloc((size_t)N * sizeof(float));
+    memcpy(params_ref, params, (size_t)N * sizeof(float));
+    float* grads = make_random_float(N);
+    for (int i = 0; i < N; i++) { grads[i] *= 0.01f; }
+    float* m_ref = make_zeros_float(N);
+    float* v_ref = make_zeros_float(N);
+
+    // versions 2-4 run the optimizer of a model that only has its parameters and gradients
+    GPT2 model;
+    memset(&model, 0, sizeof(GPT2));
+    model.params_memory = params;
+    model.grads_memory = grads;
+    model.num_parameters = N;
+    model.optimizer_bits = kernel_num == 3 ? 16 : kernel_num == 4 ? 8 : 32;
+    float* m = make_zeros_float(N);
+    float* v = make_zeros_float(N);
+
+    // first check the correctness of the kernel against the reference, over a few steps
+    // the steps reuse the same gradients, which is enough to move m and v around
+    for (int t = 1; t <= steps; t++) {
+        float c1 = 1.0f - powf(beta1, t), c2 = 1.0f - powf(beta2, t);
+        adamw_update(params_ref, grads, m_ref, v_ref, N, learning_rate, beta1, beta2, c1, c2, eps, weight_decay);
+        if (kernel_num == 1) {
+            adamw_update(params, grads, m, v, N, learning_rate, beta1, beta2, c1, c2, eps, weight_decay);
+        } else {
+            gpt2_update(&model, learning_rate, beta1, beta2, eps, weight_decay, t);
+        }
+    }
+    // the steps move every parameter by about steps * learning_rate = 1e-2. bf16 state
+    // stays within 1e-4 of that. the 8-bit codes keep a few significant bits for the
+    // entries far below the maximum of their block, so those can lose most of their step
+    float tolerance[] = {0.0f, 1e-6f, 1e-6f, 1e-4f, 1e-2f};
+    validate_result(params_ref, params, "params", N, tolerance[kernel_num]);
+
+    // time the kernel
+    int repeat_times = 5;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        int t = steps + 1 + i;
+        if (kernel_num == 1) {
+            adamw_update(params, grads, m, v, N, learning_rate, beta1, beta2,
+                         1.0f - powf(beta1, t), 1.0f - powf(beta2, t), eps, weight_decay);
+        } else {
+            gpt2_update(&model, learning_rate, beta1, beta2, eps, weight_decay, t);
+        }
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: read grads, read + write params, m and v (m and v in their storage
+    // precision). about 15 flops per parameter, counting the sqrt and the divisions as one
+    double state_bytes = kernel_num == 3 ? 2.0 : kernel_num == 4 ? 1.0 + sizeof(float) / (double)ADAMW_BLOCK : 4.0;
+    double bytes = (double)N * (3.0 * sizeof(float) + 4.0 * state_bytes);
+    char label[64];
+    snprintf(label, sizeof(label), "adamw (N=%d, state %d bits)", N, kernel_num == 3 ? 16 : kernel_num == 4 ? 8 : 32);
+    print_timing(label, elapsed_ms, bytes, 15.0 * N);
+
+    free(params_ref);
+    free(m_ref);
+    free(v_ref);
+    free(m);
+    free(v);
+    gpt2_free(&model); // frees params, grads and the optimizer state
+    printf("Results match!\n");
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+CPU kernels for attention backward pass.
+Both versions come from train_gpt2.c.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/attention_backward.c -lm -o attention_backward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is attention_backward, through the stored attention matrix and the
+dpreatt / datt buffers, parallel over (b,h)
+OMP_NUM_THREADS=8 ./attention_backward 1
+
+version 2 is attention_backward_flash, which recomputes the attention scores from the
+row statistics of attention_forward_flash instead
+OMP_NUM_THREADS=8 ./attention_backward 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// kernel version dispatch
+
+void attention_backward_version(int kernel_num,
+                                float* dinp, float* dpreatt, float* datt,
+                                float* dout, float* inp, float* att, float* rowmax, float* rowsum,
+                                int B, int T, int C, int NH) {
+    switch (kernel_num) {
+        case 1:
+            attention_backward(dinp, dpreatt, datt, dout, inp, att, B, T, C, NH);
+            break;
+        case 2:
+            attention_backward_flash(dinp, dout, inp, rowmax, rowsum, B, T, C, NH);
+            break;
+        default:
+            printf("Invalid kernel number\n");
+            exit(1);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 4;
+    int T = 512;
+    int C = 768;
+    int NH = 12;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    printf("Using kernel %d\n", kernel_num);
+
+    size_t NTT = (size_t)B * NH * T * T;
+    float* inp = make_random_float((size_t)B * T * 3 * C);
+    float* dout = make_random_float((size_t)B * T * C);
+    float* out = make_zeros_float((size_t)B * T * C);
+    float* preatt = make_zeros_float(NTT);
+    float* att = make_zeros_float(NTT);
+    float* rowmax = make_zeros_float((size_t)B * NH * T);
+    float* rowsum = make_zeros_float((size_t)B * NH * T);
+    float* dpreatt = make_zeros_float(NTT);
+    float* datt = make_zeros_float(NTT);
+    float* dinp = make_zeros_float((size_t)B * T * 3 * C);
+    float* dinp_ref = make_zeros_float((size_t)B * T * 3 * C);
+    // the forward activations that both versions need
+    attention_forward(out, preatt, att, inp, B, T, C, NH);
+    attention_forward_flash(out, rowmax, rowsum, inp, B, T, C, NH);
+
+    // first check the correctness of the kernel against the reference
+    attention_backward_version(1, dinp_ref, dpreatt, datt, dout, inp, att, rowmax, rowsum, B, T, C, NH);
+    attention_backward_version(kernel_num, dinp, dpreatt, datt, dout, inp, att, rowmax, rowsum, B, T, C, NH);
+    validate_result(dinp_ref, dinp, "dinp", (size_t)B * T * 3 * C, 1e-3f);
+
+    // time the kernel (dinp is overwritten every time, datt and dpreatt are only scratch)
+    int repeat_times = 3;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        attention_backward_version(kernel_num, dinp, dpreatt, datt, dout, inp, att, rowmax, rowsum, B, T, C, NH);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: dV, datt, dQ and dK are each a multiply-add per causal (b,h,t,t2,i),
+    // and the flash version recomputes QK^T on top. the reference also streams through
+    // att, datt and dpreatt
+    double causal = (double)B * C * T * (T + 1) / 2.0;
+    double flops = (kernel_num == 2 ? 5.0 : 4.0) * 2.0 * causal;
+    double bytes = (double)B * T * (3 * C + 3 * C + C) * sizeof(float);
+    if (kernel_num == 1) { bytes += 5.0 * NTT * sizeof(float); }
+    char label[64];
+    snprintf(label, sizeof(label), "attention backward (B=%d, T=%d, C=%d, NH=%d)", B, T, C, NH);
+    print_timing(label, elapsed_ms, bytes, flops);
+
+    free(inp);
+    free(dout);
+    free(out);
+    free(preatt);
+    free(att);
+    free(rowmax);
+    free(rowsum);
+    free(dpreatt);
+    free(datt);
+    free(dinp);
+    free(dinp_ref);
+    printf("Results match!\n");
+    return 0;
+}
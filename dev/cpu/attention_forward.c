@@ -0,0 +1,136 @@
+/*
+CPU kernels for attention forward pass.
+All versions come from train_gpt2.c.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/attention_forward.c -lm -o attention_forward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference, attention_forward, which materializes the (B,NH,T,T)
+pre-softmax scores and the attention matrix
+OMP_NUM_THREADS=8 ./attention_forward 1
+
+version 2 is the flash-style attention_forward_flash: an online softmax over tiles of
+keys, keeping only the row max and row sum of every query
+OMP_NUM_THREADS=8 ./attention_forward 2
+
+version 3 is attention_forward_cached of gpt2_decode, with all T rows of a sequence as
+one prefill: the keys and values are appended to a paged KV cache, and every query row
+runs its own online softmax over the cached positions up to itself
+OMP_NUM_THREADS=8 ./attention_forward 3
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// kernel version dispatch
+
+// for version 3: the KV cache of one layer, in blocks of KV_BLOCK positions, and every row
+// of the sequence reads it through the same block table, at its own position
+float** cached_blocks;
+int* cached_table;
+int** cached_tables;
+int* cached_positions;
+
+void attention_forward_version(int kernel_num,
+                               float* out, float* preatt, float* att,
+                               float* inp,
+                               int B, int T, int C, int NH) {
+    switch (kernel_num) {
+        case 1:
+            attention_forward(out, preatt, att, inp, B, T, C, NH);
+            break;
+        case 2:
+            // preatt and att are big enough for the (B,NH,T) row statistics
+            attention_forward_flash(out, preatt, att, inp, B, T, C, NH);
+            break;
+        case 3:
+            // preatt is big enough for the (T,C) keys and values of a sequence, in blocks
+            for (int b = 0; b < B; b++) {
+                float* inp_b = inp + b * T * 3*C;
+                for (int t = 0; t < T; t++) {
+                    float* key = cached_blocks[t / KV_BLOCK] + (t % KV_BLOCK) * C;
+                    memcpy(key, inp_b + t * 3*C + C, C * sizeof(float));
+                    memcpy(key + KV_BLOCK * C, inp_b + t * 3*C + 2*C, C * sizeof(float));
+                }
+                attention_forward_cached(out + b * T * C, inp_b, cached_blocks, cached_tables, cached_positions, 0, T, C, NH);
+            }
+            break;
+        default:
+            printf("Invalid kernel number\n");
+            exit(1);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 4;
+    int T = 512;
+    int C = 768;
+    int NH = 12;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    printf("Using kernel %d\n", kernel_num);
+
+    float* inp = make_random_float((size_t)B * T * 3 * C);
+    float* out = make_zeros_float((size_t)B * T * C);
+    float* out_ref = make_zeros_float((size_t)B * T * C);
+    float* preatt = make_zeros_float((size_t)B * NH * T * T);
+    float* att = make_zeros_float((size_t)B * NH * T * T);
+    int num_blocks = (T + KV_BLOCK - 1) / KV_BLOCK;
+    cached_blocks = (float**)malloc(num_blocks * sizeof(float*));
+    cached_table = (int*)malloc(num_blocks * sizeof(int));
+    cached_tables = (int**)malloc(T * sizeof(int*));
+    cached_positions = (int*)malloc(T * sizeof(int));
+    for (int i = 0; i < num_blocks; i++) {
+        cached_blocks[i] = preatt + (size_t)i * 2 * KV_BLOCK * C;
+        cached_table[i] = i;
+    }
+    for (int t = 0; t < T; t++) {
+        cached_tables[t] = cached_table;
+        cached_positions[t] = t;
+    }
+
+    // first check the correctness of the kernel against the reference
+    attention_forward_version(1, out_ref, preatt, att, inp, B, T, C, NH);
+    attention_forward_version(kernel_num, out, preatt, att, inp, B, T, C, NH);
+    validate_result(out_ref, out, "out", (size_t)B * T * C, 1e-4f);
+
+    // time the kernel
+    int repeat_times = 5;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        attention_forward_version(kernel_num, out, preatt, att, inp, B, T, C, NH);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: causal QK^T and att @ V are each a multiply-add per (b,h,t,t2<=t,i)
+    // the reference also writes (and reads back) the two (B,NH,T,T) tensors
+    double flops = 2.0 * 2.0 * B * C * T * (T + 1) / 2.0;
+    double bytes = (double)B * T * 4 * C * sizeof(float);
+    if (kernel_num == 1) { bytes += 3.0 * B * NH * T * T * sizeof(float); }
+    char label[64];
+    snprintf(label, sizeof(label), "attention (B=%d, T=%d, C=%d, NH=%d)", B, T, C, NH);
+    print_timing(label, elapsed_ms, bytes, flops);
+
+    free(inp);
+    free(out);
+    free(out_ref);
+    free(preatt);
+    free(att);
+    free(cached_blocks);
+    free(cached_table);
+    free(cached_tables);
+    free(cached_positions);
+    printf("Results match!\n");
+    return 0;
+}
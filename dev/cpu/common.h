@@ -0,0 +1,70 @@
+/*
+Shared utilities of the CPU kernel files in dev/cpu.
+Every file includes train_gpt2.c (with TESTING defined, so without its main) first,
+which gives it the reference layers and all the optimized versions of train_gpt2.c.
+*/
+
+// ----------------------------------------------------------------------------
+// random inputs
+
+float* make_random_float(size_t N) {
+    float* arr = (float*)malloc(N * sizeof(float));
+    for (size_t i = 0; i < N; i++) {
+        arr[i] = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
+    }
+    return arr;
+}
+
+float* make_zeros_float(size_t N) {
+    return (float*)calloc(N, sizeof(float));
+}
+
+int* make_random_int(size_t N, int V) {
+    int* arr = (int*)malloc(N * sizeof(int));
+    for (size_t i = 0; i < N; i++) {
+        arr[i] = rand() % V;
+    }
+    return arr;
+}
+
+// ----------------------------------------------------------------------------
+// checking and timing
+
+double wall_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void validate_result(float* ref, float* out, char* name, size_t N, float tolerance) {
+    for (size_t i = 0; i < N; i++) {
+        if (fabsf(out[i] - ref[i]) > tolerance || isnan(out[i])) {
+            printf("Mismatch of %s at %zu: %f vs %f\n", name, i, ref[i], out[i]);
+            exit(1);
+        }
+    }
+}
+
+void print_timing(const char* label, double elapsed_ms, double bytes, double flops) {
+    // napkin math: bytes is the minimum memory traffic of the kernel, flops its arithmetic
+    printf("%-34s | time %9.3f ms | %7.2f GB/s | %7.2f GFLOP/s\n",
+           label, elapsed_ms, bytes / elapsed_ms / 1e6, flops / elapsed_ms / 1e6);
+}
+
+// ----------------------------------------------------------------------------
+// the SIMD layer kernels of llmc/simd.h, by version number:
+// 1 = reference, 2 = avx2, 3 = avx512, 4 = neon
+
+LayerKernels layer_kernels_version(int kernel_num) {
+    LayerKernels reference = LAYER_KERNELS("reference", );
+    if (kernel_num == 1) { return reference; }
+#ifdef SIMD_HAVE_X86
+    if (kernel_num == 2 && simd_has_avx2()) { return (LayerKernels)LAYER_KERNELS("avx2", _avx2); }
+    if (kernel_num == 3 && simd_has_avx512()) { return (LayerKernels)LAYER_KERNELS("avx512", _avx512); }
+#endif
+#ifdef SIMD_HAVE_NEON
+    if (kernel_num == 4) { return (LayerKernels)LAYER_KERNELS("neon", _neon); }
+#endif
+    printf("Kernel %d is invalid or not supported on this CPU\n", kernel_num);
+    exit(1);
+}
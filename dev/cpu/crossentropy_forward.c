@@ -0,0 +1,107 @@
+/*
+CPU kernels for the classifier + crossentropy forward pass: the lm-head matmul with wte,
+the softmax over the vocabulary and the crossentropy loss.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/crossentropy_forward.c -lm -o crossentropy_forward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference chain of train_gpt2.c: matmul_forward, softmax_forward and
+crossentropy_forward, through the (B,T,V) logits and probs
+OMP_NUM_THREADS=8 ./crossentropy_forward 1
+
+version 2 is fused_classifier_forward, which runs an online softmax over chunks of the
+vocabulary and never materializes more than one block of logits
+OMP_NUM_THREADS=8 ./crossentropy_forward 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// kernel version dispatch
+
+void crossentropy_forward_version(int kernel_num,
+                                  float* losses, float* logits, float* probs, float* lse,
+                                  float* inp, float* wte, int* targets,
+                                  int B, int T, int C, int V) {
+    switch (kernel_num) {
+        case 1:
+            matmul_forward(logits, inp, wte, NULL, B, T, C, V);
+            softmax_forward(probs, logits, B, T, V);
+            crossentropy_forward(losses, probs, targets, B, T, V);
+            break;
+        case 2:
+            fused_classifier_forward(losses, lse, inp, wte, NULL, NULL, NULL, targets, B, T, C, V);
+            break;
+        default:
+            printf("Invalid kernel number\n");
+            exit(1);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 64;
+    int C = 768;
+    int V = 50257;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    printf("Using kernel %d\n", kernel_num);
+
+    float* inp = make_random_float((size_t)B * T * C);
+    float* wte = make_random_float((size_t)V * C);
+    for (size_t i = 0; i < (size_t)V * C; i++) { wte[i] *= 0.1f; } // keep the logits in a realistic range
+    int* targets = make_random_int(B * T, V);
+    float* logits = make_zeros_float((size_t)B * T * V);
+    float* probs = make_zeros_float((size_t)B * T * V);
+    float* lse = make_zeros_float(B * T);
+    float* losses = make_zeros_float(B * T);
+    float* losses_ref = make_zeros_float(B * T);
+
+    // first check the correctness of the kernel against the reference
+    crossentropy_forward_version(1, losses_ref, logits, probs, lse, inp, wte, targets, B, T, C, V);
+    crossentropy_forward_version(kernel_num, losses, logits, probs, lse, inp, wte, targets, B, T, C, V);
+    validate_result(losses_ref, losses, "losses", B * T, 1e-4f);
+
+    // time the kernel
+    int repeat_times = 2;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        crossentropy_forward_version(kernel_num, losses, logits, probs, lse, inp, wte, targets, B, T, C, V);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: the matmul dominates the flops. the reference also writes and reads back
+    // the logits and the probs, the fused version reads wte once per chunk of CLS_CHUNK_BT rows
+    double flops = 2.0 * B * T * V * C;
+    double bytes = (double)B * T * C * sizeof(float);
+    if (kernel_num == 1) {
+        bytes += (double)V * C * sizeof(float) + 4.0 * B * T * V * sizeof(float);
+    } else {
+        bytes += (double)((B * T + CLS_CHUNK_BT - 1) / CLS_CHUNK_BT) * V * C * sizeof(float);
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "classifier (BT=%d, C=%d, V=%d)", B * T, C, V);
+    print_timing(label, elapsed_ms, bytes, flops);
+
+    free(inp);
+    free(wte);
+    free(targets);
+    free(logits);
+    free(probs);
+    free(lse);
+    free(losses);
+    free(losses_ref);
+    printf("Results match!\n");
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+CPU kernels for the fused crossentropy + softmax backward pass.
+The reference comes from train_gpt2.c, the SIMD versions from llmc/simd_kernels.h.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/crossentropy_softmax_backward.c -lm -o crossentropy_softmax_backward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference loop over (b,t), crossentropy_softmax_backward
+OMP_NUM_THREADS=8 ./crossentropy_softmax_backward 1
+
+version 2, 3, 4 are the AVX2, AVX-512 and NEON versions
+OMP_NUM_THREADS=8 ./crossentropy_softmax_backward 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 64;
+    int V = 50257;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    LayerKernels k = layer_kernels_version(kernel_num);
+    printf("Using kernel %d (%s)\n", kernel_num, k.name);
+
+    size_t N = (size_t)B * T * V;
+    float* logits = make_random_float(N);
+    float* probs = make_zeros_float(N);
+    softmax_forward(probs, logits, B, T, V);
+    int* targets = make_random_int(B * T, V);
+    float* dlosses = make_random_float(B * T);
+    float* dlogits = make_zeros_float(N);
+    float* dlogits_ref = make_zeros_float(N);
+
+    // first check the correctness of the kernel against the reference
+    crossentropy_softmax_backward(dlogits_ref, dlosses, probs, targets, B, T, V);
+    k.crossentropy_softmax_backward(dlogits, dlosses, probs, targets, B, T, V);
+    validate_result(dlogits_ref, dlogits, "dlogits", N, 1e-6f);
+
+    // time the kernel
+    int repeat_times = 10;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        k.crossentropy_softmax_backward(dlogits, dlosses, probs, targets, B, T, V);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: read probs, write dlogits. a multiply per element
+    char label[64];
+    snprintf(label, sizeof(label), "crossentropy softmax backward (BT=%d, V=%d)", B * T, V);
+    print_timing(label, elapsed_ms, 2.0 * N * sizeof(float), 1.0 * N);
+
+    free(logits);
+    free(probs);
+    free(targets);
+    free(dlosses);
+    free(dlogits);
+    free(dlogits_ref);
+    printf("Results match!\n");
+    return 0;
+}
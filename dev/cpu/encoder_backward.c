@@ -0,0 +1,127 @@
+/*
+CPU kernels for the embedding table's part of a training step at small batch sizes:
+gpt2_zero_grad, the scatter of the gradient into wte and wpe (gpt2_encoder_backward)
+and gpt2_update, on a model that only has wte and wpe. All versions come from train_gpt2.c.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/encoder_backward.c -lm -o encoder_backward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the dense gradient of a tied wte: all of dwte is zeroed, encoder_backward
+scatters into it, and AdamW steps all V*C parameters
+OMP_NUM_THREADS=8 ./encoder_backward 1
+
+version 2 is the row-sparse gradient of untied embeddings (gpt2_untie_embeddings): only the
+rows of the batch are zeroed, scattered into by encoder_backward_rows, and stepped
+OMP_NUM_THREADS=8 ./encoder_backward 2
+
+the lm-head of a real model adds a dense (V,C) gradient and step to both, to wte in
+version 1 and to its own weight in version 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 4;
+    int T = 64;
+    int C = 768;
+    int V = 50257;
+    int steps = 5;
+    float learning_rate = 1e-3f, beta1 = 0.9f, beta2 = 0.999f, eps = 1e-8f;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    printf("Using kernel %d\n", kernel_num);
+    if (kernel_num < 1 || kernel_num > 2) {
+        printf("Invalid kernel number\n");
+        exit(1);
+    }
+    kernels_init();
+
+    // tokens from a small part of the vocabulary, so that rows repeat like in text
+    size_t VC = (size_t)V * C;
+    size_t N = VC + (size_t)T * C;
+    int* inp = make_random_int(B * T, 2000);
+    float* dout = make_random_float((size_t)B * T * C);
+    for (size_t i = 0; i < (size_t)B * T * C; i++) { dout[i] *= 0.01f; }
+    float* params = make_random_float(N);
+    float* params_ref = (float*)malloc(N * sizeof(float));
+    memcpy(params_ref, params, N * sizeof(float));
+    float* grads_ref = make_zeros_float(N);
+    float* m_ref = make_zeros_float(N);
+    float* v_ref = make_zeros_float(N);
+
+    // a model that only has its wte and wpe, with their gradients
+    GPT2 model;
+    memset(&model, 0, sizeof(GPT2));
+    model.config.vocab_size = V;
+    model.config.channels = C;
+    model.config.max_seq_len = T;
+    model.param_sizes[0] = VC;
+    model.param_sizes[1] = (size_t)T * C;
+    model.num_parameters = N;
+    model.params_memory = params;
+    point_parameters(&model.params, model.param_sizes, params);
+    model.grads_memory = make_zeros_float(N);
+    point_parameters(&model.grads, model.param_sizes, model.grads_memory);
+    model.optimizer_bits = 32;
+    model.batch_capacity = B;
+    model.seq_capacity = T;
+    model.inputs = inp;
+    model.untied_embeddings = kernel_num == 2;
+
+    // first check the correctness of the kernel against the reference, over a few steps
+    // without weight decay, the rows that no batch uses keep a zero gradient and zero
+    // moments, so their dense AdamW step is zero too and both versions agree
+    for (int t = 1; t <= steps; t++) {
+        memset(grads_ref, 0, N * sizeof(float));
+        encoder_backward(grads_ref, grads_ref + VC, dout, inp, B, T, C);
+        adamw_update(params_ref, grads_ref, m_ref, v_ref, N, learning_rate, beta1, beta2,
+                     1.0f - powf(beta1, t), 1.0f - powf(beta2, t), eps, 0.0f);
+        gpt2_zero_grad(&model);
+        gpt2_encoder_backward(&model, dout, B, T);
+        validate_result(grads_ref, model.grads_memory, "grads", N, 0.0f);
+        gpt2_update(&model, learning_rate, beta1, beta2, eps, 0.0f, t);
+    }
+    validate_result(params_ref, params, "params", N, 1e-6f);
+
+    // time the kernel
+    int repeat_times = 20;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        gpt2_zero_grad(&model);
+        gpt2_encoder_backward(&model, dout, B, T);
+        gpt2_update(&model, learning_rate, beta1, beta2, eps, 0.0f, steps + 1 + i);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: dout once, then for every parameter that is stepped a write of its gradient
+    // (zeroing), a read + write of it (the scatter), and the AdamW pass: read grads, read +
+    // write params, m and v. that is all of wte in version 1 and only its rows of the batch
+    // in version 2, and all of wpe in both
+    size_t stepped = kernel_num == 1 ? N : (size_t)model.num_wte_rows * C + (size_t)T * C;
+    double bytes = (double)B * T * C * sizeof(float) + (double)stepped * 10.0 * sizeof(float);
+    char label[64];
+    snprintf(label, sizeof(label), "embedding step (BT=%d, %d rows)", B * T, kernel_num == 1 ? V : model.num_wte_rows);
+    print_timing(label, elapsed_ms, bytes, 17.0 * stepped);
+
+    free(dout);
+    free(params_ref);
+    free(grads_ref);
+    free(m_ref);
+    free(v_ref);
+    model.inputs = NULL; // inp is freed here
+    free(inp);
+    gpt2_free(&model); // frees params, grads, the optimizer state and the row index
+    printf("Results match!\n");
+    return 0;
+}
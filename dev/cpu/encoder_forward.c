@@ -0,0 +1,116 @@
+/*
+CPU kernels for the encoder forward pass: the token + position embedding lookup.
+All versions come from train_gpt2.c.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/encoder_forward.c -lm -o encoder_forward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference, encoder_forward, reading rows of the (V,C) wte
+OMP_NUM_THREADS=8 ./encoder_forward 1
+
+version 2, 3, 4 are encoder_forward_packed, which reads the token embeddings out of a
+wte that was packed for the classifier matmul (inference without the original wte),
+in fp32, bf16 and int8 (group 64)
+OMP_NUM_THREADS=8 ./encoder_forward 2
+
+versions 3 and 4 change wte, so they are checked against the reference on the
+wte that they effectively use
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 1024;
+    int C = 768;
+    int V = 50257;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    printf("Using kernel %d\n", kernel_num);
+    if (kernel_num < 1 || kernel_num > 4) {
+        printf("Invalid kernel number\n");
+        exit(1);
+    }
+
+    float* wte = make_random_float((size_t)V * C);
+    float* wpe = make_random_float((size_t)T * C);
+    int* inp = make_random_int(B * T, V);
+    float* out = make_zeros_float((size_t)B * T * C);
+    float* out_ref = make_zeros_float((size_t)B * T * C);
+
+    // prepare wte in the layout of the version, like at model load
+    float* wte_ref = (float*)malloc((size_t)V * C * sizeof(float));
+    memcpy(wte_ref, wte, (size_t)V * C * sizeof(float));
+    float* wte_packed = NULL;
+    bf16* wte_bf16 = NULL;
+    QuantizedWeight wte_q;
+    char* wte_q_memory = NULL;
+    double wte_bytes_per_value = sizeof(float);
+    if (kernel_num == 2) {
+        wte_packed = (float*)malloc(gemm_packed_size(C, V) * sizeof(float));
+        gemm_prepack_b(wte_packed, wte, 1, C, C, V);
+    } else if (kernel_num == 3) {
+        wte_bf16 = (bf16*)malloc(gemm_packed_size(C, V) * sizeof(bf16));
+        gemm_prepack_b_bf16(wte_bf16, wte, 1, C, C, V);
+        for (size_t i = 0; i < (size_t)V * C; i++) { wte_ref[i] = bf16_to_float(float_to_bf16(wte[i])); }
+        wte_bytes_per_value = sizeof(bf16);
+    } else if (kernel_num == 4) {
+        wte_q_memory = (char*)malloc(quantized_weight_bytes(C, V, 8, 64));
+        quantized_weight_point(&wte_q, wte_q_memory, C, V, 8, 64);
+        quantize_weight(&wte_q, wte);
+        for (int v = 0; v < V; v++) {
+            for (int c = 0; c < C; c++) { wte_ref[(size_t)v * C + c] = quantized_weight_get(&wte_q, c, v); }
+        }
+        wte_bytes_per_value = 1.0 + sizeof(float) / 64.0;
+    }
+
+    // first check the correctness of the kernel against the reference
+    encoder_forward(out_ref, inp, wte_ref, wpe, B, T, C);
+    if (kernel_num == 1) {
+        encoder_forward(out, inp, wte, wpe, B, T, C);
+    } else {
+        encoder_forward_packed(out, inp, wte_packed, wte_bf16, wte_q_memory != NULL ? &wte_q : NULL, wpe, B, T, C);
+    }
+    validate_result(out_ref, out, "out", (size_t)B * T * C, 1e-6f);
+
+    // time the kernel
+    int repeat_times = 20;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        if (kernel_num == 1) {
+            encoder_forward(out, inp, wte, wpe, B, T, C);
+        } else {
+            encoder_forward_packed(out, inp, wte_packed, wte_bf16, wte_q_memory != NULL ? &wte_q : NULL, wpe, B, T, C);
+        }
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: one row of wte and of wpe per (b,t), and the output. an add per element
+    double bytes = (double)B * T * C * (wte_bytes_per_value + 2.0 * sizeof(float));
+    char label[64];
+    snprintf(label, sizeof(label), "encoder (BT=%d, C=%d)", B * T, C);
+    print_timing(label, elapsed_ms, bytes, (double)B * T * C);
+
+    free(wte);
+    free(wte_ref);
+    free(wpe);
+    free(inp);
+    free(out);
+    free(out_ref);
+    free(wte_packed);
+    free(wte_bf16);
+    free(wte_q_memory);
+    printf("Results match!\n");
+    return 0;
+}
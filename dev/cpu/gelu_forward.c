@@ -0,0 +1,84 @@
+/*
+CPU kernels for gelu forward and backward pass.
+The reference comes from train_gpt2.c, the SIMD versions from llmc/simd_kernels.h.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/gelu_forward.c -lm -o gelu_forward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference loop, gelu_forward / gelu_backward
+OMP_NUM_THREADS=8 ./gelu_forward 1
+
+version 2, 3, 4 are the AVX2, AVX-512 and NEON versions, with a polynomial tanh
+OMP_NUM_THREADS=8 ./gelu_forward 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 1024;
+    int C = 768;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    LayerKernels k = layer_kernels_version(kernel_num);
+    printf("Using kernel %d (%s)\n", kernel_num, k.name);
+
+    // the gelu of GPT-2 runs on the (B,T,4C) output of the fc matmul
+    size_t N = (size_t)B * T * 4 * C;
+    float* inp = make_random_float(N);
+    for (size_t i = 0; i < N; i++) { inp[i] *= 4.0f; } // cover the saturating range of tanh too
+    float* dout = make_random_float(N);
+    float* out = make_zeros_float(N);
+    float* out_ref = make_zeros_float(N);
+    float* dinp = make_zeros_float(N);
+    float* dinp_ref = make_zeros_float(N);
+
+    // first check the correctness of the kernels against the reference
+    gelu_forward(out_ref, inp, N);
+    k.gelu_forward(out, inp, N);
+    validate_result(out_ref, out, "out", N, 1e-5f);
+    gelu_backward(dinp_ref, inp, dout, N);
+    k.gelu_backward(dinp, inp, dout, N);
+    validate_result(dinp_ref, dinp, "dinp", N, 1e-5f);
+
+    // time the kernels
+    int repeat_times = 20;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        k.gelu_forward(out, inp, N);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+    char label[64];
+    snprintf(label, sizeof(label), "gelu forward (N=%zu)", N);
+    // napkin math: read inp, write out. about 10 flops per element, plus a tanh (counted as 1)
+    print_timing(label, elapsed_ms, 2.0 * N * sizeof(float), 11.0 * N);
+
+    start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        k.gelu_backward(dinp, inp, dout, N);
+    }
+    elapsed_ms = (wall_time_ms() - start) / repeat_times;
+    snprintf(label, sizeof(label), "gelu backward (N=%zu)", N);
+    // napkin math: read inp, dout, write dinp. about 20 flops per element
+    print_timing(label, elapsed_ms, 3.0 * N * sizeof(float), 20.0 * N);
+
+    free(inp);
+    free(dout);
+    free(out);
+    free(out_ref);
+    free(dinp);
+    free(dinp_ref);
+    printf("Results match!\n");
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+CPU kernels for layernorm backward pass.
+The reference comes from train_gpt2.c, the SIMD versions from llmc/simd_kernels.h.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/layernorm_backward.c -lm -o layernorm_backward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference loop over (b,t), layernorm_backward
+OMP_NUM_THREADS=8 ./layernorm_backward 1
+
+version 2, 3, 4 are the AVX2, AVX-512 and NEON versions
+OMP_NUM_THREADS=8 ./layernorm_backward 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 1024;
+    int C = 768;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    LayerKernels k = layer_kernels_version(kernel_num);
+    printf("Using kernel %d (%s)\n", kernel_num, k.name);
+
+    size_t N = (size_t)B * T * C;
+    float* inp = make_random_float(N);
+    float* weight = make_random_float(C);
+    float* bias = make_random_float(C);
+    float* dout = make_random_float(N);
+    float* out = make_zeros_float(N);
+    float* mean = make_zeros_float(B * T);
+    float* rstd = make_zeros_float(B * T);
+    float* dinp = make_zeros_float(N);
+    float* dweight = make_zeros_float(C);
+    float* dbias = make_zeros_float(C);
+    float* dinp_ref = make_zeros_float(N);
+    float* dweight_ref = make_zeros_float(C);
+    float* dbias_ref = make_zeros_float(C);
+    layernorm_forward(out, mean, rstd, inp, weight, bias, B, T, C);
+
+    // first check the correctness of the kernel against the reference
+    layernorm_backward(dinp_ref, dweight_ref, dbias_ref, dout, inp, weight, mean, rstd, B, T, C);
+    k.layernorm_backward(dinp, dweight, dbias, dout, inp, weight, mean, rstd, B, T, C);
+    validate_result(dinp_ref, dinp, "dinp", N, 1e-3f);
+    // dweight and dbias sum over all B*T rows, in a different order
+    validate_result(dweight_ref, dweight, "dweight", C, 1e-1f);
+    validate_result(dbias_ref, dbias, "dbias", C, 1e-1f);
+
+    // time the kernel (the gradients keep accumulating, which doesn't change the timing)
+    int repeat_times = 20;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        k.layernorm_backward(dinp, dweight, dbias, dout, inp, weight, mean, rstd, B, T, C);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: read dout, inp, read + write dinp. about 12 flops per element
+    double bytes = 4.0 * N * sizeof(float);
+    double flops = 12.0 * N;
+    char label[64];
+    snprintf(label, sizeof(label), "layernorm backward (BT=%d, C=%d)", B * T, C);
+    print_timing(label, elapsed_ms, bytes, flops);
+
+    free(inp);
+    free(weight);
+    free(bias);
+    free(dout);
+    free(out);
+    free(mean);
+    free(rstd);
+    free(dinp);
+    free(dweight);
+    free(dbias);
+    free(dinp_ref);
+    free(dweight_ref);
+    free(dbias_ref);
+    printf("Results match!\n");
+    return 0;
+}
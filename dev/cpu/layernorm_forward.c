@@ -0,0 +1,81 @@
+/*
+CPU kernels for layernorm forward pass.
+The reference comes from train_gpt2.c, the SIMD versions from llmc/simd_kernels.h.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/layernorm_forward.c -lm -o layernorm_forward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference loop over (b,t), layernorm_forward
+OMP_NUM_THREADS=8 ./layernorm_forward 1
+
+version 2, 3, 4 are the AVX2, AVX-512 and NEON versions, parallel over rows
+OMP_NUM_THREADS=8 ./layernorm_forward 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 1024;
+    int C = 768;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    LayerKernels k = layer_kernels_version(kernel_num);
+    printf("Using kernel %d (%s)\n", kernel_num, k.name);
+
+    size_t N = (size_t)B * T * C;
+    float* inp = make_random_float(N);
+    float* weight = make_random_float(C);
+    float* bias = make_random_float(C);
+    float* out = make_zeros_float(N);
+    float* mean = make_zeros_float(B * T);
+    float* rstd = make_zeros_float(B * T);
+    float* out_ref = make_zeros_float(N);
+    float* mean_ref = make_zeros_float(B * T);
+    float* rstd_ref = make_zeros_float(B * T);
+
+    // first check the correctness of the kernel against the reference
+    layernorm_forward(out_ref, mean_ref, rstd_ref, inp, weight, bias, B, T, C);
+    k.layernorm_forward(out, mean, rstd, inp, weight, bias, B, T, C);
+    validate_result(out_ref, out, "out", N, 1e-4f);
+    validate_result(mean_ref, mean, "mean", B * T, 1e-5f);
+    validate_result(rstd_ref, rstd, "rstd", B * T, 1e-4f);
+
+    // time the kernel
+    int repeat_times = 20;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        k.layernorm_forward(out, mean, rstd, inp, weight, bias, B, T, C);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: read inp, write out. about 8 flops per element (mean, variance, normalize, scale+shift)
+    double bytes = 2.0 * N * sizeof(float);
+    double flops = 8.0 * N;
+    char label[64];
+    snprintf(label, sizeof(label), "layernorm (BT=%d, C=%d)", B * T, C);
+    print_timing(label, elapsed_ms, bytes, flops);
+
+    free(inp);
+    free(weight);
+    free(bias);
+    free(out);
+    free(mean);
+    free(rstd);
+    free(out_ref);
+    free(mean_ref);
+    free(rstd_ref);
+    printf("Results match!\n");
+    return 0;
+}
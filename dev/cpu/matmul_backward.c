@@ -0,0 +1,109 @@
+/*
+CPU kernels for matmul backward pass.
+The reference (naive) loops and the GEMM-based version both come from train_gpt2.c.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/matmul_backward.c -lm -o matmul_backward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the naive loop: dinp over (b,t), then dweight/dbias over OC
+OMP_NUM_THREADS=8 ./matmul_backward 1
+
+version 2 is two blocked GEMMs plus a separate column reduction for dbias
+OMP_NUM_THREADS=8 ./matmul_backward 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// kernel version dispatch
+
+void matmul_backward_version(int kernel_num,
+                             float* dinp, float* dweight, float* dbias,
+                             float* dout, float* inp, float* weight,
+                             int B, int T, int C, int OC) {
+    switch (kernel_num) {
+        case 1:
+            matmul_backward_naive(dinp, dweight, dbias, dout, inp, weight, B, T, C, OC);
+            break;
+        case 2:
+            matmul_backward(dinp, dweight, dbias, dout, inp, weight, B, T, C, OC);
+            break;
+        default:
+            printf("Invalid kernel number\n");
+            exit(1);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 64;
+    int C = 768;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    printf("Using kernel %d\n", kernel_num);
+
+    // the four per-layer matmuls of GPT-2
+    int OCs[] = {3*C, C, 4*C, C};
+    int Cs[] = {C, C, C, 4*C};
+    char* names[] = {"qkv", "attproj", "fc", "fcproj"};
+
+    for (int s = 0; s < (int)(sizeof(OCs) / sizeof(OCs[0])); s++) {
+        int OC = OCs[s];
+        int IC = Cs[s];
+        float* inp = make_random_float(B * T * IC);
+        float* weight = make_random_float(OC * IC);
+        float* dout = make_random_float(B * T * OC);
+        float* dinp = make_zeros_float(B * T * IC);
+        float* dweight = make_zeros_float(OC * IC);
+        float* dbias = make_zeros_float(OC);
+        float* dinp_ref = make_zeros_float(B * T * IC);
+        float* dweight_ref = make_zeros_float(OC * IC);
+        float* dbias_ref = make_zeros_float(OC);
+
+        // first check the correctness of the kernel against the reference
+        matmul_backward_naive(dinp_ref, dweight_ref, dbias_ref, dout, inp, weight, B, T, IC, OC);
+        matmul_backward_version(kernel_num, dinp, dweight, dbias, dout, inp, weight, B, T, IC, OC);
+        validate_result(dinp_ref, dinp, "dinp", B * T * IC, 1e-2f);
+        validate_result(dweight_ref, dweight, "dweight", OC * IC, 1e-2f);
+        validate_result(dbias_ref, dbias, "dbias", OC, 1e-2f);
+
+        // time the kernel
+        int repeat_times = 5;
+        double start = wall_time_ms();
+        for (int i = 0; i < repeat_times; i++) {
+            matmul_backward_version(kernel_num, dinp, dweight, dbias, dout, inp, weight, B, T, IC, OC);
+        }
+        double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+        // napkin math: two GEMMs of a multiply-add per (b,t,oc,c). reads dout, inp and weight,
+        // writes dinp, and reads + writes the accumulated dweight and dbias
+        double flops = 4.0 * B * T * OC * IC;
+        double bytes = ((double)B * T * OC + 2.0 * B * T * IC + 3.0 * OC * IC + 2.0 * OC) * sizeof(float);
+        char label[64];
+        snprintf(label, sizeof(label), "%s (BT=%d, C=%d, OC=%d)", names[s], B * T, IC, OC);
+        print_timing(label, elapsed_ms, bytes, flops);
+
+        free(inp);
+        free(weight);
+        free(dout);
+        free(dinp);
+        free(dweight);
+        free(dbias);
+        free(dinp_ref);
+        free(dweight_ref);
+        free(dbias_ref);
+    }
+    printf("Results match!\n");
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+CPU kernels for matmul forward pass.
+The reference (naive) loop and the blocked GEMM engine both come from train_gpt2.c.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/matmul_forward.c -lm -o matmul_forward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the naive (b,t) x OC x C triple loop, matmul_forward_naive
+OMP_NUM_THREADS=8 ./matmul_forward 1
+
+version 2 is the cache-blocked, register-tiled GEMM that train_gpt2.c uses
+OMP_NUM_THREADS=8 ./matmul_forward 2
+
+version 3 is the GEMM on a weight that was pre-packed at load (gpt2_pack_weights)
+OMP_NUM_THREADS=8 ./matmul_forward 3
+
+version 4 is the GEMM on a pre-packed bf16 weight (mixed precision)
+OMP_NUM_THREADS=8 ./matmul_forward 4
+
+version 5 and 6 are the GEMM on a weight-only quantized int8 (group 64) / int4 (group 32) weight
+OMP_NUM_THREADS=8 ./matmul_forward 5
+
+versions 4-6 change the weight, so they are checked against the naive loop on the
+weight that they effectively use (rounded to bf16, or dequantized)
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// the weight in the layout of every version, prepared once like at model load
+
+typedef struct {
+    float* packed;
+    bf16* packed_bf16;
+    QuantizedWeight quantized;
+    char* quantized_memory;
+    size_t weight_bytes; // what the kernel reads of the weight per call
+} PreparedWeight;
+
+PreparedWeight prepare_weight(int kernel_num, float* weight, float* weight_ref, int C, int OC) {
+    // weight_ref receives the weight that the version effectively multiplies with
+    PreparedWeight p;
+    memset(&p, 0, sizeof(p));
+    memcpy(weight_ref, weight, (size_t)OC * C * sizeof(float));
+    p.weight_bytes = (size_t)OC * C * sizeof(float);
+    if (kernel_num == 3) {
+        p.packed = (float*)malloc(gemm_packed_size(C, OC) * sizeof(float));
+        gemm_prepack_b(p.packed, weight, 1, C, C, OC);
+    } else if (kernel_num == 4) {
+        p.packed_bf16 = (bf16*)malloc(gemm_packed_size(C, OC) * sizeof(bf16));
+        gemm_prepack_b_bf16(p.packed_bf16, weight, 1, C, C, OC);
+        for (size_t i = 0; i < (size_t)OC * C; i++) { weight_ref[i] = bf16_to_float(float_to_bf16(weight[i])); }
+        p.weight_bytes /= 2;
+    } else if (kernel_num == 5 || kernel_num == 6) {
+        int bits = kernel_num == 5 ? 8 : 4;
+        int group_size = kernel_num == 5 ? 64 : 32;
+        p.quantized_memory = (char*)malloc(quantized_weight_bytes(C, OC, bits, group_size));
+        quantized_weight_point(&p.quantized, p.quantized_memory, C, OC, bits, group_size);
+        quantize_weight(&p.quantized, weight);
+        for (int o = 0; o < OC; o++) {
+            for (int c = 0; c < C; c++) { weight_ref[(size_t)o * C + c] = quantized_weight_get(&p.quantized, c, o); }
+        }
+        p.weight_bytes = quantized_weight_bytes(C, OC, bits, group_size);
+    }
+    return p;
+}
+
+void free_prepared_weight(PreparedWeight* p) {
+    free(p->packed);
+    free(p->packed_bf16);
+    free(p->quantized_memory);
+}
+
+// ----------------------------------------------------------------------------
+// kernel version dispatch
+
+void matmul_forward_version(int kernel_num,
+                            float* out, float* inp, float* weight, PreparedWeight* prepared, float* bias,
+                            int B, int T, int C, int OC) {
+    switch (kernel_num) {
+        case 1:
+            matmul_forward_naive(out, inp, weight, bias, B, T, C, OC);
+            break;
+        case 2:
+            matmul_forward(out, inp, weight, bias, B, T, C, OC);
+            break;
+        case 3:
+        case 4:
+        case 5:
+        case 6:
+            matmul_forward_packed(out, inp, weight, prepared->packed, prepared->packed_bf16,
+                                  prepared->quantized_memory != NULL ? &prepared->quantized : NULL, bias, B, T, C, OC);
+            break;
+        default:
+            printf("Invalid kernel number\n");
+            exit(1);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 64;
+    int C = 768;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    printf("Using kernel %d\n", kernel_num);
+
+    // the four per-layer matmuls of GPT-2, and the classifier
+    int OCs[] = {3*C, C, 4*C, C, 50257};
+    int Cs[] = {C, C, C, 4*C, C};
+    char* names[] = {"qkv", "attproj", "fc", "fcproj", "wte"};
+
+    for (int s = 0; s < (int)(sizeof(OCs) / sizeof(OCs[0])); s++) {
+        int OC = OCs[s];
+        int IC = Cs[s];
+        float* inp = make_random_float((size_t)B * T * IC);
+        float* weight = make_random_float((size_t)OC * IC);
+        float* weight_ref = (float*)malloc((size_t)OC * IC * sizeof(float));
+        float* bias = make_random_float(OC);
+        float* out = (float*)malloc((size_t)B * T * OC * sizeof(float));
+        float* out_ref = (float*)malloc((size_t)B * T * OC * sizeof(float));
+        PreparedWeight prepared = prepare_weight(kernel_num, weight, weight_ref, IC, OC);
+
+        // first check the correctness of the kernel against the reference
+        matmul_forward_naive(out_ref, inp, weight_ref, bias, B, T, IC, OC);
+        matmul_forward_version(kernel_num, out, inp, weight, &prepared, bias, B, T, IC, OC);
+        validate_result(out_ref, out, names[s], (size_t)B * T * OC, 1e-3f);
+
+        // time the kernel
+        int repeat_times = OC > 4*C ? 1 : 10;
+        double start = wall_time_ms();
+        for (int i = 0; i < repeat_times; i++) {
+            matmul_forward_version(kernel_num, out, inp, weight, &prepared, bias, B, T, IC, OC);
+        }
+        double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+        // napkin math: a multiply-add per (b,t,oc,c), and every input, weight and output once
+        double flops = 2.0 * B * T * OC * IC;
+        double bytes = (double)B * T * (IC + OC) * sizeof(float) + prepared.weight_bytes;
+        char label[64];
+        snprintf(label, sizeof(label), "%s (BT=%d, C=%d, OC=%d)", names[s], B * T, IC, OC);
+        print_timing(label, elapsed_ms, bytes, flops);
+
+        free_prepared_weight(&prepared);
+        free(inp);
+        free(weight);
+        free(weight_ref);
+        free(bias);
+        free(out);
+        free(out_ref);
+    }
+    printf("Results match!\n");
+    return 0;
+}
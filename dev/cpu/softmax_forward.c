@@ -0,0 +1,67 @@
+/*
+CPU kernels for softmax forward pass (of the classifier, over the vocabulary).
+The reference comes from train_gpt2.c, the SIMD versions from llmc/simd_kernels.h.
+
+Compile example (from the root of the repo):
+gcc -O3 -Ofast -fno-fast-math -fopenmp -DOMP dev/cpu/softmax_forward.c -lm -o softmax_forward
+or build all of dev/cpu with: make dev_cpu
+
+version 1 is the reference loop over (b,t), softmax_forward
+OMP_NUM_THREADS=8 ./softmax_forward 1
+
+version 2, 3, 4 are the AVX2, AVX-512 and NEON versions, with a polynomial exp
+OMP_NUM_THREADS=8 ./softmax_forward 2
+*/
+
+#define TESTING
+#include "../../train_gpt2.c"
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    srand(0);
+
+    int B = 8;
+    int T = 64;
+    int V = 50257;
+
+    // read kernel_num from command line
+    int kernel_num = 2;
+    if (argc > 1) {
+        kernel_num = atoi(argv[1]);
+    }
+    LayerKernels k = layer_kernels_version(kernel_num);
+    printf("Using kernel %d (%s)\n", kernel_num, k.name);
+
+    size_t N = (size_t)B * T * V;
+    float* logits = make_random_float(N);
+    for (size_t i = 0; i < N; i++) { logits[i] *= 10.0f; }
+    float* probs = make_zeros_float(N);
+    float* probs_ref = make_zeros_float(N);
+
+    // first check the correctness of the kernel against the reference
+    softmax_forward(probs_ref, logits, B, T, V);
+    k.softmax_forward(probs, logits, B, T, V);
+    validate_result(probs_ref, probs, "probs", N, 1e-6f);
+
+    // time the kernel
+    int repeat_times = 10;
+    double start = wall_time_ms();
+    for (int i = 0; i < repeat_times; i++) {
+        k.softmax_forward(probs, logits, B, T, V);
+    }
+    double elapsed_ms = (wall_time_ms() - start) / repeat_times;
+
+    // napkin math: read logits (twice, but the second time mostly from cache), write probs.
+    // max, exp (counted as 1), sum and the normalization: about 4 flops per element
+    char label[64];
+    snprintf(label, sizeof(label), "softmax (BT=%d, V=%d)", B * T, V);
+    print_timing(label, elapsed_ms, 2.0 * N * sizeof(float), 4.0 * N);
+
+    free(logits);
+    free(probs);
+    free(probs_ref);
+    printf("Results match!\n");
+    return 0;
+}
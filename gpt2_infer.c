@@ -0,0 +1,179 @@
+/*
+Inference only GPT-2: scores the val split and samples from the model, and nothing else.
+It compiles train_gpt2.c with -DINFERENCE_ONLY, which leaves out the backward pass, the
+gradients and the optimizer state, and runs every model in the fixed inference arena:
+no layer activations beyond one layer's, no layernorm statistics, and the gelu in place.
+The checkpoint is mapped rather than read by default, so the model starts without copying
+the weights. With -d, a smaller checkpoint drafts the sampled tokens, which the model then
+checks several at a time (speculative decoding); the tokens follow the same distribution.
+
+Example:
+./gpt2_infer -i gpt2_124M.bin -e 10 -n 64
+./gpt2_infer -i gpt2_350M.bin -d gpt2_124M.bin -g 4 -n 128
+*/
+#define TESTING
+#define INFERENCE_ONLY
+#include "train_gpt2.c"
+#include <sys/resource.h>
+
+void error_usage() {
+    fprintf(stderr, "Usage:   ./gpt2_infer [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -i <string> checkpoint, fp32 or quantized (default = gpt2_124M.bin)\n");
+    fprintf(stderr, "  -m <int>    checkpoint: 0 = read, 1 = mmap, 2 = mmap and populate (default = 1)\n");
+    fprintf(stderr, "  -a <int>    attention: 0 = reference, 1 = flash (default = 1)\n");
+    fprintf(stderr, "  -c <int>    classifier: 0 = reference, 1 = fused (default = 1)\n");
+    fprintf(stderr, "  -p <int>    keep only pre-packed copies of the matmul weights (default = 0)\n");
+    fprintf(stderr, "  -e <int>    number of val batches to score, 0 = none (default = 0)\n");
+    fprintf(stderr, "  -b <int>    batch size of the scoring (default = 4)\n");
+    fprintf(stderr, "  -t <int>    sequence length of the scoring (default = 64)\n");
+    fprintf(stderr, "  -n <int>    number of tokens to generate (default = 64)\n");
+    fprintf(stderr, "  -k <int>    generation: 0 = recompute the prefix, 1 = KV cache (default = 1)\n");
+    fprintf(stderr, "  -d <string> draft checkpoint for speculative decoding, with the same vocabulary (default = none)\n");
+    fprintf(stderr, "  -g <int>    tokens the draft proposes per step (default = 4)\n");
+    fprintf(stderr, "  -s <int>    random seed of the sampling (default = 1337)\n");
+    exit(EXIT_FAILURE);
+}
+
+double elapsed_ms(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+
+    char* checkpoint_path = "gpt2_124M.bin";
+    int checkpoint_load = CHECKPOINT_MMAP;
+    int flash_attention = 1;
+    int fused_classifier = 1;
+    int packed_only = 0;
+    int eval_batches = 0;
+    int B = 4;
+    int T = 64;
+    int gen_tokens_count = 64;
+    int kv_cache = 1;
+    char* draft_path = NULL;
+    int draft_tokens = 4;
+    unsigned long long rng_state = 1337;
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        if (argv[i][0] != '-' || strlen(argv[i]) != 2) { error_usage(); } // must be -x
+        if (argv[i][1] == 'i') { checkpoint_path = argv[i+1]; }
+        else if (argv[i][1] == 'm') { checkpoint_load = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'a') { flash_attention = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'c') { fused_classifier = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'p') { packed_only = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'e') { eval_batches = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'b') { B = atoi(argv[i+1]); }
+        else if (argv[i][1] == 't') { T = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'n') { gen_tokens_count = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'k') { kv_cache = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'd') { draft_path = argv[i+1]; }
+        else if (argv[i][1] == 'g') { draft_tokens = atoi(argv[i+1]); }
+        else if (argv[i][1] == 's') { rng_state = strtoull(argv[i+1], NULL, 10); }
+        else { error_usage(); }
+    }
+
+    // build the model, which in this build is always inference only
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    GPT2 model;
+    gpt2_build_from_checkpoint_mmap(&model, checkpoint_path, checkpoint_load);
+    model.flash_attention = flash_attention;
+    model.fused_classifier = fused_classifier;
+    if (packed_only) { gpt2_drop_unpacked_weights(&model); }
+    GPT2 draft;
+    if (draft_path != NULL) {
+        gpt2_build_from_checkpoint_mmap(&draft, draft_path, checkpoint_load);
+        draft.flash_attention = flash_attention;
+        draft.fused_classifier = fused_classifier;
+        if (packed_only) { gpt2_drop_unpacked_weights(&draft); }
+    }
+    printf("load: %.1f ms\n", elapsed_ms(&start));
+    int V = model.config.vocab_size;
+    int maxT = model.config.max_seq_len;
+    if (T > maxT || gen_tokens_count > maxT) {
+        printf("Error: sequences are at most %d tokens long\n", maxT);
+        exit(1);
+    }
+
+    // score the val split, with the same data as train_gpt2
+    if (eval_batches > 0) {
+        char* tiny_shakespeare_val = "data/tiny_shakespeare_val.bin";
+        char* tiny_stories_val = "data/TinyStories_val.bin";
+        char* val_tokens = access(tiny_shakespeare_val, F_OK) != -1 ? tiny_shakespeare_val : tiny_stories_val;
+        DataLoader val_loader;
+        dataloader_init(&val_loader, val_tokens, B, T);
+        if (eval_batches > val_loader.num_batches) { eval_batches = val_loader.num_batches; }
+        double loss = 0.0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < eval_batches; i++) {
+            dataloader_next_batch(&val_loader);
+            gpt2_forward(&model, val_loader.inputs, val_loader.targets, B, T);
+            loss += model.mean_loss;
+        }
+        double ms = elapsed_ms(&start);
+        loss /= eval_batches;
+        printf("val loss %f, perplexity %.3f, %.1f tokens/s\n", loss, exp(loss), eval_batches * B * T / ms * 1e3);
+        dataloader_free(&val_loader);
+    }
+
+    // sample from the model, forwarding only the newest token through the KV cache, or
+    // recomputing all the activations of the prefix for every token
+    if (gen_tokens_count > 0 && draft_path == NULL) {
+        int* gen_tokens = (int*)malloc(gen_tokens_count * sizeof(int));
+        gen_tokens[0] = GPT2_EOT; // the GPT-2 EOT token kicks off the generation
+        KVCache cache;
+        if (kv_cache) { kv_cache_init(&cache, &model, gen_tokens_count); }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 1; t < gen_tokens_count; t++) {
+            float* probs;
+            if (kv_cache) {
+                probs = gpt2_decode(&model, &cache, gen_tokens + t - 1, 1);
+            } else {
+                gpt2_forward(&model, gen_tokens, NULL, 1, t);
+                // the fused classifier only produces the probabilities of the last position
+                probs = model.fused_classifier ? model.acts.probs : model.acts.probs + (t-1) * V;
+            }
+            gen_tokens[t] = sample_mult(probs, V, random_f32(&rng_state));
+        }
+        double ms = elapsed_ms(&start);
+        if (kv_cache) { kv_cache_free(&cache); }
+        printf("generated: ");
+        for (int t = 0; t < gen_tokens_count; t++) { printf("%d ", gen_tokens[t]); }
+        printf("\n");
+        printf("generation: %.1f ms per token\n", ms / (gen_tokens_count > 1 ? gen_tokens_count - 1 : 1));
+        free(gen_tokens);
+    }
+
+    // or let the draft model propose the tokens, and the model check them -g at a time
+    if (gen_tokens_count > 0 && draft_path != NULL) {
+        int* gen_tokens = (int*)malloc(gen_tokens_count * sizeof(int));
+        gen_tokens[0] = GPT2_EOT;
+        Speculator sp;
+        speculator_init(&sp, &model, &draft, draft_tokens, gen_tokens_count);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 1; t < gen_tokens_count; ) {
+            t += speculator_step(&sp, gen_tokens, t, gen_tokens_count - t, &rng_state);
+        }
+        double ms = elapsed_ms(&start);
+        printf("generated: ");
+        for (int t = 0; t < gen_tokens_count; t++) { printf("%d ", gen_tokens[t]); }
+        printf("\n");
+        printf("generation: %.1f ms per token, %lld steps, %.1f%% of %lld drafted tokens accepted\n",
+               ms / (gen_tokens_count > 1 ? gen_tokens_count - 1 : 1), sp.steps,
+               sp.drafted > 0 ? 100.0 * sp.accepted / sp.drafted : 0.0, sp.drafted);
+        speculator_free(&sp);
+        free(gen_tokens);
+    }
+
+    // the resident set at its largest, i.e. the weights that were touched plus the arena
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak memory: %.1f MiB\n", usage.ru_maxrss / 1024.0);
+
+    if (draft_path != NULL) { gpt2_free(&draft); }
+    gpt2_free(&model);
+    return 0;
+}
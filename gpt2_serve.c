@@ -0,0 +1,435 @@
+/*
+Generation server: loads the weights once and then serves generation requests, with
+continuous batching. Every decoding step forwards the next token of all the sequences in
+flight through one gpt2_decode_batch, so the weights are read once per step for all of
+them instead of once per sequence. A finished sequence leaves the batch right after its
+last token, and a new request joins at the next step, with the prefill of its prompt.
+
+Requests come from a Unix domain socket, or from stdin when no socket is given (for tests
+and scripts). Both take one request per line:
+<max_new_tokens> <token> <token> ...
+which is the number of tokens to generate and the token ids of the prompt (an empty prompt
+starts from the GPT-2 EOT token). Every request is answered with one line:
+<request> <token> <token> ...
+with the generated tokens, where <request> numbers the requests of the connection from 0.
+The answers come in the order the requests finish. Generation stops early at the EOT token
+or at -t tokens. Every request samples with its own
+random_f32 state, seeded from -s and the order the requests arrived in, so it generates
+the same tokens however it gets batched with other requests.
+
+Requests that begin with the same tokens share the keys and values of them: the full KV
+blocks of every prompt and finished sequence go into a PrefixCache (-c blocks, the least
+recently used ones are evicted), and a new request starts from the longest prefix of its
+prompt that is cached there. The hits, the reused tokens and the estimated prefill time
+saved are printed at the end.
+
+Example:
+./gpt2_serve -i gpt2_124M.bin -l /tmp/gpt2.sock &
+printf '32 50256\n' | nc -U /tmp/gpt2.sock
+printf '32 50256\n16 464 2068\n' | ./gpt2_serve -i gpt2_124M.bin
+*/
+#define TESTING
+#define INFERENCE_ONLY
+#include "train_gpt2.c"
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVE_MAX_CONNECTIONS 64
+#define SERVE_LINE_BYTES 65536
+
+typedef struct {
+    int in_fd; // stdin, or the client socket
+    int out_fd; // the answers: stdout, or the same client socket
+    char line[SERVE_LINE_BYTES]; // the bytes read so far of the next request
+    int line_bytes;
+    int num_requests; // the requests read from this connection, which numbers them
+    int open; // 0 once the client hung up or stdin ended
+    int in_flight; // its requests that are queued or generating
+} Connection;
+
+typedef struct {
+    Connection* conn;
+    int id; // the number of the request on its connection
+    int* tokens; // the prompt, followed by the generated tokens
+    int num_prompt;
+    int num_tokens;
+    int max_tokens; // num_prompt + the max_new_tokens of the request, at most the cache capacity
+    unsigned long long rng_state;
+    int slot; // the KV cache of the sequence while it generates
+    int prefilled; // 1 once its prompt is in the KV cache (and in the prefix cache)
+} Request;
+
+Connection connections[SERVE_MAX_CONNECTIONS];
+volatile sig_atomic_t serve_stop = 0;
+
+void serve_signal(int sig) { (void)sig; serve_stop = 1; }
+
+void error_usage() {
+    fprintf(stderr, "Usage:   ./gpt2_serve [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -i <string> checkpoint, fp32 or quantized (default = gpt2_124M.bin)\n");
+    fprintf(stderr, "  -m <int>    checkpoint: 0 = read, 1 = mmap, 2 = mmap and populate (default = 1)\n");
+    fprintf(stderr, "  -p <int>    keep only pre-packed copies of the matmul weights (default = 0)\n");
+    fprintf(stderr, "  -l <string> listen on this Unix domain socket (default = serve stdin)\n");
+    fprintf(stderr, "  -b <int>    most sequences generating at the same time (default = 16)\n");
+    fprintf(stderr, "  -t <int>    most tokens of a sequence, prompt included (default = max_seq_len)\n");
+    fprintf(stderr, "  -c <int>    KV blocks that the prefix cache keeps, 0 = off (default = 256)\n");
+    fprintf(stderr, "  -s <int>    random seed of the sampling (default = 1337)\n");
+    exit(EXIT_FAILURE);
+}
+
+double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+Connection* connection_open(int in_fd, int out_fd) {
+    for (int i = 0; i < SERVE_MAX_CONNECTIONS; i++) {
+        Connection* conn = &connections[i];
+        if (conn->in_fd >= 0) { continue; } // in use, or its answers are still pending
+        conn->in_fd = in_fd;
+        conn->out_fd = out_fd;
+        conn->line_bytes = 0;
+        conn->num_requests = 0;
+        conn->open = 1;
+        return conn;
+    }
+    return NULL;
+}
+
+void connection_release(Connection* conn) {
+    // a socket is closed once the client hung up and all of its answers are out
+    if (conn->open || conn->in_flight > 0 || conn->in_fd < 0) { return; }
+    if (conn->in_fd != STDIN_FILENO) { close(conn->in_fd); }
+    conn->in_fd = -1;
+}
+
+void connection_write(Connection* conn, const char* text, size_t bytes) {
+    // answers to a client that hung up are dropped (SIGPIPE is ignored, write fails)
+    while (bytes > 0) {
+        ssize_t n = write(conn->out_fd, text, bytes);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return; }
+        text += n;
+        bytes -= n;
+    }
+}
+
+void request_answer(Request* req, const char* error) {
+    // one line: the request number and either its generated tokens or the error
+    size_t capacity = 32 + 12 * (size_t)(req->num_tokens - req->num_prompt) + (error ? strlen(error) : 0);
+    char* text = (char*)malloc(capacity);
+    size_t bytes = snprintf(text, capacity, "%d", req->id);
+    if (error != NULL) {
+        bytes += snprintf(text + bytes, capacity - bytes, " error: %s", error);
+    } else {
+        for (int t = req->num_prompt; t < req->num_tokens; t++) {
+            bytes += snprintf(text + bytes, capacity - bytes, " %d", req->tokens[t]);
+        }
+    }
+    text[bytes++] = '\n';
+    connection_write(req->conn, text, bytes);
+    free(text);
+}
+
+int request_parse(Request* req, char* line, int max_tokens, int vocab_size) {
+    // "<max_new_tokens> <token> <token> ...", returns 0 and answers the error if it is malformed
+    req->num_prompt = 0;
+    req->num_tokens = 0;
+    char* end;
+    long max_new = strtol(line, &end, 10);
+    if (end == line || max_new <= 0) { request_answer(req, "expected <max_new_tokens> <token> ..."); return 0; }
+    req->tokens = (int*)malloc(max_tokens * sizeof(int));
+    for (char* p = end; ; p = end) {
+        long token = strtol(p, &end, 10);
+        if (end == p) { break; }
+        if (token < 0 || token >= vocab_size) { request_answer(req, "token out of range"); free(req->tokens); return 0; }
+        if (req->num_prompt == max_tokens) { request_answer(req, "prompt too long"); free(req->tokens); return 0; }
+        req->tokens[req->num_prompt++] = (int)token;
+    }
+    while (*end == ' ' || *end == '\t' || *end == '\r') { end++; }
+    if (*end != '\0') { request_answer(req, "expected <max_new_tokens> <token> ..."); free(req->tokens); return 0; }
+    if (req->num_prompt == 0 && GPT2_EOT < vocab_size) { req->tokens[req->num_prompt++] = GPT2_EOT; }
+    if (req->num_prompt == 0) { request_answer(req, "empty prompt"); free(req->tokens); return 0; }
+    req->num_tokens = req->num_prompt;
+    req->max_tokens = max_new < max_tokens - req->num_prompt ? req->num_prompt + (int)max_new : max_tokens;
+    if (req->num_tokens == req->max_tokens) { request_answer(req, "prompt too long"); free(req->tokens); return 0; }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+
+    char* checkpoint_path = "gpt2_124M.bin";
+    int checkpoint_load = CHECKPOINT_MMAP;
+    int packed_only = 0;
+    char* socket_path = NULL;
+    int max_batch = 16;
+    int max_tokens = 0;
+    int prefix_blocks = 256;
+    unsigned long long seed = 1337;
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        if (argv[i][0] != '-' || strlen(argv[i]) != 2) { error_usage(); } // must be -x
+        if (argv[i][1] == 'i') { checkpoint_path = argv[i+1]; }
+        else if (argv[i][1] == 'm') { checkpoint_load = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'p') { packed_only = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'l') { socket_path = argv[i+1]; }
+        else if (argv[i][1] == 'b') { max_batch = atoi(argv[i+1]); }
+        else if (argv[i][1] == 't') { max_tokens = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'c') { prefix_blocks = atoi(argv[i+1]); }
+        else if (argv[i][1] == 's') { seed = strtoull(argv[i+1], NULL, 10); }
+        else { error_usage(); }
+    }
+    if (max_batch <= 0) { error_usage(); }
+
+    // the answers go to stdout, so everything else that prints goes to stderr
+    int answer_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, serve_signal);
+    signal(SIGTERM, serve_signal);
+
+    // build the model, once
+    GPT2 model;
+    gpt2_build_from_checkpoint_mmap(&model, checkpoint_path, checkpoint_load);
+    if (packed_only) { gpt2_drop_unpacked_weights(&model); }
+    int V = model.config.vocab_size;
+    int maxT = model.config.max_seq_len;
+    if (max_tokens <= 0 || max_tokens > maxT) { max_tokens = maxT; }
+
+    // a KV cache for every sequence that can generate at the same time. they take blocks
+    // from the pool of the model as their sequences grow, and give them back when they finish
+    KVCache* slots = (KVCache*)malloc(max_batch * sizeof(KVCache));
+    int* slot_free = (int*)malloc(max_batch * sizeof(int));
+    for (int i = 0; i < max_batch; i++) {
+        kv_cache_init(&slots[i], &model, max_tokens);
+        slot_free[i] = 1;
+    }
+    // the KV blocks of earlier prompts and sequences, to start from their common prefixes
+    PrefixCache prefix_cache;
+    prefix_cache_init(&prefix_cache, &model, prefix_blocks);
+    // the requests that generate (batch) and those that wait for a slot (queue, in order)
+    Request* batch = (Request*)malloc(max_batch * sizeof(Request));
+    int batch_size = 0;
+    int queue_capacity = 64, queue_head = 0, queue_size = 0;
+    Request* queue = (Request*)malloc(queue_capacity * sizeof(Request));
+    // the inputs of a decoding step
+    KVCache** step_caches = (KVCache**)malloc(max_batch * sizeof(KVCache*));
+    int* step_tokens = (int*)malloc((size_t)max_batch * max_tokens * sizeof(int));
+    int* step_counts = (int*)malloc(max_batch * sizeof(int));
+
+    // where the requests come from
+    int listen_fd = -1;
+    for (int i = 0; i < SERVE_MAX_CONNECTIONS; i++) { connections[i].in_fd = -1; }
+    if (socket_path != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) { printf("Error: socket path too long\n"); exit(1); }
+        strcpy(addr.sun_path, socket_path);
+        unlink(socket_path);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+            printf("Error: can't listen on %s\n", socket_path);
+            exit(1);
+        }
+        printf("serving %s, up to %d sequences of %d tokens\n", socket_path, max_batch, max_tokens);
+    } else {
+        connection_open(STDIN_FILENO, answer_fd);
+        printf("serving stdin, up to %d sequences of %d tokens\n", max_batch, max_tokens);
+    }
+
+    // counters, reported at the end
+    int num_served = 0, num_steps = 0;
+    long long num_generated = 0, num_rows = 0, num_sequences = 0;
+    double busy_ms = 0.0;
+    // a least squares fit of the step time to a + b * rows, whose b is the cost of another
+    // forwarded row: the prefill that a reused token saves
+    double fit_x = 0.0, fit_y = 0.0, fit_xx = 0.0, fit_xy = 0.0;
+    int num_requests = 0; // over all connections, for the seeds
+
+    while (!serve_stop) {
+        // 1) read what arrived. without sequences to generate, wait for it
+        struct pollfd fds[SERVE_MAX_CONNECTIONS + 1];
+        Connection* fd_conns[SERVE_MAX_CONNECTIONS + 1];
+        int num_fds = 0, num_open = 0;
+        if (listen_fd >= 0) { fds[num_fds] = (struct pollfd){ listen_fd, POLLIN, 0 }; fd_conns[num_fds++] = NULL; }
+        for (int i = 0; i < SERVE_MAX_CONNECTIONS; i++) {
+            if (!connections[i].open) { continue; }
+            num_open++;
+            fds[num_fds] = (struct pollfd){ connections[i].in_fd, POLLIN, 0 };
+            fd_conns[num_fds++] = &connections[i];
+        }
+        if (listen_fd < 0 && num_open == 0 && batch_size == 0 && queue_size == 0) { break; } // stdin is done
+        int busy = batch_size > 0 || queue_size > 0;
+        if (poll(fds, num_fds, busy ? 0 : -1) < 0) {
+            if (errno == EINTR) { continue; }
+            printf("Error: poll failed\n");
+            exit(1);
+        }
+        for (int f = 0; f < num_fds; f++) {
+            if (!(fds[f].revents & (POLLIN | POLLHUP | POLLERR))) { continue; }
+            Connection* conn = fd_conns[f];
+            if (conn == NULL) {
+                int client = accept(listen_fd, NULL, NULL);
+                if (client >= 0 && connection_open(client, client) == NULL) { close(client); }
+                continue;
+            }
+            ssize_t n = read(conn->in_fd, conn->line + conn->line_bytes, SERVE_LINE_BYTES - conn->line_bytes);
+            if (n < 0 && errno == EINTR) { continue; }
+            int hangup = n <= 0;
+            if (hangup) {
+                // the client is done. a last request without its newline still counts
+                int pending = 0;
+                for (int i = 0; i < conn->line_bytes; i++) { pending |= !isspace((unsigned char)conn->line[i]); }
+                if (!pending) {
+                    conn->open = 0;
+                    conn->line_bytes = 0;
+                    connection_release(conn);
+                    continue;
+                }
+                conn->line[conn->line_bytes++] = '\n'; // there is room, a full line was answered
+            } else {
+                conn->line_bytes += n;
+            }
+            // every complete line is a request
+            char* start = conn->line;
+            char* newline;
+            while ((newline = memchr(start, '\n', conn->line + conn->line_bytes - start)) != NULL) {
+                *newline = '\0';
+                Request req;
+                req.conn = conn;
+                req.id = conn->num_requests++;
+                if (request_parse(&req, start, max_tokens, V)) {
+                    req.rng_state = seed + 0x9E3779B97F4A7C15ULL * (unsigned long long)(++num_requests);
+                    req.slot = -1;
+                    req.prefilled = 0;
+                    if (queue_size == queue_capacity) {
+                        // grow the ring, unrolling it
+                        Request* grown = (Request*)malloc(2 * queue_capacity * sizeof(Request));
+                        for (int q = 0; q < queue_size; q++) { grown[q] = queue[(queue_head + q) % queue_capacity]; }
+                        free(queue);
+                        queue = grown;
+                        queue_head = 0;
+                        queue_capacity *= 2;
+                    }
+                    queue[(queue_head + queue_size++) % queue_capacity] = req;
+                    conn->in_flight++;
+                }
+                start = newline + 1;
+            }
+            conn->line_bytes -= start - conn->line;
+            memmove(conn->line, start, conn->line_bytes);
+            if (conn->line_bytes == SERVE_LINE_BYTES) {
+                Request req = { .conn = conn, .id = conn->num_requests++, .num_prompt = 0, .num_tokens = 0 };
+                request_answer(&req, "line too long");
+                conn->line_bytes = 0;
+            }
+            if (hangup) {
+                conn->open = 0;
+                conn->line_bytes = 0;
+                connection_release(conn);
+            }
+        }
+
+        // 2) waiting requests join the batch while there are free KV caches
+        while (queue_size > 0 && batch_size < max_batch) {
+            Request req = queue[queue_head];
+            queue_head = (queue_head + 1) % queue_capacity;
+            queue_size--;
+            for (int i = 0; i < max_batch; i++) {
+                if (slot_free[i]) { req.slot = i; slot_free[i] = 0; break; }
+            }
+            // the cached blocks of the longest prefix of the prompt don't need a prefill
+            if (prefix_blocks > 0) { prefix_cache_match(&prefix_cache, &slots[req.slot], req.tokens, req.num_prompt - 1); }
+            batch[batch_size++] = req;
+        }
+        if (batch_size == 0) { continue; }
+
+        // 3) one decoding step: the prompt of every sequence that just joined, and the last
+        // generated token of every other one
+        double step_start = now_ms();
+        int num_step_tokens = 0;
+        for (int s = 0; s < batch_size; s++) {
+            Request* req = &batch[s];
+            KVCache* cache = &slots[req->slot];
+            step_caches[s] = cache;
+            step_counts[s] = req->num_tokens - cache->len; // all of the prompt, then 1
+            memcpy(step_tokens + num_step_tokens, req->tokens + cache->len, step_counts[s] * sizeof(int));
+            num_step_tokens += step_counts[s];
+        }
+        float* probs = gpt2_decode_batch(&model, step_caches, step_tokens, step_counts, batch_size);
+        double step_ms = now_ms() - step_start;
+        busy_ms += step_ms;
+        fit_x += num_step_tokens;
+        fit_y += step_ms;
+        fit_xx += (double)num_step_tokens * num_step_tokens;
+        fit_xy += num_step_tokens * step_ms;
+        num_steps++;
+        num_rows += num_step_tokens;
+        num_sequences += batch_size;
+
+        // 4) sample the next token of every sequence, and let the finished ones leave
+        int kept = 0;
+        for (int s = 0; s < batch_size; s++) {
+            Request* req = &batch[s];
+            KVCache* cache = &slots[req->slot];
+            if (!req->prefilled && prefix_blocks > 0) { prefix_cache_insert(&prefix_cache, cache, req->tokens); }
+            req->prefilled = 1;
+            int token = sample_mult(probs + (size_t)s * V, V, random_f32(&req->rng_state));
+            req->tokens[req->num_tokens++] = token;
+            num_generated++;
+            if (token != GPT2_EOT && req->num_tokens < req->max_tokens) {
+                batch[kept++] = *req;
+                continue;
+            }
+            request_answer(req, NULL);
+            if (prefix_blocks > 0) { prefix_cache_insert(&prefix_cache, cache, req->tokens); }
+            free(req->tokens);
+            kv_cache_reset(cache);
+            slot_free[req->slot] = 1;
+            req->conn->in_flight--;
+            connection_release(req->conn);
+            num_served++;
+        }
+        batch_size = kept;
+    }
+
+    printf("served %d requests: %lld tokens generated in %d steps, %.1f sequences and %.1f rows per step, %.1f tokens/s\n",
+           num_served, num_generated, num_steps,
+           num_steps > 0 ? (double)num_sequences / num_steps : 0.0, num_steps > 0 ? (double)num_rows / num_steps : 0.0,
+           busy_ms > 0.0 ? num_generated / busy_ms * 1e3 : 0.0);
+    KVPool* pool = &model.kv_pool;
+    printf("KV cache: at most %d blocks of %d tokens in use, %.1f MiB\n",
+           pool->max_used, KV_BLOCK, pool->max_used * pool->block_floats * sizeof(float) / (1024.0 * 1024.0));
+    PrefixCache* pc = &prefix_cache;
+    if (prefix_blocks > 0) {
+        double fit_det = num_steps * fit_xx - fit_x * fit_x;
+        double row_ms = fit_det > 0.0 ? (num_steps * fit_xy - fit_x * fit_y) / fit_det : num_rows > 0 ? busy_ms / num_rows : 0.0;
+        printf("prefix cache: %lld of %lld requests hit, %lld of %lld prompt tokens reused (%.1f%%), ~%.1f ms of prefill saved, %lld blocks cached, %lld evicted\n",
+               pc->hits, pc->lookups, pc->hit_tokens, pc->lookup_tokens,
+               pc->lookup_tokens > 0 ? 100.0 * pc->hit_tokens / pc->lookup_tokens : 0.0,
+               pc->hit_tokens * row_ms, pc->inserted - pc->evicted, pc->evicted);
+    }
+
+    // free everything
+    if (listen_fd >= 0) { close(listen_fd); unlink(socket_path); }
+    for (int i = 0; i < batch_size; i++) { free(batch[i].tokens); }
+    for (int q = 0; q < queue_size; q++) { free(queue[(queue_head + q) % queue_capacity].tokens); }
+    for (int i = 0; i < max_batch; i++) { kv_cache_free(&slots[i]); }
+    prefix_cache_free(&prefix_cache);
+    free(slots);
+    free(slot_free);
+    free(batch);
+    free(queue);
+    free(step_caches);
+    free(step_tokens);
+    free(step_counts);
+    gpt2_free(&model);
+    return 0;
+}
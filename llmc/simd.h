@@ -0,0 +1,156 @@
+/*
+Explicit SIMD versions of the elementwise and normalization layers in train_gpt2.c.
+train_gpt2.c itself stays free of intrinsics. This header only provides the
+accelerated variants and the CPU feature checks, and train_gpt2.c picks one set
+of them once at startup (see kernels_init), falling back to its own reference
+functions when nothing here applies.
+
+The kernel bodies live in simd_kernels.h and are written once against a tiny
+vector vocabulary (simd_load, simd_fma, simd_exp, ...). This file defines that
+vocabulary for each instruction set and includes simd_kernels.h once per set.
+On x86 the functions carry target attributes, so one binary built without any
+-m flags contains AVX2 and AVX-512 versions side by side.
+*/
+#ifndef LLMC_SIMD_H
+#define LLMC_SIMD_H
+
+#include <math.h>
+
+#define SIMD_CONCAT2(a, b) a##_##b
+#define SIMD_CONCAT(a, b) SIMD_CONCAT2(a, b)
+#define SIMD_NAME(name) SIMD_CONCAT(name, SIMD_SUFFIX)
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_HAVE_X86 1
+#include <immintrin.h>
+
+// ----------------------------------------------------------------------------
+// AVX2 + FMA, 8 floats per vector
+
+#define SIMD_SUFFIX avx2
+#define SIMD_TARGET __attribute__((target("avx2,fma")))
+#define SIMD_WIDTH 8
+#define SIMD_F32 __m256
+#define simd_load(p) _mm256_loadu_ps(p)
+#define simd_store(p, v) _mm256_storeu_ps(p, v)
+#define simd_set1(x) _mm256_set1_ps(x)
+#define simd_zero() _mm256_setzero_ps()
+#define simd_add(a, b) _mm256_add_ps(a, b)
+#define simd_sub(a, b) _mm256_sub_ps(a, b)
+#define simd_mul(a, b) _mm256_mul_ps(a, b)
+#define simd_div(a, b) _mm256_div_ps(a, b)
+#define simd_sqrt(x) _mm256_sqrt_ps(x)
+#define simd_fma(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define simd_max(a, b) _mm256_max_ps(a, b)
+#define simd_min(a, b) _mm256_min_ps(a, b)
+#define simd_round(x) _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define simd_pow2n(n) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23))
+#define simd_hsum(v) simd_hsum_avx2(v)
+#define simd_hmax(v) simd_hmax_avx2(v)
+
+SIMD_TARGET static inline float simd_hsum_avx2(__m256 v) {
+    __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_movehdup_ps(x));
+    return _mm_cvtss_f32(x);
+}
+
+SIMD_TARGET static inline float simd_hmax_avx2(__m256 v) {
+    __m128 x = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_max_ss(x, _mm_movehdup_ps(x));
+    return _mm_cvtss_f32(x);
+}
+
+#include "simd_kernels.h"
+
+// ----------------------------------------------------------------------------
+// AVX-512F, 16 floats per vector
+
+#define SIMD_SUFFIX avx512
+#define SIMD_TARGET __attribute__((target("avx512f")))
+#define SIMD_WIDTH 16
+#define SIMD_F32 __m512
+#define simd_load(p) _mm512_loadu_ps(p)
+#define simd_store(p, v) _mm512_storeu_ps(p, v)
+#define simd_set1(x) _mm512_set1_ps(x)
+#define simd_zero() _mm512_setzero_ps()
+#define simd_add(a, b) _mm512_add_ps(a, b)
+#define simd_sub(a, b) _mm512_sub_ps(a, b)
+#define simd_mul(a, b) _mm512_mul_ps(a, b)
+#define simd_div(a, b) _mm512_div_ps(a, b)
+#define simd_sqrt(x) _mm512_sqrt_ps(x)
+#define simd_fma(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define simd_max(a, b) _mm512_max_ps(a, b)
+#define simd_min(a, b) _mm512_min_ps(a, b)
+#define simd_round(x) _mm512_roundscale_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define simd_pow2n(n) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23))
+#define simd_hsum(v) _mm512_reduce_add_ps(v)
+#define simd_hmax(v) _mm512_reduce_max_ps(v)
+
+#include "simd_kernels.h"
+
+#endif // x86
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_HAVE_NEON 1
+#include <arm_neon.h>
+
+// ----------------------------------------------------------------------------
+// NEON, 4 floats per vector. always present on aarch64, so no target attribute
+
+#define SIMD_SUFFIX neon
+#define SIMD_TARGET
+#define SIMD_WIDTH 4
+#define SIMD_F32 float32x4_t
+#define simd_load(p) vld1q_f32(p)
+#define simd_store(p, v) vst1q_f32(p, v)
+#define simd_set1(x) vdupq_n_f32(x)
+#define simd_zero() vdupq_n_f32(0.0f)
+#define simd_add(a, b) vaddq_f32(a, b)
+#define simd_sub(a, b) vsubq_f32(a, b)
+#define simd_mul(a, b) vmulq_f32(a, b)
+#define simd_div(a, b) vdivq_f32(a, b)
+#define simd_sqrt(x) vsqrtq_f32(x)
+#define simd_fma(a, b, c) vfmaq_f32(c, a, b)
+#define simd_max(a, b) vmaxq_f32(a, b)
+#define simd_min(a, b) vminq_f32(a, b)
+#define simd_round(x) vrndnq_f32(x)
+#define simd_pow2n(n) vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(vcvtnq_s32_f32(n), vdupq_n_s32(127)), 23))
+#define simd_hsum(v) vaddvq_f32(v)
+#define simd_hmax(v) vmaxvq_f32(v)
+
+#include "simd_kernels.h"
+
+#endif // aarch64
+
+// ----------------------------------------------------------------------------
+// feature detection
+
+int simd_has_avx2(void) {
+#ifdef SIMD_HAVE_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return 0;
+#endif
+}
+
+int simd_has_avx512(void) {
+#ifdef SIMD_HAVE_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+#else
+    return 0;
+#endif
+}
+
+int simd_has_neon(void) {
+#ifdef SIMD_HAVE_NEON
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#endif // LLMC_SIMD_H
@@ -0,0 +1,338 @@
+/*
+SIMD kernel bodies, written once against the vector vocabulary of simd.h.
+There is deliberately no include guard: simd.h includes this file once per
+instruction set, after defining SIMD_SUFFIX, SIMD_TARGET, SIMD_WIDTH, SIMD_F32
+and the simd_* operations. Every function gets the suffix appended to its name,
+e.g. layernorm_forward_avx2. All the vocabulary is undefined again at the end.
+
+The signatures and semantics match the reference layers in train_gpt2.c exactly,
+including which backward passes accumulate (+=) into their gradients and which
+are the first writer (=).
+Tails that don't fill a whole vector are handled with plain scalar code.
+*/
+
+// ----------------------------------------------------------------------------
+// math helpers
+
+SIMD_TARGET static inline SIMD_F32 SIMD_NAME(simd_exp)(SIMD_F32 x) {
+    // exp(x) = 2^n * exp(r), with n = round(x / ln2) and |r| <= ln2/2
+    // exp(r) is a degree 6 polynomial (the Cephes expf coefficients), ~1 ulp
+    // the input is clamped so that 2^n stays a normal float
+    x = simd_min(x, simd_set1(88.0f));
+    x = simd_max(x, simd_set1(-87.0f));
+    SIMD_F32 n = simd_round(simd_mul(x, simd_set1(1.44269504088896341f)));
+    SIMD_F32 r = simd_fma(n, simd_set1(-0.693359375f), x);
+    r = simd_fma(n, simd_set1(2.12194440e-4f), r);
+    SIMD_F32 r2 = simd_mul(r, r);
+    SIMD_F32 p = simd_set1(1.9875691500e-4f);
+    p = simd_fma(p, r, simd_set1(1.3981999507e-3f));
+    p = simd_fma(p, r, simd_set1(8.3334519073e-3f));
+    p = simd_fma(p, r, simd_set1(4.1665795894e-2f));
+    p = simd_fma(p, r, simd_set1(1.6666665459e-1f));
+    p = simd_fma(p, r, simd_set1(5.0000001201e-1f));
+    p = simd_fma(p, r2, simd_add(r, simd_set1(1.0f)));
+    return simd_mul(p, simd_pow2n(n));
+}
+
+SIMD_TARGET static inline SIMD_F32 SIMD_NAME(simd_tanh)(SIMD_F32 x) {
+    // tanh(x) = 1 - 2 / (exp(2x) + 1), saturates cleanly to +-1 through the exp clamp
+    SIMD_F32 e = SIMD_NAME(simd_exp)(simd_add(x, x));
+    return simd_sub(simd_set1(1.0f), simd_div(simd_set1(2.0f), simd_add(e, simd_set1(1.0f))));
+}
+
+// ----------------------------------------------------------------------------
+// layers
+
+SIMD_TARGET void SIMD_NAME(layernorm_forward)(float* out, float* mean, float* rstd,
+                                              float* inp, float* weight, float* bias,
+                                              int B, int T, int C) {
+    float eps = 1e-5f;
+    #pragma omp parallel for
+    for (int bt = 0; bt < B * T; bt++) {
+        float* x = inp + bt * C;
+        float* out_bt = out + bt * C;
+        // mean
+        SIMD_F32 acc = simd_zero();
+        int i = 0;
+        for (; i + SIMD_WIDTH <= C; i += SIMD_WIDTH) { acc = simd_add(acc, simd_load(x + i)); }
+        float m = simd_hsum(acc);
+        for (; i < C; i++) { m += x[i]; }
+        m = m / C;
+        // variance (without any bias correction)
+        SIMD_F32 mv = simd_set1(m);
+        acc = simd_zero();
+        for (i = 0; i + SIMD_WIDTH <= C; i += SIMD_WIDTH) {
+            SIMD_F32 xshift = simd_sub(simd_load(x + i), mv);
+            acc = simd_fma(xshift, xshift, acc);
+        }
+        float v = simd_hsum(acc);
+        for (; i < C; i++) { float xshift = x[i] - m; v += xshift * xshift; }
+        v = v / C;
+        float s = 1.0f / sqrtf(v + eps);
+        // normalize, scale and shift
+        SIMD_F32 sv = simd_set1(s);
+        for (i = 0; i + SIMD_WIDTH <= C; i += SIMD_WIDTH) {
+            SIMD_F32 n = simd_mul(sv, simd_sub(simd_load(x + i), mv));
+            simd_store(out_bt + i, simd_fma(n, simd_load(weight + i), simd_load(bias + i)));
+        }
+        for (; i < C; i++) { out_bt[i] = (s * (x[i] - m)) * weight[i] + bias[i]; }
+        if (mean != NULL) {
+            mean[bt] = m;
+            rstd[bt] = s;
+        }
+    }
+}
+
+SIMD_TARGET void SIMD_NAME(layernorm_backward)(float* dinp, float* dweight, float* dbias,
+                                               float* dout, float* inp, float* weight, float* mean, float* rstd,
+                                               int B, int T, int C) {
+    // the rows all accumulate into dweight/dbias, so this one stays serial over (b,t)
+    for (int bt = 0; bt < B * T; bt++) {
+        float* dout_bt = dout + bt * C;
+        float* inp_bt = inp + bt * C;
+        float* dinp_bt = dinp + bt * C;
+        float mean_bt = mean[bt];
+        float rstd_bt = rstd[bt];
+        SIMD_F32 mv = simd_set1(mean_bt);
+        SIMD_F32 sv = simd_set1(rstd_bt);
+
+        // first: two reduce operations
+        SIMD_F32 acc_mean = simd_zero();
+        SIMD_F32 acc_norm_mean = simd_zero();
+        int i = 0;
+        for (; i + SIMD_WIDTH <= C; i += SIMD_WIDTH) {
+            SIMD_F32 norm = simd_mul(simd_sub(simd_load(inp_bt + i), mv), sv);
+            SIMD_F32 dnorm = simd_mul(simd_load(weight + i), simd_load(dout_bt + i));
+            acc_mean = simd_add(acc_mean, dnorm);
+            acc_norm_mean = simd_fma(dnorm, norm, acc_norm_mean);
+        }
+        float dnorm_mean = simd_hsum(acc_mean);
+        float dnorm_norm_mean = simd_hsum(acc_norm_mean);
+        for (; i < C; i++) {
+            float norm_bti = (inp_bt[i] - mean_bt) * rstd_bt;
+            float dnorm_i = weight[i] * dout_bt[i];
+            dnorm_mean += dnorm_i;
+            dnorm_norm_mean += dnorm_i * norm_bti;
+        }
+        dnorm_mean = dnorm_mean / C;
+        dnorm_norm_mean = dnorm_norm_mean / C;
+
+        // now iterate again and accumulate all the gradients
+        SIMD_F32 dmv = simd_set1(dnorm_mean);
+        SIMD_F32 dnmv = simd_set1(dnorm_norm_mean);
+        for (i = 0; i + SIMD_WIDTH <= C; i += SIMD_WIDTH) {
+            SIMD_F32 d = simd_load(dout_bt + i);
+            SIMD_F32 norm = simd_mul(simd_sub(simd_load(inp_bt + i), mv), sv);
+            SIMD_F32 dnorm = simd_mul(simd_load(weight + i), d);
+            simd_store(dbias + i, simd_add(simd_load(dbias + i), d));
+            simd_store(dweight + i, simd_fma(norm, d, simd_load(dweight + i)));
+            SIMD_F32 dval = simd_sub(simd_sub(dnorm, dmv), simd_mul(norm, dnmv));
+            simd_store(dinp_bt + i, simd_fma(dval, sv, simd_load(dinp_bt + i)));
+        }
+        for (; i < C; i++) {
+            float norm_bti = (inp_bt[i] - mean_bt) * rstd_bt;
+            float dnorm_i = weight[i] * dout_bt[i];
+            dbias[i] += dout_bt[i];
+            dweight[i] += norm_bti * dout_bt[i];
+            dinp_bt[i] += (dnorm_i - dnorm_mean - norm_bti * dnorm_norm_mean) * rstd_bt;
+        }
+    }
+}
+
+SIMD_TARGET void SIMD_NAME(gelu_forward)(float* out, float* inp, int N) {
+    const float s = 0.7978845608028654f; // sqrt(2/pi)
+    int n_vec = N / SIMD_WIDTH * SIMD_WIDTH;
+    #pragma omp parallel for
+    for (int i = 0; i < n_vec; i += SIMD_WIDTH) {
+        SIMD_F32 x = simd_load(inp + i);
+        SIMD_F32 cube = simd_mul(simd_mul(simd_set1(0.044715f), x), simd_mul(x, x));
+        SIMD_F32 th = SIMD_NAME(simd_tanh)(simd_mul(simd_set1(s), simd_add(x, cube)));
+        simd_store(out + i, simd_mul(simd_mul(simd_set1(0.5f), x), simd_add(simd_set1(1.0f), th)));
+    }
+    for (int i = n_vec; i < N; i++) {
+        float x = inp[i];
+        float cube = 0.044715f * x * x * x;
+        out[i] = 0.5f * x * (1.0f + tanhf(s * (x + cube)));
+    }
+}
+
+SIMD_TARGET void SIMD_NAME(gelu_backward)(float* dinp, float* inp, float* dout, int N) {
+    const float s = 0.7978845608028654f; // sqrt(2/pi)
+    int n_vec = N / SIMD_WIDTH * SIMD_WIDTH;
+    #pragma omp parallel for
+    for (int i = 0; i < n_vec; i += SIMD_WIDTH) {
+        SIMD_F32 x = simd_load(inp + i);
+        SIMD_F32 x2 = simd_mul(x, x);
+        SIMD_F32 cube = simd_mul(simd_mul(simd_set1(0.044715f), x), x2);
+        SIMD_F32 th = SIMD_NAME(simd_tanh)(simd_mul(simd_set1(s), simd_add(x, cube)));
+        // sech^2 = 1 - tanh^2, the same quantity as 1/cosh^2 in the reference
+        SIMD_F32 sech2 = simd_sub(simd_set1(1.0f), simd_mul(th, th));
+        SIMD_F32 poly = simd_fma(simd_set1(3.0f * 0.044715f), x2, simd_set1(1.0f));
+        SIMD_F32 local_grad = simd_mul(simd_set1(0.5f), simd_add(simd_set1(1.0f), th));
+        local_grad = simd_fma(simd_mul(simd_mul(x, simd_set1(0.5f * s)), sech2), poly, local_grad);
+        simd_store(dinp + i, simd_mul(local_grad, simd_load(dout + i)));
+    }
+    for (int i = n_vec; i < N; i++) {
+        float x = inp[i];
+        float tanh_out = tanhf(s * (x + 0.044715f * x * x * x));
+        float sech_out = 1.0f - tanh_out * tanh_out;
+        float local_grad = 0.5f * (1.0f + tanh_out) + x * 0.5f * sech_out * s * (1.0f + 3.0f * 0.044715f * x * x);
+        dinp[i] = local_grad * dout[i];
+    }
+}
+
+SIMD_TARGET void SIMD_NAME(residual_forward)(float* out, float* inp1, float* inp2, int N) {
+    int n_vec = N / SIMD_WIDTH * SIMD_WIDTH;
+    #pragma omp parallel for
+    for (int i = 0; i < n_vec; i += SIMD_WIDTH) {
+        simd_store(out + i, simd_add(simd_load(inp1 + i), simd_load(inp2 + i)));
+    }
+    for (int i = n_vec; i < N; i++) { out[i] = inp1[i] + inp2[i]; }
+}
+
+SIMD_TARGET void SIMD_NAME(residual_backward)(float* dinp1, float* dinp2, float* dout, int N) {
+    int n_vec = N / SIMD_WIDTH * SIMD_WIDTH;
+    #pragma omp parallel for
+    for (int i = 0; i < n_vec; i += SIMD_WIDTH) {
+        SIMD_F32 d = simd_load(dout + i);
+        simd_store(dinp1 + i, simd_add(simd_load(dinp1 + i), d));
+        simd_store(dinp2 + i, simd_add(simd_load(dinp2 + i), d));
+    }
+    for (int i = n_vec; i < N; i++) { dinp1[i] += dout[i]; dinp2[i] += dout[i]; }
+}
+
+SIMD_TARGET void SIMD_NAME(softmax_forward)(float* probs, float* logits, int B, int T, int V) {
+    #pragma omp parallel for
+    for (int bt = 0; bt < B * T; bt++) {
+        float* logits_bt = logits + bt * V;
+        float* probs_bt = probs + bt * V;
+        // maxval is only calculated and subtracted for numerical stability
+        SIMD_F32 vmax = simd_set1(-10000.0f);
+        int i = 0;
+        for (; i + SIMD_WIDTH <= V; i += SIMD_WIDTH) { vmax = simd_max(vmax, simd_load(logits_bt + i)); }
+        float maxval = simd_hmax(vmax);
+        for (; i < V; i++) { if (logits_bt[i] > maxval) { maxval = logits_bt[i]; } }
+        SIMD_F32 mv = simd_set1(maxval);
+        SIMD_F32 acc = simd_zero();
+        for (i = 0; i + SIMD_WIDTH <= V; i += SIMD_WIDTH) {
+            SIMD_F32 e = SIMD_NAME(simd_exp)(simd_sub(simd_load(logits_bt + i), mv));
+            simd_store(probs_bt + i, e);
+            acc = simd_add(acc, e);
+        }
+        float sum = simd_hsum(acc);
+        for (; i < V; i++) { probs_bt[i] = expf(logits_bt[i] - maxval); sum += probs_bt[i]; }
+        SIMD_F32 inv = simd_set1(1.0f / sum);
+        for (i = 0; i + SIMD_WIDTH <= V; i += SIMD_WIDTH) {
+            simd_store(probs_bt + i, simd_mul(simd_load(probs_bt + i), inv));
+        }
+        for (; i < V; i++) { probs_bt[i] /= sum; }
+    }
+}
+
+SIMD_TARGET void SIMD_NAME(crossentropy_softmax_backward)(float* dlogits,
+                                                          float* dlosses, float* probs, int* targets,
+                                                          int B, int T, int V) {
+    #pragma omp parallel for
+    for (int bt = 0; bt < B * T; bt++) {
+        float* dlogits_bt = dlogits + bt * V;
+        float* probs_bt = probs + bt * V;
+        float dloss = dlosses[bt];
+        int ix = targets[bt];
+        // dlogits = p * dloss everywhere, and the indicator term only at the target
+        SIMD_F32 dv = simd_set1(dloss);
+        int i = 0;
+        for (; i + SIMD_WIDTH <= V; i += SIMD_WIDTH) {
+            simd_store(dlogits_bt + i, simd_mul(simd_load(probs_bt + i), dv));
+        }
+        for (; i < V; i++) { dlogits_bt[i] = probs_bt[i] * dloss; }
+        dlogits_bt[ix] -= dloss;
+    }
+}
+
+SIMD_TARGET void SIMD_NAME(adamw_update)(float* params, float* grads, float* m, float* v, int n,
+                                         float learning_rate, float beta1, float beta2,
+                                         float beta1_correction, float beta2_correction,
+                                         float eps, float weight_decay) {
+    // the reference math, up to the rounding of the fused multiply-adds
+    SIMD_F32 b1 = simd_set1(beta1), b2 = simd_set1(beta2);
+    SIMD_F32 one_b1 = simd_set1(1.0f - beta1), one_b2 = simd_set1(1.0f - beta2);
+    SIMD_F32 c1 = simd_set1(beta1_correction), c2 = simd_set1(beta2_correction);
+    SIMD_F32 lr = simd_set1(-learning_rate), ev = simd_set1(eps), wd = simd_set1(weight_decay);
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        SIMD_F32 p = simd_load(params + i);
+        SIMD_F32 g = simd_load(grads + i);
+        SIMD_F32 mv = simd_fma(b1, simd_load(m + i), simd_mul(one_b1, g));
+        SIMD_F32 vv = simd_fma(b2, simd_load(v + i), simd_mul(simd_mul(one_b2, g), g));
+        SIMD_F32 m_hat = simd_div(mv, c1);
+        SIMD_F32 v_hat = simd_div(vv, c2);
+        SIMD_F32 step = simd_fma(wd, p, simd_div(m_hat, simd_add(simd_sqrt(v_hat), ev)));
+        simd_store(m + i, mv);
+        simd_store(v + i, vv);
+        simd_store(params + i, simd_fma(lr, step, p));
+    }
+    for (; i < n; i++) {
+        float mi = beta1 * m[i] + (1.0f - beta1) * grads[i];
+        float vi = beta2 * v[i] + (1.0f - beta2) * grads[i] * grads[i];
+        float m_hat = mi / beta1_correction;
+        float v_hat = vi / beta2_correction;
+        m[i] = mi;
+        v[i] = vi;
+        params[i] -= learning_rate * (m_hat / (sqrtf(v_hat) + eps) + weight_decay * params[i]);
+    }
+}
+
+SIMD_TARGET void SIMD_NAME(adamw_codes)(float* m, float* v, int n, float* m_max, float* v_max) {
+    // the reference math, with a vector sqrt
+    SIMD_F32 zero = simd_zero();
+    SIMD_F32 mx = zero, vx = zero;
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        SIMD_F32 mv = simd_load(m + i);
+        mx = simd_max(mx, simd_max(mv, simd_sub(zero, mv)));
+        vx = simd_max(vx, simd_load(v + i));
+    }
+    float mxs = simd_hmax(mx), vxs = simd_hmax(vx);
+    for (; i < n; i++) {
+        mxs = fmaxf(mxs, fabsf(m[i]));
+        vxs = fmaxf(vxs, v[i]);
+    }
+    float m_scale = mxs > 0.0f ? 127.0f / sqrtf(mxs) : 0.0f;
+    float v_inv = vxs > 0.0f ? 1.0f / vxs : 0.0f;
+    SIMD_F32 ms = simd_set1(m_scale), vi = simd_set1(v_inv);
+    SIMD_F32 tiny = simd_set1(1e-30f), c255 = simd_set1(255.0f);
+    i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        SIMD_F32 mv = simd_load(m + i);
+        SIMD_F32 root = simd_max(simd_sqrt(simd_max(mv, simd_sub(zero, mv))), tiny);
+        simd_store(m + i, simd_div(simd_mul(mv, ms), root));
+        simd_store(v + i, simd_mul(c255, simd_sqrt(simd_sqrt(simd_mul(simd_load(v + i), vi)))));
+    }
+    for (; i < n; i++) {
+        m[i] = m[i] * m_scale / fmaxf(sqrtf(fabsf(m[i])), 1e-30f);
+        v[i] = 255.0f * sqrtf(sqrtf(v[i] * v_inv));
+    }
+    *m_max = mxs;
+    *v_max = vxs;
+}
+
+#undef SIMD_SUFFIX
+#undef SIMD_TARGET
+#undef SIMD_WIDTH
+#undef SIMD_F32
+#undef simd_load
+#undef simd_store
+#undef simd_set1
+#undef simd_zero
+#undef simd_add
+#undef simd_sub
+#undef simd_mul
+#undef simd_div
+#undef simd_sqrt
+#undef simd_fma
+#undef simd_max
+#undef simd_min
+#undef simd_round
+#undef simd_pow2n
+#undef simd_hsum
+#undef simd_hmax
@@ -0,0 +1,127 @@
+/*
+Quantizes a GPT-2 checkpoint for inference: weight-only int8 or int4, with one fp32
+scale per group of input channels of every output channel, for wte (the lm-head) and
+the qkv, attention projection, fc and fc projection weights of every layer. The
+result is written as a version 3 checkpoint, which gpt2_build_from_checkpoint loads
+directly. Everything else (embeddings of positions, layernorms, biases) stays fp32.
+
+Optionally (-e) it evaluates the fp32 and the quantized model on the val split,
+and reports the loss, the perplexity and the forward throughput of both.
+
+Example:
+./quantize_gpt2 -i gpt2_124M.bin -o gpt2_124M_int8.bin -b 8 -g 64 -e 1
+*/
+#define TESTING
+#include "train_gpt2.c"
+
+void error_usage() {
+    fprintf(stderr, "Usage:   ./quantize_gpt2 [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -i <string> input fp32 checkpoint (default = gpt2_124M.bin)\n");
+    fprintf(stderr, "  -o <string> output quantized checkpoint (default = gpt2_124M_q.bin)\n");
+    fprintf(stderr, "  -b <int>    bits, 8 or 4 (default = 8)\n");
+    fprintf(stderr, "  -g <int>    group size along the input channels, must divide C (default = 64)\n");
+    fprintf(stderr, "  -e <int>    evaluate fp32 vs quantized on the val split (default = 0)\n");
+    fprintf(stderr, "  -n <int>    number of val batches to evaluate, 0 = all (default = 0)\n");
+    exit(1);
+}
+
+typedef struct {
+    float loss;
+    double tokens_per_second;
+} EvalResult;
+
+EvalResult evaluate(GPT2* model, int* tokens, int num_batches, int B, int T) {
+    // mean loss over num_batches consecutive (B,T) batches, and the forward throughput
+    EvalResult result;
+    double loss = 0.0;
+    double elapsed_s = 0.0;
+    for (int i = 0; i < num_batches; i++) {
+        int* batch = tokens + (size_t)i * B * T;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        gpt2_forward(model, batch, batch + 1, B, T);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed_s += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        loss += model->mean_loss;
+    }
+    result.loss = loss / num_batches;
+    result.tokens_per_second = (double)num_batches * B * T / elapsed_s;
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+
+    char* input_path = "gpt2_124M.bin";
+    char* output_path = "gpt2_124M_q.bin";
+    int bits = 8;
+    int group_size = 64;
+    int eval = 0;
+    int eval_batches = 0;
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        if (argv[i][0] != '-') { error_usage(); } // must start with dash
+        if (strlen(argv[i]) != 2) { error_usage(); } // must be -x (one dash, one letter)
+        if (argv[i][1] == 'i') { input_path = argv[i+1]; }
+        else if (argv[i][1] == 'o') { output_path = argv[i+1]; }
+        else if (argv[i][1] == 'b') { bits = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'g') { group_size = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'e') { eval = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'n') { eval_batches = atoi(argv[i+1]); }
+        else { error_usage(); }
+    }
+
+    // quantize and write out the checkpoint
+    GPT2 model;
+    gpt2_build_from_checkpoint(&model, input_path);
+    gpt2_quantize_weights(&model, bits, group_size);
+    gpt2_write_quantized_checkpoint(&model, output_path);
+    size_t fp32_bytes = (size_t)model.num_parameters * sizeof(float);
+    size_t unpackable_bytes = 0;
+    for (int i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+        if (!packable_parameters[i]) { unpackable_bytes += model.param_sizes[i] * sizeof(float); }
+    }
+    size_t quantized_bytes = unpackable_bytes + model.quantized_bytes;
+    printf("wrote %s: int%d, group size %d\n", output_path, bits, group_size);
+    printf("weights: %.1f MB fp32 -> %.1f MB quantized\n", fp32_bytes / 1e6, quantized_bytes / 1e6);
+    gpt2_free(&model);
+    if (!eval) { return 0; }
+
+    // evaluate both checkpoints on the val split, with the same settings as train_gpt2
+    char* tiny_shakespeare_val = "data/tiny_shakespeare_val.bin";
+    char* tiny_stories_val = "data/TinyStories_val.bin";
+    char* val_tokens = access(tiny_shakespeare_val, F_OK) != -1 ? tiny_shakespeare_val : tiny_stories_val;
+    FILE* tokens_file = fopen(val_tokens, "rb");
+    if (tokens_file == NULL) { printf("Error opening tokens file\n"); return 1; }
+    fseek(tokens_file, 0, SEEK_END);
+    long num_tokens = ftell(tokens_file) / sizeof(int);
+    fseek(tokens_file, 0, SEEK_SET);
+    int* tokens = (int*)malloc(num_tokens * sizeof(int));
+    fread(tokens, sizeof(int), num_tokens, tokens_file);
+    fclose(tokens_file);
+    int B = 4;
+    int T = 64;
+    int num_batches = (num_tokens - 1) / (B * T);
+    if (eval_batches > 0 && eval_batches < num_batches) { num_batches = eval_batches; }
+    printf("evaluating on %d batches of %s\n", num_batches, val_tokens);
+
+    GPT2 reference;
+    gpt2_build_from_checkpoint(&reference, input_path);
+    reference.fused_classifier = 1;
+    reference.inference_only = 1;
+    EvalResult fp32 = evaluate(&reference, tokens, num_batches, B, T);
+    gpt2_free(&reference);
+
+    GPT2 quantized;
+    gpt2_build_from_checkpoint(&quantized, output_path);
+    quantized.fused_classifier = 1;
+    EvalResult quant = evaluate(&quantized, tokens, num_batches, B, T);
+    gpt2_free(&quantized);
+
+    printf("fp32:      val loss %f, perplexity %.3f, %.1f tokens/s\n", fp32.loss, expf(fp32.loss), fp32.tokens_per_second);
+    printf("int%d g%-3d val loss %f, perplexity %.3f, %.1f tokens/s\n", bits, group_size, quant.loss, expf(quant.loss), quant.tokens_per_second);
+    printf("perplexity delta: %+.3f (%+.2f%%)\n", expf(quant.loss) - expf(fp32.loss), 100.0f * (expf(quant.loss - fp32.loss) - 1.0f));
+
+    free(tokens);
+    return 0;
+}
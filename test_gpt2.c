@@ -2,12 +2,12 @@
 #include "train_gpt2.c"
 
 // poor man's tensor checker
-int check_tensor(float *a, float *b, int n, char* label) {
+int check_tensor(float *a, float *b, int n, char* label, float tol) {
     int print_upto = 5;
     int ok = 1;
     printf("%s\n", label);
     for (int i = 0; i < n; i++) {
-        if (fabsf(a[i] - b[i]) <= 1e-2) {
+        if (fabsf(a[i] - b[i]) <= tol) {
             if (i < print_upto) { printf("OK "); }
         } else {
             if (i < print_upto) { printf("NOT OK "); }
@@ -26,9 +26,33 @@ int check_tensor(float *a, float *b, int n, char* label) {
 
 int main(int argc, char *argv[]) {
 
+    // the same options as train_gpt2 that change which code paths run, e.g. -a 1
+    int flash_attention = 0;
+    int fused_classifier = 0;
+    int pack_weights = 0;
+    int mixed_precision = 0;
+    int recompute = 0;
+    int recompute_every = 1;
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc || argv[i][0] != '-' || strlen(argv[i]) != 2) { printf("bad arguments\n"); return 1; }
+        if (argv[i][1] == 'a') { flash_attention = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'c') { fused_classifier = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'p') { pack_weights = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'b') { mixed_precision = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'r') { recompute = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'k') { recompute_every = atoi(argv[i+1]); }
+        else { printf("unknown option %s\n", argv[i]); return 1; }
+    }
+
     // build the GPT-2 model from a checkpoint
     GPT2 model;
     gpt2_build_from_checkpoint(&model, "gpt2_124M.bin");
+    model.flash_attention = flash_attention;
+    model.fused_classifier = fused_classifier;
+    model.mixed_precision = mixed_precision;
+    model.recompute = recompute;
+    model.recompute_every = recompute_every;
+    if (pack_weights) { gpt2_pack_weights(&model); }
 
     int C = model.config.channels;
     int V = model.config.vocab_size;
@@ -67,6 +91,111 @@ int main(int argc, char *argv[]) {
 
     // overall OK signal for the test
     int allok = 1;
+    // bf16 storage keeps only 8 bits of mantissa, so the mixed precision path is
+    // checked for parity with the fp32 reference at a looser tolerance
+    float tol = mixed_precision ? 5e-2f : 1e-2f;
+
+    // incremental decoding through the KV cache must give the same logits as the full
+    // forward pass: prefill the first half of the first sequence, then add one token at a time
+    KVCache cache;
+    kv_cache_init(&cache, &model, T);
+    int decode_ok = 1;
+    for (int t = T / 2; t <= T && decode_ok; t++) {
+        int n = t == T / 2 ? t : 1;
+        gpt2_decode(&model, &cache, x + t - n, n);
+        for (int i = 0; i < V; i++) {
+            if (fabsf(expected_logits[(t-1)*V + i] - model.decode_logits[i]) >= tol) {
+                printf("DECODE MISMATCH AT POSITION %d, INDEX %d: %f %f\n", t-1, i, expected_logits[(t-1)*V + i], model.decode_logits[i]);
+                decode_ok = 0;
+                break;
+            }
+        }
+    }
+    if (!decode_ok) { printf("NOT "); }
+    printf("OK (DECODE)\n");
+    allok = allok && decode_ok;
+    // and so must the logits of all the positions of a multi-token pass, which is how
+    // speculative decoding checks its drafted tokens: drop the second half, then redo it at once
+    kv_cache_truncate(&cache, T / 2);
+    gpt2_decode_rows(&model, &cache, x + T / 2, T - T / 2, T - T / 2);
+    int rows_ok = 1;
+    for (int i = 0; i < (T - T / 2) * V && rows_ok; i++) {
+        if (fabsf(expected_logits[(T/2)*V + i] - model.decode_logits[i]) >= tol) {
+            printf("DECODE ROWS MISMATCH AT POSITION %d, INDEX %d: %f %f\n", T/2 + i / V, i % V,
+                   expected_logits[(T/2)*V + i], model.decode_logits[i]);
+            rows_ok = 0;
+        }
+    }
+    if (!rows_ok) { printf("NOT "); }
+    printf("OK (DECODE ROWS)\n");
+    allok = allok && rows_ok;
+    kv_cache_free(&cache);
+
+    // prefix caching: a prompt that starts from the cached blocks of an earlier sequence must
+    // give the same logits as forwarding all of it. that includes a prompt of a multiple of
+    // KV_BLOCK tokens, whose last block is left out of the match to forward its last token
+    PrefixCache prefix_cache;
+    prefix_cache_init(&prefix_cache, &model, 16);
+    KVCache cold, warm;
+    kv_cache_init(&cold, &model, T);
+    kv_cache_init(&warm, &model, T);
+    gpt2_decode(&model, &cold, x, T);
+    prefix_cache_insert(&prefix_cache, &cold, x);
+    float* cold_logits = (float*)malloc(V * sizeof(float));
+    int prompt_lens[2] = {2 * KV_BLOCK, 2 * KV_BLOCK + 5};
+    int prefix_ok = 1;
+    for (int p = 0; p < 2 && prompt_lens[p] <= T && prefix_ok; p++) {
+        int n = prompt_lens[p];
+        kv_cache_reset(&cold);
+        gpt2_decode(&model, &cold, x, n);
+        memcpy(cold_logits, model.decode_logits, V * sizeof(float));
+        kv_cache_reset(&warm);
+        int matched = prefix_cache_match(&prefix_cache, &warm, x, n - 1);
+        if (matched != (n - 1) / KV_BLOCK * KV_BLOCK) {
+            printf("PREFIX CACHE MATCHED %d OF %d TOKENS\n", matched, n);
+            prefix_ok = 0;
+            break;
+        }
+        gpt2_decode(&model, &warm, x + matched, n - matched);
+        for (int i = 0; i < V; i++) {
+            if (fabsf(cold_logits[i] - model.decode_logits[i]) >= tol) {
+                printf("PREFIX CACHE MISMATCH AT PROMPT LENGTH %d, INDEX %d: %f %f\n", n, i, cold_logits[i], model.decode_logits[i]);
+                prefix_ok = 0;
+                break;
+            }
+        }
+    }
+    if (!prefix_ok) { printf("NOT "); }
+    printf("OK (PREFIX CACHE)\n");
+    allok = allok && prefix_ok;
+    free(cold_logits);
+    kv_cache_free(&cold);
+    kv_cache_free(&warm);
+    prefix_cache_free(&prefix_cache);
+
+    // gradient accumulation: the two halves of the batch as two micro-batches of one step
+    // (grad_accum_steps = 2) must give the mean of the gradients of the two halves, which
+    // is the gradient of the whole batch
+    if (B % 2 == 0) {
+        model.grad_accum_steps = 2;
+        gpt2_zero_grad(&model);
+        for (int micro = 0; micro < 2; micro++) {
+            gpt2_forward(&model, x + micro * (B/2) * T, y + micro * (B/2) * T, B/2, T);
+            gpt2_backward(&model);
+        }
+        model.grad_accum_steps = 1;
+        int accum_ok = 1;
+        for (int i = 0; i < model.num_parameters; i++) {
+            if (fabsf(model.grads_memory[i] - expected_grads_memory[i]) >= tol) {
+                printf("GRAD ACCUMULATION MISMATCH AT PARAMETER %d: %f %f\n", i, expected_grads_memory[i], model.grads_memory[i]);
+                accum_ok = 0;
+                break;
+            }
+        }
+        if (!accum_ok) { printf("NOT "); }
+        printf("OK (GRAD ACCUMULATION)\n");
+        allok = allok && accum_ok;
+    }
 
     // let's do 10 training iterations, following the pytorch code
     float losses[10];
@@ -86,12 +215,13 @@ int main(int argc, char *argv[]) {
             // error checking at step 0 for reference activations/gradients
 
             // at this point, target should be equal to expected_logits, let's compare
+            // (the fused classifier never materializes the logits, so it only checks the loss)
             int logits_ok = 1;
-            for (int i=0; i<B*T*V; i++) {
+            for (int i=0; i<B*T*V && !fused_classifier; i++) {
                 if(i < 3) {
                     printf("%f %f\n", expected_logits[i], model.acts.logits[i]);
                 }
-                if (fabsf(expected_logits[i] - model.acts.logits[i]) >= 1e-2) {
+                if (fabsf(expected_logits[i] - model.acts.logits[i]) >= tol) {
                     printf("MISMATCH AT INDEX %d: ", i);
                     printf("%f %f\n", expected_logits[i],model.acts.logits[i]);
                     logits_ok = 0;
@@ -103,7 +233,7 @@ int main(int argc, char *argv[]) {
             allok = allok && logits_ok;
 
             // compare the achieved loss
-            if (fabsf(model.mean_loss - *expected_loss) >= 1e-2) {
+            if (fabsf(model.mean_loss - *expected_loss) >= tol) {
                 printf("LOSS MISMATCH: %f %f\n", model.mean_loss, *expected_loss);
                 allok = 0;
             } else {
@@ -113,22 +243,22 @@ int main(int argc, char *argv[]) {
             // finally check all the gradients
             int gradoks[16];
             ParameterTensors grads = model.grads;
-            gradoks[0] = check_tensor(grads.wte, expected_grads.wte, V*C, "dwte");
-            gradoks[1] = check_tensor(grads.wpe, expected_grads.wpe, maxT*C, "dwpe");
-            gradoks[2] = check_tensor(grads.ln1w, expected_grads.ln1w, L*C, "dln1w");
-            gradoks[3] = check_tensor(grads.ln1b, expected_grads.ln1b, L*C, "dln1b");
-            gradoks[4] = check_tensor(grads.qkvw, expected_grads.qkvw, L*3*C*C, "dqkvw");
-            gradoks[5] = check_tensor(grads.qkvb, expected_grads.qkvb, L*3*C, "dqkvb");
-            gradoks[6] = check_tensor(grads.attprojw, expected_grads.attprojw, L*C*C, "dattprojw");
-            gradoks[7] = check_tensor(grads.attprojb, expected_grads.attprojb, L*C, "dattprojb");
-            gradoks[8] = check_tensor(grads.ln2w, expected_grads.ln2w, L*C, "dln2w");
-            gradoks[9] = check_tensor(grads.ln2b, expected_grads.ln2b, L*C, "dln2b");
-            gradoks[10] = check_tensor(grads.fcw, expected_grads.fcw, L*4*C*C, "dfcw");
-            gradoks[11] = check_tensor(grads.fcb, expected_grads.fcb, L*4*C, "dfcb");
-            gradoks[12] = check_tensor(grads.fcprojw, expected_grads.fcprojw, L*C*4*C, "dfcprojw");
-            gradoks[13] = check_tensor(grads.fcprojb, expected_grads.fcprojb, L*C, "dfcprojb");
-            gradoks[14] = check_tensor(grads.lnfw, expected_grads.lnfw, C, "dlnfw");
-            gradoks[15] = check_tensor(grads.lnfb, expected_grads.lnfb, C, "dlnfb");
+            gradoks[0] = check_tensor(grads.wte, expected_grads.wte, V*C, "dwte", tol);
+            gradoks[1] = check_tensor(grads.wpe, expected_grads.wpe, maxT*C, "dwpe", tol);
+            gradoks[2] = check_tensor(grads.ln1w, expected_grads.ln1w, L*C, "dln1w", tol);
+            gradoks[3] = check_tensor(grads.ln1b, expected_grads.ln1b, L*C, "dln1b", tol);
+            gradoks[4] = check_tensor(grads.qkvw, expected_grads.qkvw, L*3*C*C, "dqkvw", tol);
+            gradoks[5] = check_tensor(grads.qkvb, expected_grads.qkvb, L*3*C, "dqkvb", tol);
+            gradoks[6] = check_tensor(grads.attprojw, expected_grads.attprojw, L*C*C, "dattprojw", tol);
+            gradoks[7] = check_tensor(grads.attprojb, expected_grads.attprojb, L*C, "dattprojb", tol);
+            gradoks[8] = check_tensor(grads.ln2w, expected_grads.ln2w, L*C, "dln2w", tol);
+            gradoks[9] = check_tensor(grads.ln2b, expected_grads.ln2b, L*C, "dln2b", tol);
+            gradoks[10] = check_tensor(grads.fcw, expected_grads.fcw, L*4*C*C, "dfcw", tol);
+            gradoks[11] = check_tensor(grads.fcb, expected_grads.fcb, L*4*C, "dfcb", tol);
+            gradoks[12] = check_tensor(grads.fcprojw, expected_grads.fcprojw, L*C*4*C, "dfcprojw", tol);
+            gradoks[13] = check_tensor(grads.fcprojb, expected_grads.fcprojb, L*C, "dfcprojb", tol);
+            gradoks[14] = check_tensor(grads.lnfw, expected_grads.lnfw, C, "dlnfw", tol);
+            gradoks[15] = check_tensor(grads.lnfb, expected_grads.lnfb, C, "dlnfb", tol);
             for (int i = 0; i < 16; i++) {
                 allok = allok && gradoks[i];
             }
@@ -156,7 +286,7 @@ int main(int argc, char *argv[]) {
     };
     // compare
     for (int i = 0; i < 10; i++) {
-        if (fabsf(losses[i] - expected_losses[i]) >= 1e-2) {
+        if (fabsf(losses[i] - expected_losses[i]) >= tol) {
             printf("LOSS MISMATCH AT STEP %d: %f %f\n", i, losses[i], expected_losses[i]);
             allok = 0;
         } else {
@@ -164,6 +294,90 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    gpt2_free(&model);
+
+    // weight-only quantization (see quantize_gpt2): an int8 and an int4 copy of the checkpoint
+    // must stay close to the fp32 reference. closeness is the mean KL divergence of the next
+    // token distributions of the first sequence (from one decode pass, which keeps the logits
+    // apart from the probabilities) from the reference ones, at most 0.02 resp. 0.25 nats, and
+    // the loss may be off by 0.05 resp. 0.3
+    int quant_bits[2] = {8, 4};
+    float quant_kl_tol[2] = {0.02f, 0.25f};
+    float quant_loss_tol[2] = {0.05f, 0.3f};
+    for (int q = 0; q < 2; q++) {
+        GPT2 quantized;
+        gpt2_build_from_checkpoint(&quantized, "gpt2_124M.bin");
+        gpt2_quantize_weights(&quantized, quant_bits[q], 64);
+        gpt2_forward(&quantized, x, y, B, T);
+        float loss = quantized.mean_loss;
+        KVCache quant_cache;
+        kv_cache_init(&quant_cache, &quantized, T);
+        gpt2_decode_rows(&quantized, &quant_cache, x, T, T);
+        double kl = 0.0;
+        for (int t = 0; t < T; t++) {
+            float* ref = expected_logits + t * V;
+            float* got = quantized.decode_logits + t * V;
+            double ref_max = -INFINITY, got_max = -INFINITY;
+            for (int i = 0; i < V; i++) {
+                if (ref[i] > ref_max) { ref_max = ref[i]; }
+                if (got[i] > got_max) { got_max = got[i]; }
+            }
+            double ref_sum = 0.0, got_sum = 0.0;
+            for (int i = 0; i < V; i++) {
+                ref_sum += exp(ref[i] - ref_max);
+                got_sum += exp(got[i] - got_max);
+            }
+            double ref_lse = ref_max + log(ref_sum), got_lse = got_max + log(got_sum);
+            for (int i = 0; i < V; i++) {
+                double logp = ref[i] - ref_lse;
+                kl += exp(logp) * (logp - (got[i] - got_lse));
+            }
+        }
+        kl /= T;
+        int quant_ok = kl < quant_kl_tol[q] && fabsf(loss - *expected_loss) < quant_loss_tol[q];
+        printf("int%d: KL from fp32 %f, loss %f vs %f\n", quant_bits[q], kl, loss, *expected_loss);
+        if (!quant_ok) { printf("NOT "); }
+        printf("OK (QUANTIZED INT%d)\n", quant_bits[q]);
+        allok = allok && quant_ok;
+        kv_cache_free(&quant_cache);
+        gpt2_free(&quantized);
+    }
+
+    // untied embeddings: the gradients of wte and of the lm-head, which starts as a copy of
+    // wte, must add up to the gradient of the tied wte, and a step must only move the rows of
+    // wte of the tokens of the batch
+    GPT2 untied;
+    gpt2_build_from_checkpoint(&untied, "gpt2_124M.bin");
+    gpt2_untie_embeddings(&untied);
+    gpt2_forward(&untied, x, y, B, T);
+    gpt2_zero_grad(&untied);
+    gpt2_backward(&untied);
+    int untied_ok = 1;
+    float* dlm_head = untied.grads_memory + (untied.lm_head - untied.params_memory);
+    for (int i = 0; i < untied.num_parameters - V*C && untied_ok; i++) {
+        float grad = untied.grads_memory[i] + (i < V*C ? dlm_head[i] : 0.0f);
+        if (fabsf(grad - expected_grads_memory[i]) >= tol) {
+            printf("UNTIED MISMATCH AT PARAMETER %d: %f %f\n", i, expected_grads_memory[i], grad);
+            untied_ok = 0;
+        }
+    }
+    float* wte_before = (float*)malloc(V * C * sizeof(float));
+    memcpy(wte_before, untied.params.wte, V * C * sizeof(float));
+    gpt2_update(&untied, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.01f, 1);
+    int moved_rows = 0;
+    for (int row = 0; row < V; row++) {
+        moved_rows += memcmp(wte_before + row * C, untied.params.wte + row * C, C * sizeof(float)) != 0;
+    }
+    if (moved_rows != untied.num_wte_rows) {
+        printf("UNTIED STEP MOVED %d ROWS OF WTE, THE BATCH HAS %d\n", moved_rows, untied.num_wte_rows);
+        untied_ok = 0;
+    }
+    if (!untied_ok) { printf("NOT "); }
+    printf("OK (UNTIED EMBEDDINGS)\n");
+    allok = allok && untied_ok;
+    free(wte_before);
+    gpt2_free(&untied);
+
     printf("overall okay: %d\n", allok);
 
     // free everything
@@ -171,7 +385,6 @@ int main(int argc, char *argv[]) {
     free(y);
     free(expected_logits);
     free(expected_loss);
-    free(expected_grads_memory);
-    gpt2_free(&model);
+    free_large(expected_grads_memory);
     return 0;
 }
@@ -3,20 +3,29 @@ This file trains the GPT-2 model.
 This version is the clean, minimal, reference. As such:
 - it runs on CPU.
 - it does not make the code too complex; it is readable.
-- it does not use any processor-specific instructions, intrinsics and such.
+- its layers are plain C. SIMD versions of some of them, with intrinsics, live in llmc/simd.h
+  and are chosen at startup for the CPU they run on.
 - it _does_ use a few OpenMP pragmas because this is a large speedup at very low cost
+Compiled with -DINFERENCE_ONLY (see gpt2_infer.c), the backward pass, the gradients and
+the optimizer state are left out, and models only forward through the inference arena.
 There will be other versions of this code that specialize it and make it fast.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #ifdef OMP
 #include <omp.h>
 #endif
+#include "llmc/simd.h"
+#include "llmc/alloc.h"
 
 // ----------------------------------------------------------------------------
 // all the individual layers' forward and backward passes
@@ -47,6 +56,7 @@ void encoder_forward(float* out,
     }
 }
 
+#ifndef INFERENCE_ONLY
 void encoder_backward(float* dwte, float* dwpe,
                       float* dout, int* inp,
                       int B, int T, int C) {
@@ -65,6 +75,64 @@ void encoder_backward(float* dwte, float* dwpe,
     }
 }
 
+// the rows of an embedding table that a batch touches, and the positions that touch each
+// row: the row-sparse form of the encoder's gradient, before it is added into the table
+typedef struct {
+    int num_rows; // the distinct tokens of the batch
+    int* rows; // (num_rows) the distinct tokens, in order of first appearance
+    int* offsets; // (num_rows+1) the positions of rows[r] are positions[offsets[r]..offsets[r+1])
+    int* positions; // (B*T) every b*T+t, grouped by row and ascending within a row
+    int* slot; // (V) scratch, the index of a token in rows, or -1. all -1 between calls
+} EmbeddingRows;
+
+void embedding_rows_build(EmbeddingRows* er, int* inp, int BT) {
+    // a counting sort of the positions by token, in O(BT) and without touching the (V) slot
+    // array beyond the tokens of the batch
+    int n = 0;
+    for (int i = 0; i < BT; i++) {
+        int ix = inp[i];
+        if (er->slot[ix] < 0) {
+            er->slot[ix] = n;
+            er->rows[n] = ix;
+            er->offsets[n + 1] = 0;
+            n++;
+        }
+        er->offsets[er->slot[ix] + 1]++;
+    }
+    er->offsets[0] = 0;
+    for (int r = 0; r < n; r++) { er->offsets[r + 1] += er->offsets[r]; }
+    // fill in the positions, with offsets[r] as the running cursor of row r, then restore it
+    for (int i = 0; i < BT; i++) { er->positions[er->offsets[er->slot[inp[i]]]++] = i; }
+    for (int r = n; r > 0; r--) { er->offsets[r] = er->offsets[r - 1]; }
+    er->offsets[0] = 0;
+    for (int r = 0; r < n; r++) { er->slot[er->rows[r]] = -1; }
+    er->num_rows = n;
+}
+
+void encoder_backward_rows(float* dwte, float* dwpe, float* dout, EmbeddingRows* er,
+                           int B, int T, int C) {
+    // encoder_backward, parallel: every thread owns whole rows of dwte (and of dwpe), so
+    // the scatter needs no atomics. each row adds its positions in the same order as the
+    // serial loop above, so the result is bit-identical to it
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int r = 0; r < er->num_rows; r++) {
+        float* dwte_ix = dwte + (size_t)er->rows[r] * C;
+        for (int p = er->offsets[r]; p < er->offsets[r + 1]; p++) {
+            float* dout_bt = dout + (size_t)er->positions[p] * C;
+            for (int i = 0; i < C; i++) { dwte_ix[i] += dout_bt[i]; }
+        }
+    }
+    #pragma omp parallel for
+    for (int t = 0; t < T; t++) {
+        float* dwpe_t = dwpe + (size_t)t * C;
+        for (int b = 0; b < B; b++) {
+            float* dout_bt = dout + ((size_t)b * T + t) * C;
+            for (int i = 0; i < C; i++) { dwpe_t[i] += dout_bt[i]; }
+        }
+    }
+}
+#endif // INFERENCE_ONLY
+
 void layernorm_forward(float* out, float* mean, float* rstd,
                        float* inp, float* weight, float* bias,
                        int B, int T, int C) {
@@ -100,9 +168,11 @@ void layernorm_forward(float* out, float* mean, float* rstd,
                 float o = n * weight[i] + bias[i]; // scale and shift
                 out_bt[i] = o; // write
             }
-            // cache the mean and rstd for the backward pass later
-            mean[b * T + t] = m;
-            rstd[b * T + t] = s;
+            // cache the mean and rstd for the backward pass later (NULL = not needed)
+            if (mean != NULL) {
+                mean[b * T + t] = m;
+                rstd[b * T + t] = s;
+            }
         }
     }
 }
@@ -150,13 +220,414 @@ void layernorm_backward(float* dinp, float* dweight, float* dbias,
     }
 }
 
-void matmul_forward(float* out,
-                    float* inp, float* weight, float* bias,
-                    int B, int T, int C, int OC) {
-    // most of the running time is spent here and in matmul_backward
-    // OC is short for "output channels"
-    // inp is (B,T,C), weight is (OC, C), bias is (OC)
-    // out will be (B,T,OC)
+// ----------------------------------------------------------------------------
+// bf16 storage
+// bf16 keeps the 8 exponent bits of fp32 and the top 7 mantissa bits, so a conversion
+// is just a shift. it is only used for storage: all the math happens in fp32
+
+typedef uint16_t bf16;
+
+static inline float bf16_to_float(bf16 h) {
+    uint32_t u = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static inline bf16 float_to_bf16(float f) {
+    // round to nearest even
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    u += 0x7FFF + ((u >> 16) & 1);
+    return (bf16)(u >> 16);
+}
+
+void bf16_from_float(bf16* out, const float* inp, size_t n) {
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; i++) { out[i] = float_to_bf16(inp[i]); }
+}
+
+void float_from_bf16(float* out, const bf16* inp, size_t n) {
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; i++) { out[i] = bf16_to_float(inp[i]); }
+}
+
+// ----------------------------------------------------------------------------
+// a small blocked GEMM engine, used by the matmul layers
+// computes C = A @ B (+ C or + bias), with C (M,N), A (M,K), B (K,N)
+// A and B are read through (row, column) strides, so transposed operands need no copies
+// the structure follows the usual Goto/BLIS layout: each thread owns an MC x NC
+// tile of C and walks K in KC steps. for every step it packs a KC x NC panel of B
+// (sized for L2) and an MC x KC panel of A (sized for L1/L2) into contiguous
+// buffers, and then a register-tiled MR x NR micro-kernel sweeps over the panels.
+// the micro-kernel is plain C that the compiler auto-vectorizes, no intrinsics.
+
+#define GEMM_MR 4
+#define GEMM_NR 8
+#define GEMM_MC 64
+#define GEMM_NC 256
+#define GEMM_KC 256
+
+static void gemm_pack_a(float* pa, const float* A, int rsa, int csa, int mc, int kc) {
+    // pack an mc x kc block of A into MR-row micro-panels, zero padded at the edge
+    // within a micro-panel the layout is pa[p * MR + i], i.e. column-major
+    for (int i0 = 0; i0 < mc; i0 += GEMM_MR) {
+        int mr = mc - i0 < GEMM_MR ? mc - i0 : GEMM_MR;
+        float* dst = pa + i0 * kc;
+        if (csa == 1) {
+            for (int i = 0; i < GEMM_MR; i++) {
+                if (i < mr) {
+                    const float* src = A + (i0 + i) * rsa;
+                    for (int p = 0; p < kc; p++) { dst[p * GEMM_MR + i] = src[p]; }
+                } else {
+                    for (int p = 0; p < kc; p++) { dst[p * GEMM_MR + i] = 0.0f; }
+                }
+            }
+        } else {
+            for (int p = 0; p < kc; p++) {
+                const float* src = A + p * csa + i0 * rsa;
+                for (int i = 0; i < GEMM_MR; i++) {
+                    dst[p * GEMM_MR + i] = i < mr ? src[i * rsa] : 0.0f;
+                }
+            }
+        }
+    }
+}
+
+static void gemm_pack_b(float* pb, const float* B, int rsb, int csb, int kc, int nc) {
+    // pack a kc x nc block of B into NR-column micro-panels, zero padded at the edge
+    // within a micro-panel the layout is pb[p * NR + j], i.e. row-major
+    for (int j0 = 0; j0 < nc; j0 += GEMM_NR) {
+        int nr = nc - j0 < GEMM_NR ? nc - j0 : GEMM_NR;
+        float* dst = pb + j0 * kc;
+        if (csb == 1) {
+            for (int p = 0; p < kc; p++) {
+                const float* src = B + p * rsb + j0;
+                for (int j = 0; j < GEMM_NR; j++) {
+                    dst[p * GEMM_NR + j] = j < nr ? src[j] : 0.0f;
+                }
+            }
+        } else {
+            for (int j = 0; j < GEMM_NR; j++) {
+                if (j < nr) {
+                    const float* src = B + (j0 + j) * csb;
+                    for (int p = 0; p < kc; p++) { dst[p * GEMM_NR + j] = src[p * rsb]; }
+                } else {
+                    for (int p = 0; p < kc; p++) { dst[p * GEMM_NR + j] = 0.0f; }
+                }
+            }
+        }
+    }
+}
+
+static void gemm_micro_kernel(int kc, const float* pa, const float* pb,
+                              float* c, int ldc, int mr, int nr,
+                              int load_c, const float* bias) {
+    // computes an MR x NR block of C from one micro-panel of A and one of B
+    // the accumulators are sized so that they stay in vector registers
+    float acc[GEMM_MR][GEMM_NR];
+    for (int i = 0; i < GEMM_MR; i++) {
+        for (int j = 0; j < GEMM_NR; j++) { acc[i][j] = 0.0f; }
+    }
+    for (int p = 0; p < kc; p++) {
+        const float* a = pa + p * GEMM_MR;
+        const float* b = pb + p * GEMM_NR;
+        for (int i = 0; i < GEMM_MR; i++) {
+            float ai = a[i];
+            for (int j = 0; j < GEMM_NR; j++) {
+                acc[i][j] += ai * b[j];
+            }
+        }
+    }
+    // write out only the valid mr x nr region
+    for (int i = 0; i < mr; i++) {
+        float* c_i = c + i * ldc;
+        for (int j = 0; j < nr; j++) {
+            float base = load_c ? c_i[j] : (bias != NULL ? bias[j] : 0.0f);
+            c_i[j] = base + acc[i][j];
+        }
+    }
+}
+
+size_t gemm_packed_size(int K, int N) {
+    // number of floats that a K x N matrix B takes in the pre-packed layout (see gemm_prepack_b)
+    return (size_t)((N + GEMM_NR - 1) / GEMM_NR) * GEMM_NR * K;
+}
+
+void gemm_prepack_b(float* Bp, const float* B, int rsb, int csb, int K, int N) {
+    // pack all of B (K,N) once, ahead of time, in the layout that the micro-kernel reads:
+    // NR-column panels one after the other, each one K rows of NR contiguous floats.
+    // a KC slice of a panel is then contiguous already, so gemm_packed skips packing B
+    int num_panels = (N + GEMM_NR - 1) / GEMM_NR;
+    #pragma omp parallel for
+    for (int jp = 0; jp < num_panels; jp++) {
+        int j0 = jp * GEMM_NR;
+        int nr = N - j0 < GEMM_NR ? N - j0 : GEMM_NR;
+        float* dst = Bp + (size_t)j0 * K;
+        for (int j = 0; j < GEMM_NR; j++) {
+            if (j < nr) {
+                const float* src = B + (j0 + j) * csb;
+                for (int p = 0; p < K; p++) { dst[p * GEMM_NR + j] = src[p * rsb]; }
+            } else {
+                for (int p = 0; p < K; p++) { dst[p * GEMM_NR + j] = 0.0f; }
+            }
+        }
+    }
+}
+
+void gemm_prepack_b_bf16(bf16* Bp, const float* B, int rsb, int csb, int K, int N) {
+    // same as gemm_prepack_b, but the packed copy of B is stored in bf16
+    int num_panels = (N + GEMM_NR - 1) / GEMM_NR;
+    #pragma omp parallel for
+    for (int jp = 0; jp < num_panels; jp++) {
+        int j0 = jp * GEMM_NR;
+        int nr = N - j0 < GEMM_NR ? N - j0 : GEMM_NR;
+        bf16* dst = Bp + (size_t)j0 * K;
+        for (int j = 0; j < GEMM_NR; j++) {
+            if (j < nr) {
+                const float* src = B + (j0 + j) * csb;
+                for (int p = 0; p < K; p++) { dst[p * GEMM_NR + j] = float_to_bf16(src[p * rsb]); }
+            } else {
+                for (int p = 0; p < K; p++) { dst[p * GEMM_NR + j] = 0; }
+            }
+        }
+    }
+}
+
+// a weight-only quantized matrix B (K,N), for inference. every column (output channel)
+// is split into groups of group_size consecutive rows (input channels) that share one
+// fp32 scale, and the values are symmetric int8 or int4 multiples of that scale.
+// the quantized values use the panel layout of gemm_prepack_b, so that dequantizing a
+// KC slice of a panel is a single streaming pass; int4 packs two neighbouring columns
+// per byte, low nibble first, offset by 8. the scales of a panel are (K/group_size, NR)
+typedef struct {
+    int bits; // 8 or 4
+    int group_size; // divides K. group_size = K is per-channel quantization
+    int K, N;
+    int8_t* data; // gemm_packed_size(K, N) * bits / 8 bytes
+    float* scales; // gemm_packed_size(K, N) / group_size floats
+} QuantizedWeight;
+
+size_t quantized_weight_bytes(int K, int N, int bits, int group_size) {
+    // the number of bytes of data + scales of a quantized (K,N) matrix, scales first
+    size_t packed = gemm_packed_size(K, N);
+    return packed / group_size * sizeof(float) + packed * bits / 8;
+}
+
+void quantized_weight_point(QuantizedWeight* w, char* memory, int K, int N, int bits, int group_size) {
+    // lay out a quantized weight in memory of quantized_weight_bytes bytes
+    w->bits = bits;
+    w->group_size = group_size;
+    w->K = K;
+    w->N = N;
+    w->scales = (float*)memory;
+    w->data = (int8_t*)(memory + gemm_packed_size(K, N) / group_size * sizeof(float));
+}
+
+QuantizedWeight quantized_weight_slice(const QuantizedWeight* w, int n0, int n) {
+    // the columns [n0, n0+n) of w, n0 must be a multiple of GEMM_NR
+    QuantizedWeight slice = *w;
+    slice.N = n;
+    slice.data = w->data + (size_t)n0 * w->K * w->bits / 8;
+    slice.scales = w->scales + (size_t)n0 * (w->K / w->group_size);
+    return slice;
+}
+
+void quantize_weight(QuantizedWeight* w, const float* W) {
+    // quantize the weight W (N,K) of a forward matmul, i.e. B = W^T, into w (already pointed)
+    int K = w->K;
+    int N = w->N;
+    int G = w->group_size;
+    int num_groups = K / G;
+    int qmax = w->bits == 8 ? 127 : 7;
+    int num_panels = (N + GEMM_NR - 1) / GEMM_NR;
+    #pragma omp parallel for
+    for (int jp = 0; jp < num_panels; jp++) {
+        float* scales = w->scales + (size_t)jp * num_groups * GEMM_NR;
+        for (int j = 0; j < GEMM_NR; j++) {
+            int n = jp * GEMM_NR + j;
+            for (int g = 0; g < num_groups; g++) {
+                // symmetric quantization: the largest magnitude in the group maps to qmax
+                float maxabs = 0.0f;
+                for (int p = g * G; p < (g + 1) * G && n < N; p++) {
+                    float a = fabsf(W[(size_t)n * K + p]);
+                    if (a > maxabs) { maxabs = a; }
+                }
+                float scale = maxabs / qmax;
+                float iscale = scale > 0.0f ? 1.0f / scale : 0.0f;
+                scales[g * GEMM_NR + j] = scale;
+                for (int p = g * G; p < (g + 1) * G; p++) {
+                    int q = n < N ? (int)roundf(W[(size_t)n * K + p] * iscale) : 0;
+                    q = q > qmax ? qmax : (q < -qmax ? -qmax : q);
+                    size_t ix = ((size_t)jp * K + p) * GEMM_NR + j;
+                    if (w->bits == 8) {
+                        w->data[ix] = (int8_t)q;
+                    } else {
+                        uint8_t* byte = (uint8_t*)w->data + ix / 2;
+                        uint8_t nibble = (uint8_t)(q + 8);
+                        *byte = (j % 2 == 0) ? ((*byte & 0xF0) | nibble) : ((*byte & 0x0F) | (nibble << 4));
+                    }
+                }
+            }
+        }
+    }
+}
+
+static inline float quantized_weight_get(const QuantizedWeight* w, int p, int n) {
+    // the dequantized value of B(p, n) = W(n, p)
+    int jp = n / GEMM_NR;
+    int j = n % GEMM_NR;
+    size_t ix = ((size_t)jp * w->K + p) * GEMM_NR + j;
+    float scale = w->scales[((size_t)jp * (w->K / w->group_size) + p / w->group_size) * GEMM_NR + j];
+    int q = w->bits == 8 ? w->data[ix] : (((uint8_t)w->data[ix / 2] >> (4 * (j % 2))) & 15) - 8;
+    return q * scale;
+}
+
+static void gemm_dequantize_b(float* pb, const QuantizedWeight* w, int p0, int j0, int kc, int nc) {
+    // dequantize a kc x nc block of a quantized B into the pack buffer of gemm_impl
+    int num_groups = w->K / w->group_size;
+    for (int jr = 0; jr < nc; jr += GEMM_NR) {
+        int jp = (j0 + jr) / GEMM_NR;
+        const float* scales = w->scales + (size_t)jp * num_groups * GEMM_NR;
+        float* dst = pb + jr * kc;
+        for (int p = 0; p < kc; p++) {
+            const float* s = scales + ((p0 + p) / w->group_size) * GEMM_NR;
+            size_t ix = ((size_t)jp * w->K + p0 + p) * GEMM_NR;
+            float* d = dst + p * GEMM_NR;
+            if (w->bits == 8) {
+                const int8_t* src = w->data + ix;
+                for (int j = 0; j < GEMM_NR; j++) { d[j] = src[j] * s[j]; }
+            } else {
+                const uint8_t* src = (const uint8_t*)w->data + ix / 2;
+                for (int j = 0; j < GEMM_NR; j += 2) {
+                    d[j] = ((src[j / 2] & 15) - 8) * s[j];
+                    d[j + 1] = ((src[j / 2] >> 4) - 8) * s[j + 1];
+                }
+            }
+        }
+    }
+}
+
+static void gemm_impl(int M, int N, int K,
+                      const float* A, int rsa, int csa,
+                      const float* B, int rsb, int csb, const float* Bp, const bf16* Bh, const QuantizedWeight* Bq,
+                      float* C, int ldc, int accumulate, const float* bias) {
+    // the engine behind gemm and gemm_packed. B is either strided (B, rsb, csb),
+    // or pre-packed (Bp != NULL), in which case its micro-panels are read in place,
+    // or pre-packed in bf16 (Bh != NULL), in which case every KC slice of its panels
+    // is widened to fp32 into the pack buffer, which reads half the bytes of fp32 panels,
+    // or quantized (Bq != NULL), in which case the slices are dequantized the same way
+    int m_tiles = (M + GEMM_MC - 1) / GEMM_MC;
+    int n_tiles = (N + GEMM_NC - 1) / GEMM_NC;
+    if (K == 0) {
+        if (!accumulate) {
+            for (int i = 0; i < M; i++) {
+                for (int j = 0; j < N; j++) { C[i * ldc + j] = bias != NULL ? bias[j] : 0.0f; }
+            }
+        }
+        return;
+    }
+    #pragma omp parallel
+    {
+        // every thread packs into its own buffers, so the tile loop below is race-free
+        float* pa = (float*)malloc(GEMM_MC * GEMM_KC * sizeof(float));
+        float* pb = (float*)malloc(GEMM_KC * GEMM_NC * sizeof(float));
+        #pragma omp for collapse(2) schedule(static)
+        for (int jt = 0; jt < n_tiles; jt++) {
+            for (int it = 0; it < m_tiles; it++) {
+                int j0 = jt * GEMM_NC;
+                int i0 = it * GEMM_MC;
+                int nc = N - j0 < GEMM_NC ? N - j0 : GEMM_NC;
+                int mc = M - i0 < GEMM_MC ? M - i0 : GEMM_MC;
+                for (int p0 = 0; p0 < K; p0 += GEMM_KC) {
+                    int kc = K - p0 < GEMM_KC ? K - p0 : GEMM_KC;
+                    if (Bq != NULL) {
+                        gemm_dequantize_b(pb, Bq, p0, j0, kc, nc);
+                    } else if (Bh != NULL) {
+                        for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                            const bf16* src = Bh + (size_t)(j0 + jr) * K + p0 * GEMM_NR;
+                            float* dst = pb + jr * kc;
+                            for (int q = 0; q < kc * GEMM_NR; q++) { dst[q] = bf16_to_float(src[q]); }
+                        }
+                    } else if (Bp == NULL) {
+                        gemm_pack_b(pb, B + p0 * rsb + j0 * csb, rsb, csb, kc, nc);
+                    }
+                    gemm_pack_a(pa, A + i0 * rsa + p0 * csa, rsa, csa, mc, kc);
+                    int load_c = accumulate || p0 > 0;
+                    for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                        int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+                        const float* bias_j = bias != NULL ? bias + j0 + jr : NULL;
+                        const float* pb_j = Bp != NULL ? Bp + (size_t)(j0 + jr) * K + p0 * GEMM_NR : pb + jr * kc;
+                        for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                            int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                            float* c = C + (i0 + ir) * ldc + j0 + jr;
+                            gemm_micro_kernel(kc, pa + ir * kc, pb_j, c, ldc, mr, nr, load_c, bias_j);
+                        }
+                    }
+                }
+            }
+        }
+        free(pa);
+        free(pb);
+    }
+}
+
+void gemm(int M, int N, int K,
+          const float* A, int rsa, int csa,
+          const float* B, int rsb, int csb,
+          float* C, int ldc, int accumulate, const float* bias) {
+    // C (M,N) with row stride ldc. A(i,p) = A[i*rsa + p*csa], B(p,j) = B[p*rsb + j*csb]
+    // if accumulate is set, C += A @ B, otherwise C = A @ B + bias (bias is (N), may be NULL)
+    gemm_impl(M, N, K, A, rsa, csa, B, rsb, csb, NULL, NULL, NULL, C, ldc, accumulate, bias);
+}
+
+void gemm_packed(int M, int N, int K,
+                 const float* A, int rsa, int csa,
+                 const float* Bp,
+                 float* C, int ldc, int accumulate, const float* bias) {
+    // same as gemm, with B given in the pre-packed layout of gemm_prepack_b
+    gemm_impl(M, N, K, A, rsa, csa, NULL, 0, 0, Bp, NULL, NULL, C, ldc, accumulate, bias);
+}
+
+void gemm_packed_bf16(int M, int N, int K,
+                      const float* A, int rsa, int csa,
+                      const bf16* Bh,
+                      float* C, int ldc, int accumulate, const float* bias) {
+    // same as gemm_packed, with B pre-packed in bf16 by gemm_prepack_b_bf16
+    gemm_impl(M, N, K, A, rsa, csa, NULL, 0, 0, NULL, Bh, NULL, C, ldc, accumulate, bias);
+}
+
+void gemm_quantized(int M, int N, int K,
+                    const float* A, int rsa, int csa,
+                    const QuantizedWeight* Bq,
+                    float* C, int ldc, int accumulate, const float* bias) {
+    // same as gemm_packed, with B quantized by quantize_weight
+    gemm_impl(M, N, K, A, rsa, csa, NULL, 0, 0, NULL, NULL, Bq, C, ldc, accumulate, bias);
+}
+
+void gemm_weight(int M, int N, int K,
+                 const float* A, int rsa,
+                 const float* W, const float* Wp, const bf16* Wh, const QuantizedWeight* Wq,
+                 float* C, int ldc, const float* bias) {
+    // C (M,N) = A (M,K) @ W^T + bias, for a weight W (N,K): the product of every forward matmul.
+    // the model can keep W in several layouts, and the first non-NULL one of Wq (quantized),
+    // Wh (pre-packed bf16), Wp (pre-packed fp32) and W (plain row-major) is used
+    if (Wq != NULL) {
+        gemm_quantized(M, N, K, A, rsa, 1, Wq, C, ldc, 0, bias);
+    } else if (Wh != NULL) {
+        gemm_packed_bf16(M, N, K, A, rsa, 1, Wh, C, ldc, 0, bias);
+    } else if (Wp != NULL) {
+        gemm_packed(M, N, K, A, rsa, 1, Wp, C, ldc, 0, bias);
+    } else {
+        gemm(M, N, K, A, rsa, 1, W, 1, K, C, ldc, 0, bias);
+    }
+}
+
+void matmul_forward_naive(float* out,
+                          float* inp, float* weight, float* bias,
+                          int B, int T, int C, int OC) {
+    // the most naive implementation of matmul, kept around as the reference
+    // that the blocked version below is checked against (see dev/cpu)
     #pragma omp parallel for collapse(2)
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
@@ -174,19 +645,64 @@ void matmul_forward(float* out,
     }
 }
 
-void matmul_backward(float* dinp, float* dweight, float* dbias,
-                     float* dout, float* inp, float* weight,
-                     int B, int T, int C, int OC) {
-    // most of the running time is spent here and in matmul_forward
+void matmul_forward(float* out,
+                    float* inp, float* weight, float* bias,
+                    int B, int T, int C, int OC) {
+    // most of the running time is spent here and in matmul_backward
+    // OC is short for "output channels"
+    // inp is (B,T,C), weight is (OC, C), bias is (OC)
+    // out will be (B,T,OC)
+    // this is out = inp @ weight^T + bias, with all (b,t) rows folded into one GEMM
+    // the transpose of weight is expressed through the strides: B(c,o) = weight[o*C + c]
+    gemm(B*T, OC, C, inp, C, 1, weight, 1, C, out, OC, 0, bias);
+}
+
+void matmul_forward_packed(float* out,
+                           float* inp, float* weight, float* weight_packed, bf16* weight_bf16,
+                           QuantizedWeight* weight_q, float* bias,
+                           int B, int T, int C, int OC) {
+    // same as matmul_forward, but if the weight was pre-packed with gemm_prepack_b
+    // (as the C x OC matrix weight^T), in fp32 (weight_packed) or bf16 (weight_bf16),
+    // or quantized (weight_q), that copy is used and there is no per-call packing of the weight
+    gemm_weight(B*T, OC, C, inp, C, weight, weight_packed, weight_bf16, weight_q, out, OC, bias);
+}
+
+void encoder_forward_packed(float* out,
+                            int* inp, float* wte_packed, bf16* wte_bf16, QuantizedWeight* wte_q, float* wpe,
+                            int B, int T, int C) {
+    // same as encoder_forward, but reading the token embeddings out of a wte that was
+    // pre-packed for the classifier matmul, in fp32 (wte_packed), bf16 (wte_bf16) or
+    // quantized (wte_q): the C values of token ix sit NR apart inside the panel that holds ix
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* out_bt = out + b * T * C + t * C;
+            int ix = inp[b * T + t];
+            size_t offset = (size_t)(ix / GEMM_NR) * GEMM_NR * C + ix % GEMM_NR;
+            float* wpe_t = wpe + t * C;
+            for (int i = 0; i < C; i++) {
+                float w = wte_q != NULL ? quantized_weight_get(wte_q, i, ix)
+                        : wte_bf16 != NULL ? bf16_to_float(wte_bf16[offset + i * GEMM_NR]) : wte_packed[offset + i * GEMM_NR];
+                out_bt[i] = w + wpe_t[i];
+            }
+        }
+    }
+}
+
+#ifndef INFERENCE_ONLY
+void matmul_backward_naive(float* dinp, float* dweight, float* dbias,
+                           float* dout, float* inp, float* weight,
+                           int B, int T, int C, int OC) {
+    // the most naive implementation of the matmul backward, kept as the reference
     // this backward could be done in a single "round" of loops
     // but that doesn't afford an efficient parallelization strategy
 
-    // backward into inp first, parallelize over B,T
+    // backward into inp first, parallelize over B,T. dinp is written, not accumulated
     #pragma omp parallel for collapse(2)
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             float* dout_bt = dout + b * T * OC + t * OC;
             float* dinp_bt = dinp + b * T * C + t * C;
+            for (int i = 0; i < C; i++) { dinp_bt[i] = 0.0f; }
             for (int o = 0; o < OC; o++) {
                 float* wrow = weight + o*C;
                 float d = dout_bt[o];
@@ -214,6 +730,39 @@ void matmul_backward(float* dinp, float* dweight, float* dbias,
     }
 }
 
+void matmul_backward(float* dinp, float* dweight, float* dbias,
+                     float* dout, float* inp, float* weight,
+                     int B, int T, int C, int OC) {
+    // most of the running time is spent here and in matmul_forward
+    // the backward is two GEMMs on the same engine as the forward pass:
+    // dinp (BT,C) = dout (BT,OC) @ weight (OC,C). every input has this matmul as its only
+    // consumer, so dinp is written rather than accumulated and needs no zeroing beforehand
+    gemm(B*T, C, OC, dout, OC, 1, weight, C, 1, dinp, C, 0, NULL);
+    // dweight (OC,C) += dout^T (OC,BT) @ inp (BT,C), the transpose is again only strides
+    gemm(OC, C, B*T, dout, 1, OC, inp, C, 1, dweight, C, 1, NULL);
+    // dbias (OC) += column sums of dout. every thread owns a contiguous chunk of
+    // output channels and streams over the rows, so the inner loop is unit-stride
+    if (dbias != NULL) {
+        int chunk = 256;
+        int num_chunks = (OC + chunk - 1) / chunk;
+        #pragma omp parallel for
+        for (int c = 0; c < num_chunks; c++) {
+            int o0 = c * chunk;
+            int o1 = o0 + chunk < OC ? o0 + chunk : OC;
+            float acc[256];
+            for (int o = o0; o < o1; o++) { acc[o - o0] = 0.0f; }
+            for (int bt = 0; bt < B*T; bt++) {
+                float* dout_bt = dout + bt * OC;
+                for (int o = o0; o < o1; o++) {
+                    acc[o - o0] += dout_bt[o];
+                }
+            }
+            for (int o = o0; o < o1; o++) { dbias[o] += acc[o - o0]; }
+        }
+    }
+}
+#endif // INFERENCE_ONLY
+
 void attention_forward(float* out, float* preatt, float* att,
                        float* inp,
                        int B, int T, int C, int NH) {
@@ -290,19 +839,29 @@ void attention_forward(float* out, float* preatt, float* att,
     }
 }
 
+#ifndef INFERENCE_ONLY
 void attention_backward(float* dinp, float* dpreatt, float* datt,
                         float* dout, float* inp, float* att,
                         int B, int T, int C, int NH) {
     // inp/dinp are (B, T, 3C) Q,K,V
     // att/datt/dpreatt are (B, NH, T, T)
     // dout is (B, T, C)
+    // we parallelize over (b,h): every write into dinp of head h of sequence b comes from
+    // the queries of that same (b,h), so the threads never touch the same dkey/dvalue
+    // dinp is written, not accumulated: each (b,h) first zeroes its own q,k,v slices,
+    // and datt/dpreatt are only scratch
     int C3 = C*3;
     int hs = C / NH; // head size
     float scale = 1.0 / sqrtf(hs);
 
+    #pragma omp parallel for collapse(2)
     for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            for (int h = 0; h < NH; h++) {
+        for (int h = 0; h < NH; h++) {
+            for (int t = 0; t < T; t++) {
+                float* dinp_bth = dinp + b * T * C3 + t * C3 + h * hs;
+                for (int i = 0; i < hs; i++) { dinp_bth[i] = 0.0f; dinp_bth[C + i] = 0.0f; dinp_bth[2*C + i] = 0.0f; }
+            }
+            for (int t = 0; t < T; t++) {
                 float* att_bth = att + b*NH*T*T + h*T*T + t*T;
                 float* datt_bth = datt + b*NH*T*T + h*T*T + t*T;
                 float* dpreatt_bth = dpreatt + b*NH*T*T + h*T*T + t*T;
@@ -314,6 +873,7 @@ void attention_backward(float* dinp, float* dpreatt, float* datt,
                 for (int t2 = 0; t2 <= t; t2++) {
                     float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
                     float* dvalue_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C*2;
+                    datt_bth[t2] = 0.0f;
                     for (int i = 0; i < hs; i++) {
                         // in the forward pass this was:
                         // out_bth[i] += att_bth[t2] * value_t2[i];
@@ -325,12 +885,15 @@ void attention_backward(float* dinp, float* dpreatt, float* datt,
 
                 // backward pass 2 & 3, the softmax
                 // note that softmax (like e.g. tanh) doesn't need the input (preatt) to backward
+                // the Jacobian is att[t3] * (indicator(t2 == t3) - att[t2]), and contracting it
+                // with datt collapses to att[t3] * (datt[t3] - sum_t2 att[t2] * datt[t2]),
+                // so one dot product replaces the double loop over t2 and t3
+                float dsum = 0.0f;
                 for (int t2 = 0; t2 <= t; t2++) {
-                    for (int t3 = 0; t3 <= t; t3++) {
-                        float indicator = t2 == t3 ? 1.0f : 0.0f;
-                        float local_derivative = att_bth[t2] * (indicator - att_bth[t3]);
-                        dpreatt_bth[t3] += local_derivative * datt_bth[t2];
-                    }
+                    dsum += att_bth[t2] * datt_bth[t2];
+                }
+                for (int t3 = 0; t3 <= t; t3++) {
+                    dpreatt_bth[t3] = att_bth[t3] * (datt_bth[t3] - dsum);
                 }
 
                 // backward pass 1, the query @ key matmul
@@ -349,6 +912,309 @@ void attention_backward(float* dinp, float* dpreatt, float* datt,
         }
     }
 }
+#endif // INFERENCE_ONLY
+
+// flash-style attention: the same math as above, but never materializing (T,T) tensors
+// queries are processed in tiles of ATTN_BQ rows against tiles of ATTN_BK keys, so a
+// tile of K/V is reused by several queries while it is in cache. the softmax is computed
+// online: a running max and sum per query row, rescaling the partial output whenever
+// the max grows. only these two statistics per row are kept for the backward pass,
+// which recomputes the attention scores from Q and K.
+#define ATTN_BQ 16
+#define ATTN_BK 64
+
+void attention_forward_flash(float* out, float* rowmax, float* rowsum,
+                             float* inp,
+                             int B, int T, int C, int NH) {
+    // input is (B, T, 3C) holding the query, key, value (Q, K, V) vectors
+    // rowmax, rowsum are (B, NH, T), the softmax statistics of every query row (NULL = not needed)
+    // output is (B, T, C)
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.0 / sqrtf(hs);
+    int num_qtiles = (T + ATTN_BQ - 1) / ATTN_BQ;
+
+    #pragma omp parallel
+    {
+        float* acc = (float*)malloc(ATTN_BQ * hs * sizeof(float)); // unnormalized outputs of the tile
+        float scores[ATTN_BK];
+        float m[ATTN_BQ];
+        float l[ATTN_BQ];
+        #pragma omp for collapse(3)
+        for (int b = 0; b < B; b++) {
+            for (int h = 0; h < NH; h++) {
+                for (int qt = 0; qt < num_qtiles; qt++) {
+                    int t0 = qt * ATTN_BQ;
+                    int t1 = t0 + ATTN_BQ < T ? t0 + ATTN_BQ : T;
+                    for (int i = 0; i < ATTN_BQ; i++) { m[i] = -FLT_MAX; l[i] = 0.0f; }
+                    for (int i = 0; i < ATTN_BQ * hs; i++) { acc[i] = 0.0f; }
+
+                    // only keys up to t1-1 are visible to any query of this tile
+                    for (int k0 = 0; k0 < t1; k0 += ATTN_BK) {
+                        int k1 = k0 + ATTN_BK < t1 ? k0 + ATTN_BK : t1;
+                        for (int t = t0; t < t1; t++) {
+                            int kend = k1 < t + 1 ? k1 : t + 1; // causal mask
+                            if (kend <= k0) { continue; }
+                            float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+                            float* acc_t = acc + (t - t0) * hs;
+
+                            // query dot keys of this tile, and the tile max
+                            float tile_max = -FLT_MAX;
+                            for (int t2 = k0; t2 < kend; t2++) {
+                                float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
+                                float val = 0.0f;
+                                for (int i = 0; i < hs; i++) {
+                                    val += query_t[i] * key_t2[i];
+                                }
+                                val *= scale;
+                                scores[t2 - k0] = val;
+                                if (val > tile_max) { tile_max = val; }
+                            }
+
+                            // rescale what we have so far to the new max, then add this tile
+                            float m_new = m[t - t0] > tile_max ? m[t - t0] : tile_max;
+                            float correction = expf(m[t - t0] - m_new);
+                            l[t - t0] *= correction;
+                            for (int i = 0; i < hs; i++) { acc_t[i] *= correction; }
+                            for (int t2 = k0; t2 < kend; t2++) {
+                                float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
+                                float p = expf(scores[t2 - k0] - m_new);
+                                l[t - t0] += p;
+                                for (int i = 0; i < hs; i++) {
+                                    acc_t[i] += p * value_t2[i];
+                                }
+                            }
+                            m[t - t0] = m_new;
+                        }
+                    }
+
+                    // normalize and write out, keeping the statistics for the backward pass
+                    for (int t = t0; t < t1; t++) {
+                        float* out_bth = out + b * T * C + t * C + h * hs;
+                        float* acc_t = acc + (t - t0) * hs;
+                        float inv = 1.0f / l[t - t0];
+                        for (int i = 0; i < hs; i++) { out_bth[i] = acc_t[i] * inv; }
+                        if (rowmax != NULL) {
+                            rowmax[b*NH*T + h*T + t] = m[t - t0];
+                            rowsum[b*NH*T + h*T + t] = l[t - t0];
+                        }
+                    }
+                }
+            }
+        }
+        free(acc);
+    }
+}
+
+// the keys and values of incremental decoding (see gpt2_decode_batch) are paged: they live
+// in blocks of KV_BLOCK positions that the sequences take from one pool of the model as they
+// grow, and give back when they are done. so the memory follows the tokens that are actually
+// in flight, not the max_seq_len of every sequence. a block holds its positions for every
+// layer: per layer KV_BLOCK keys (KV_BLOCK, C), then KV_BLOCK values (KV_BLOCK, C)
+#define KV_BLOCK 16
+#define KV_POOL_CHUNK 16 // the pool grows by this many blocks at a time
+
+typedef struct {
+    size_t block_floats; // L * 2 * KV_BLOCK * C
+    int num_blocks; // the blocks allocated so far
+    int num_free;
+    int max_used; // the most blocks that were in use at the same time
+    float** blocks; // (num_blocks) every block
+    int* refs; // (num_blocks) the KV caches (and the PrefixCache) that hold every block
+    int* free_list; // (num_blocks) the free blocks, as a stack
+    float** chunks; // (num_blocks / KV_POOL_CHUNK) the allocations that hold the blocks
+} KVPool;
+
+typedef struct {
+    KVPool* pool;
+    int capacity; // the most positions the sequence can have, at most max_seq_len
+    int len; // the positions filled so far
+    int num_blocks; // the blocks taken so far, for positions 0..num_blocks*KV_BLOCK-1
+    int* table; // (capacity / KV_BLOCK, rounded up) the block of every KV_BLOCK positions
+} KVCache;
+
+int kv_pool_take(KVPool* pool) {
+    // a free block, allocating another chunk of them if there is none
+    if (pool->num_free == 0) {
+        int n = pool->num_blocks + KV_POOL_CHUNK;
+        float* chunk = (float*)alloc_large(KV_POOL_CHUNK * pool->block_floats * sizeof(float));
+        pool->blocks = (float**)realloc(pool->blocks, n * sizeof(float*));
+        pool->refs = (int*)realloc(pool->refs, n * sizeof(int));
+        pool->free_list = (int*)realloc(pool->free_list, n * sizeof(int));
+        pool->chunks = (float**)realloc(pool->chunks, (n / KV_POOL_CHUNK) * sizeof(float*));
+        pool->chunks[n / KV_POOL_CHUNK - 1] = chunk;
+        // the first block of the chunk goes on top of the stack
+        for (int i = KV_POOL_CHUNK - 1; i >= 0; i--) {
+            pool->blocks[pool->num_blocks + i] = chunk + i * pool->block_floats;
+            pool->refs[pool->num_blocks + i] = 0;
+            pool->free_list[pool->num_free++] = pool->num_blocks + i;
+        }
+        pool->num_blocks = n;
+    }
+    int block = pool->free_list[--pool->num_free];
+    int used = pool->num_blocks - pool->num_free;
+    if (used > pool->max_used) { pool->max_used = used; }
+    pool->refs[block] = 1;
+    return block;
+}
+
+void kv_pool_ref(KVPool* pool, int block) {
+    // one more holder of a block, which then is shared: nobody writes into it anymore
+    pool->refs[block]++;
+}
+
+void kv_pool_give(KVPool* pool, int block) {
+    // drop one reference, the last one frees the block
+    if (--pool->refs[block] == 0) { pool->free_list[pool->num_free++] = block; }
+}
+
+void kv_pool_free(KVPool* pool) {
+    for (int i = 0; i < pool->num_blocks / KV_POOL_CHUNK; i++) { free_large(pool->chunks[i]); }
+    free(pool->blocks);
+    free(pool->refs);
+    free(pool->free_list);
+    free(pool->chunks);
+}
+
+void attention_forward_cached(float* out,
+                              float* qkv, float** blocks, int** tables, int* positions,
+                              size_t layer_offset, int N, int C, int NH) {
+    // attention of N new rows against the keys and values of all positions so far, for
+    // incremental decoding (see gpt2_decode_batch). the rows can belong to different sequences
+    // qkv is (N, 3C), the query, key, value of the new rows. only the queries are read here:
+    // row n is at position positions[n] of its sequence, whose keys and values are paged
+    // (see KVCache): position t is in block tables[n][t / KV_BLOCK], and the keys of this layer
+    // start at layer_offset in every block, followed by the values. they already hold the
+    // key and value of the row itself
+    // output is (N, C)
+    // every row is a single query per head, an online softmax over tiles of ATTN_BK keys
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.0 / sqrtf(hs);
+
+    #pragma omp parallel
+    {
+        float* acc = (float*)malloc(hs * sizeof(float));
+        float scores[ATTN_BK];
+        // consecutive rows of the same head mostly read the same keys and values (the rows
+        // of a prefill), so they go together
+        #pragma omp for collapse(2)
+        for (int h = 0; h < NH; h++) {
+            for (int n = 0; n < N; n++) {
+                float* query = qkv + n * C3 + h * hs;
+                int* table = tables[n];
+                int kend = positions[n] + 1; // causal mask: the row sees itself and everything before
+                float m = -FLT_MAX;
+                float l = 0.0f;
+                for (int i = 0; i < hs; i++) { acc[i] = 0.0f; }
+                for (int k0 = 0; k0 < kend; k0 += ATTN_BK) {
+                    int k1 = k0 + ATTN_BK < kend ? k0 + ATTN_BK : kend;
+                    float tile_max = -FLT_MAX;
+                    for (int t2 = k0; t2 < k1; t2++) {
+                        float* key_t2 = blocks[table[t2 / KV_BLOCK]] + layer_offset + (t2 % KV_BLOCK) * C + h * hs;
+                        float val = 0.0f;
+                        for (int i = 0; i < hs; i++) {
+                            val += query[i] * key_t2[i];
+                        }
+                        val *= scale;
+                        scores[t2 - k0] = val;
+                        if (val > tile_max) { tile_max = val; }
+                    }
+                    float m_new = m > tile_max ? m : tile_max;
+                    float correction = expf(m - m_new);
+                    l *= correction;
+                    for (int i = 0; i < hs; i++) { acc[i] *= correction; }
+                    for (int t2 = k0; t2 < k1; t2++) {
+                        float* value_t2 = blocks[table[t2 / KV_BLOCK]] + layer_offset + (KV_BLOCK + t2 % KV_BLOCK) * C + h * hs;
+                        float p = expf(scores[t2 - k0] - m_new);
+                        l += p;
+                        for (int i = 0; i < hs; i++) {
+                            acc[i] += p * value_t2[i];
+                        }
+                    }
+                    m = m_new;
+                }
+                float* out_nh = out + n * C + h * hs;
+                float inv = 1.0f / l;
+                for (int i = 0; i < hs; i++) { out_nh[i] = acc[i] * inv; }
+            }
+        }
+        free(acc);
+    }
+}
+
+#ifndef INFERENCE_ONLY
+void attention_backward_flash(float* dinp,
+                              float* dout, float* inp, float* rowmax, float* rowsum,
+                              int B, int T, int C, int NH) {
+    // inp/dinp are (B, T, 3C) Q,K,V
+    // rowmax, rowsum are (B, NH, T), as saved by attention_forward_flash
+    // dout is (B, T, C)
+    // each (b,h) is handled by a single thread: the only writes into dkey/dvalue of
+    // head h of sequence b come from the queries of that same (b,h), so this is race-free
+    // as in attention_backward, dinp is written: each (b,h) zeroes its slices first
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.0 / sqrtf(hs);
+
+    #pragma omp parallel
+    {
+        float* att_row = (float*)malloc(T * sizeof(float));
+        float* datt_row = (float*)malloc(T * sizeof(float));
+        #pragma omp for collapse(2)
+        for (int b = 0; b < B; b++) {
+            for (int h = 0; h < NH; h++) {
+                for (int t = 0; t < T; t++) {
+                    float* dinp_bth = dinp + b * T * C3 + t * C3 + h * hs;
+                    for (int i = 0; i < hs; i++) { dinp_bth[i] = 0.0f; dinp_bth[C + i] = 0.0f; dinp_bth[2*C + i] = 0.0f; }
+                }
+                for (int t = 0; t < T; t++) {
+                    float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+                    float* dquery_t = dinp + b * T * C3 + t * C3 + h * hs;
+                    float* dout_bth = dout + b * T * C + t * C + h * hs;
+                    float m = rowmax[b*NH*T + h*T + t];
+                    float inv_l = 1.0f / rowsum[b*NH*T + h*T + t];
+
+                    // recompute the attention row, and backward through the value accumulation
+                    // dsum is sum_t2 att[t2] * datt[t2], which the softmax backward needs
+                    float dsum = 0.0f;
+                    for (int t2 = 0; t2 <= t; t2++) {
+                        float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
+                        float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
+                        float* dvalue_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C*2;
+                        float val = 0.0f;
+                        float datt = 0.0f;
+                        for (int i = 0; i < hs; i++) {
+                            val += query_t[i] * key_t2[i];
+                            datt += value_t2[i] * dout_bth[i];
+                        }
+                        float att = expf(val * scale - m) * inv_l;
+                        for (int i = 0; i < hs; i++) {
+                            dvalue_t2[i] += att * dout_bth[i];
+                        }
+                        att_row[t2] = att;
+                        datt_row[t2] = datt;
+                        dsum += att * datt;
+                    }
+
+                    // backward through the softmax and the query @ key matmul
+                    for (int t2 = 0; t2 <= t; t2++) {
+                        float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
+                        float* dkey_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
+                        float dpreatt = att_row[t2] * (datt_row[t2] - dsum) * scale;
+                        for (int i = 0; i < hs; i++) {
+                            dquery_t[i] += key_t2[i] * dpreatt;
+                            dkey_t2[i] += query_t[i] * dpreatt;
+                        }
+                    }
+                }
+            }
+        }
+        free(att_row);
+        free(datt_row);
+    }
+}
+#endif // INFERENCE_ONLY
 
 #define GELU_SCALING_FACTOR sqrtf(2.0f / M_PI)
 void gelu_forward(float* out, float* inp, int N) {
@@ -361,6 +1227,7 @@ void gelu_forward(float* out, float* inp, int N) {
 }
 
 void gelu_backward(float* dinp, float* inp, float* dout, int N) {
+    // dinp is written, not accumulated, and may be the same buffer as dout
     for (int i = 0; i < N; i++) {
         float x = inp[i];
         float cube = 0.044715f * x * x * x;
@@ -369,7 +1236,7 @@ void gelu_backward(float* dinp, float* inp, float* dout, int N) {
         float coshf_out = coshf(tanh_arg);
         float sech_out = 1.0f / (coshf_out * coshf_out);
         float local_grad = 0.5f * (1.0f + tanh_out) + x * 0.5f * sech_out * GELU_SCALING_FACTOR * (1.0f + 3.0f * 0.044715f * x * x);
-        dinp[i] += local_grad * dout[i];
+        dinp[i] = local_grad * dout[i];
     }
 }
 
@@ -434,7 +1301,7 @@ void crossentropy_forward(float* losses,
 void crossentropy_softmax_backward(float* dlogits,
                            float* dlosses, float* probs, int* targets,
                            int B, int T, int V) {
-    // backwards through both softmax and crossentropy
+    // backwards through both softmax and crossentropy. dlogits is written, not accumulated
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             float* dlogits_bt = dlogits + b * T * V + t * V;
@@ -444,45 +1311,282 @@ void crossentropy_softmax_backward(float* dlogits,
             for (int i = 0; i < V; i++) {
                 float p = probs_bt[i];
                 float indicator = i == ix ? 1.0f : 0.0f;
-                dlogits_bt[i] += (p - indicator) * dloss;
+                dlogits_bt[i] = (p - indicator) * dloss;
             }
         }
     }
 }
 
-// ----------------------------------------------------------------------------
-// GPT-2 model definition
+// the fused classifier: lm-head matmul + softmax + crossentropy (+ backward) in one place
+// the (B,T,V) logits/probs are never materialized. the rows are processed in chunks of
+// CLS_CHUNK_BT positions against chunks of CLS_CHUNK_V vocabulary entries, and only a
+// CLS_CHUNK_BT x CLS_CHUNK_V scratch block of logits exists at any time. the forward pass
+// runs an online softmax over the vocabulary chunks and keeps the log-sum-exp of every row.
+// the backward pass recomputes each logits block from it, turns it into dlogits in place
+// and feeds it straight into the dinp and dwte GEMMs. this costs one extra classifier matmul.
+#define CLS_CHUNK_BT 128
+#define CLS_CHUNK_V 2048
+
+static void classifier_logits_block(float* logits, float* inp,
+                                    float* wte, float* wte_packed, bf16* wte_bf16, QuantizedWeight* wte_q,
+                                    int v0, int nr, int nv, int C) {
+    // logits (nr,nv) = inp (nr,C) @ wte[v0:v0+nv]^T. v0 is a multiple of CLS_CHUNK_V and
+    // therefore of GEMM_NR, so the packed copies of wte start at panel boundaries
+    QuantizedWeight wte_q_slice;
+    if (wte_q != NULL) { wte_q_slice = quantized_weight_slice(wte_q, v0, nv); }
+    gemm_weight(nr, nv, C, inp, C,
+                wte != NULL ? wte + (size_t)v0 * C : NULL,
+                wte_packed != NULL ? wte_packed + (size_t)v0 * C : NULL,
+                wte_bf16 != NULL ? wte_bf16 + (size_t)v0 * C : NULL,
+                wte_q != NULL ? &wte_q_slice : NULL,
+                logits, nv, NULL);
+}
 
-// the parameters of the model
-#define NUM_PARAMETER_TENSORS 16
-typedef struct {
-    float* wte; // (V, C)
-    float* wpe; // (maxT, C)
-    float* ln1w; // (L, C)
-    float* ln1b; // (L, C)
-    float* qkvw; // (L, 3*C, C)
-    float* qkvb; // (L, 3*C)
-    float* attprojw; // (L, C, C)
-    float* attprojb; // (L, C)
-    float* ln2w; // (L, C)
-    float* ln2b; // (L, C)
-    float* fcw; // (L, 4*C, C)
-    float* fcb; // (L, 4*C)
-    float* fcprojw; // (L, C, 4*C)
-    float* fcprojb; // (L, C)
-    float* lnfw; // (C)
-    float* lnfb; // (C)
-} ParameterTensors;
+void fused_classifier_forward(float* losses, float* lse,
+                              float* inp, float* wte, float* wte_packed, bf16* wte_bf16, QuantizedWeight* wte_q,
+                              int* targets, int B, int T, int C, int V) {
+    // output: losses is (B,T) of the individual losses, lse is (B,T) of the log-sum-exp
+    // input: inp is (B,T,C) (the output of the final layernorm), wte is (V,C)
+    // input: wte_packed / wte_bf16 / wte_q are NULL, or other copies of wte (see gemm_weight)
+    // input: targets is (B,T) of integers giving the correct index in logits
+    float* logits = (float*)malloc(CLS_CHUNK_BT * CLS_CHUNK_V * sizeof(float));
+    float rowmax[CLS_CHUNK_BT];
+    float rowsum[CLS_CHUNK_BT];
+    float target_logit[CLS_CHUNK_BT];
+    for (int r0 = 0; r0 < B*T; r0 += CLS_CHUNK_BT) {
+        int nr = B*T - r0 < CLS_CHUNK_BT ? B*T - r0 : CLS_CHUNK_BT;
+        for (int r = 0; r < nr; r++) { rowmax[r] = -FLT_MAX; rowsum[r] = 0.0f; }
+        for (int v0 = 0; v0 < V; v0 += CLS_CHUNK_V) {
+            int nv = V - v0 < CLS_CHUNK_V ? V - v0 : CLS_CHUNK_V;
+            // logits (nr,nv) = inp[r0:r0+nr] @ wte[v0:v0+nv]^T
+            classifier_logits_block(logits, inp + r0 * C, wte, wte_packed, wte_bf16, wte_q, v0, nr, nv, C);
+            #pragma omp parallel for
+            for (int r = 0; r < nr; r++) {
+                float* logits_r = logits + r * nv;
+                float maxval = rowmax[r];
+                for (int i = 0; i < nv; i++) {
+                    if (logits_r[i] > maxval) { maxval = logits_r[i]; }
+                }
+                float sum = rowsum[r] * expf(rowmax[r] - maxval);
+                for (int i = 0; i < nv; i++) {
+                    sum += expf(logits_r[i] - maxval);
+                }
+                rowmax[r] = maxval;
+                rowsum[r] = sum;
+                int ix = targets[r0 + r];
+                if (ix >= v0 && ix < v0 + nv) { target_logit[r] = logits_r[ix - v0]; }
+            }
+        }
+        for (int r = 0; r < nr; r++) {
+            // loss = -log(softmax[target]) = log(sum(exp(logits))) - logits[target]
+            lse[r0 + r] = rowmax[r] + logf(rowsum[r]);
+            losses[r0 + r] = lse[r0 + r] - target_logit[r];
+        }
+    }
+    free(logits);
+}
 
-// allocate memory for the parameters and point the individual tensors to the right places
+#ifndef INFERENCE_ONLY
+void fused_classifier_backward(float* dinp, float* dwte,
+                               float* dlosses, float* lse,
+                               float* inp, float* wte, float* wte_packed, bf16* wte_bf16, QuantizedWeight* wte_q,
+                               int* targets, int B, int T, int C, int V) {
+    // backwards through the crossentropy, the softmax and the classifier matmul
+    // dinp (B,T,C) = dlogits @ wte and dwte (V,C) += dlogits^T @ inp,
+    // where dlogits = (softmax(logits) - onehot(targets)) * dlosses, one block at a time
+    float* dlogits = (float*)malloc(CLS_CHUNK_BT * CLS_CHUNK_V * sizeof(float));
+    for (int r0 = 0; r0 < B*T; r0 += CLS_CHUNK_BT) {
+        int nr = B*T - r0 < CLS_CHUNK_BT ? B*T - r0 : CLS_CHUNK_BT;
+        for (int v0 = 0; v0 < V; v0 += CLS_CHUNK_V) {
+            int nv = V - v0 < CLS_CHUNK_V ? V - v0 : CLS_CHUNK_V;
+            // recompute the logits of this block, from the same copy of wte as the forward pass
+            classifier_logits_block(dlogits, inp + r0 * C, wte, wte_packed, wte_bf16, wte_q, v0, nr, nv, C);
+            // and turn them into dlogits in place
+            #pragma omp parallel for
+            for (int r = 0; r < nr; r++) {
+                float* dlogits_r = dlogits + r * nv;
+                float lse_r = lse[r0 + r];
+                float dloss = dlosses[r0 + r];
+                for (int i = 0; i < nv; i++) {
+                    dlogits_r[i] = expf(dlogits_r[i] - lse_r) * dloss;
+                }
+                int ix = targets[r0 + r];
+                if (ix >= v0 && ix < v0 + nv) { dlogits_r[ix - v0] -= dloss; }
+            }
+            gemm(nr, C, nv, dlogits, nv, 1, wte + v0 * C, C, 1, dinp + r0 * C, C, v0 > 0, NULL);
+            gemm(nv, C, nr, dlogits, 1, nv, inp + r0 * C, C, 1, dwte + v0 * C, C, 1, NULL);
+        }
+    }
+    free(dlogits);
+}
+#endif // INFERENCE_ONLY
+
+void adamw_update(float* params, float* grads, float* m, float* v, int n,
+                  float learning_rate, float beta1, float beta2,
+                  float beta1_correction, float beta2_correction,
+                  float eps, float weight_decay) {
+    // reference: https://pytorch.org/docs/stable/generated/torch.optim.AdamW.html
+    // the AdamW step of n parameters, with fp32 moments m and v. the bias corrections
+    // 1 - beta^t are the same for every parameter, so the caller computes them once
+    for (int i = 0; i < n; i++) {
+        float param = params[i];
+        float grad = grads[i];
+
+        // update the first moment (momentum)
+        float mi = beta1 * m[i] + (1.0f - beta1) * grad;
+        // update the second moment (RMSprop)
+        float vi = beta2 * v[i] + (1.0f - beta2) * grad * grad;
+        // bias-correct both moments
+        float m_hat = mi / beta1_correction;
+        float v_hat = vi / beta2_correction;
+
+        // update
+        m[i] = mi;
+        v[i] = vi;
+        params[i] -= learning_rate * (m_hat / (sqrtf(v_hat) + eps) + weight_decay * param);
+    }
+}
+
+void adamw_codes(float* m, float* v, int n, float* m_max, float* v_max) {
+    // the 8-bit codes of a block of AdamW moments, before the rounding: m becomes
+    // 127 * sign(m) * sqrt(|m| / max|m|) and v becomes 255 * (v / max v)^(1/4).
+    // the maxima are the scales of the block (see adamw_state_narrow)
+    float mx = 0.0f, vx = 0.0f;
+    for (int i = 0; i < n; i++) {
+        mx = fmaxf(mx, fabsf(m[i]));
+        vx = fmaxf(vx, v[i]);
+    }
+    float m_scale = mx > 0.0f ? 127.0f / sqrtf(mx) : 0.0f;
+    float v_inv = vx > 0.0f ? 1.0f / vx : 0.0f;
+    for (int i = 0; i < n; i++) {
+        m[i] = m[i] * m_scale / fmaxf(sqrtf(fabsf(m[i])), 1e-30f);
+        v[i] = 255.0f * sqrtf(sqrtf(v[i] * v_inv));
+    }
+    *m_max = mx;
+    *v_max = vx;
+}
+
+// ----------------------------------------------------------------------------
+// runtime kernel dispatch
+// the elementwise and normalization layers and the optimizer step are called through this table.
+// it starts out pointing at the reference functions above, and kernels_init
+// swaps in the fastest SIMD versions from llmc/simd.h that this CPU supports.
+// setting LLMC_KERNELS=reference|avx2|avx512|neon in the environment overrides the choice.
+
+typedef struct {
+    const char* name;
+    void (*layernorm_forward)(float* out, float* mean, float* rstd,
+                              float* inp, float* weight, float* bias, int B, int T, int C);
+    void (*layernorm_backward)(float* dinp, float* dweight, float* dbias,
+                               float* dout, float* inp, float* weight, float* mean, float* rstd,
+                               int B, int T, int C);
+    void (*gelu_forward)(float* out, float* inp, int N);
+    void (*gelu_backward)(float* dinp, float* inp, float* dout, int N);
+    void (*residual_forward)(float* out, float* inp1, float* inp2, int N);
+    void (*residual_backward)(float* dinp1, float* dinp2, float* dout, int N);
+    void (*softmax_forward)(float* probs, float* logits, int B, int T, int V);
+    void (*crossentropy_softmax_backward)(float* dlogits, float* dlosses, float* probs, int* targets,
+                                          int B, int T, int V);
+    void (*adamw_update)(float* params, float* grads, float* m, float* v, int n,
+                         float learning_rate, float beta1, float beta2,
+                         float beta1_correction, float beta2_correction, float eps, float weight_decay);
+    void (*adamw_codes)(float* m, float* v, int n, float* m_max, float* v_max);
+} LayerKernels;
+
+#define LAYER_KERNELS(name, suffix) { name, \
+    layernorm_forward##suffix, layernorm_backward##suffix, gelu_forward##suffix, gelu_backward##suffix, \
+    residual_forward##suffix, residual_backward##suffix, softmax_forward##suffix, crossentropy_softmax_backward##suffix, \
+    adamw_update##suffix, adamw_codes##suffix }
+
+LayerKernels kernels = LAYER_KERNELS("reference", );
+
+void kernels_init() {
+    // choose once, the first time a model is built
+    static int initialized = 0;
+    if (initialized) { return; }
+    initialized = 1;
+    const char* want = getenv("LLMC_KERNELS");
+    if (want != NULL && want[0] == '\0') { want = NULL; }
+    if (want != NULL && strcmp(want, "reference") != 0 && strcmp(want, "avx2") != 0
+        && strcmp(want, "avx512") != 0 && strcmp(want, "neon") != 0) {
+        printf("Warning: unknown LLMC_KERNELS=%s, using the reference kernels\n", want);
+        return;
+    }
+    if (want != NULL && strcmp(want, "reference") == 0) { return; }
+#ifdef SIMD_HAVE_X86
+    LayerKernels avx512 = LAYER_KERNELS("avx512", _avx512);
+    LayerKernels avx2 = LAYER_KERNELS("avx2", _avx2);
+    int use_avx512 = simd_has_avx512() && (want == NULL || strcmp(want, "avx512") == 0);
+    int use_avx2 = simd_has_avx2() && (want == NULL || strcmp(want, "avx2") == 0);
+    if (use_avx512) { kernels = avx512; } else if (use_avx2) { kernels = avx2; }
+#endif
+#ifdef SIMD_HAVE_NEON
+    LayerKernels neon = LAYER_KERNELS("neon", _neon);
+    if (want == NULL || strcmp(want, "neon") == 0) { kernels = neon; }
+#endif
+    if (want != NULL && strcmp(kernels.name, want) != 0) {
+        printf("Warning: LLMC_KERNELS=%s is not supported by this build or CPU, using %s\n", want, kernels.name);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// GPT-2 model definition
+
+// the parameters of the model
+#define NUM_PARAMETER_TENSORS 16
+typedef struct {
+    float* wte; // (V, C)
+    float* wpe; // (maxT, C)
+    float* ln1w; // (L, C)
+    float* ln1b; // (L, C)
+    float* qkvw; // (L, 3*C, C)
+    float* qkvb; // (L, 3*C)
+    float* attprojw; // (L, C, C)
+    float* attprojb; // (L, C)
+    float* ln2w; // (L, C)
+    float* ln2b; // (L, C)
+    float* fcw; // (L, 4*C, C)
+    float* fcb; // (L, 4*C)
+    float* fcprojw; // (L, C, 4*C)
+    float* fcprojb; // (L, C)
+    float* lnfw; // (C)
+    float* lnfb; // (C)
+} ParameterTensors;
+
+// allocate memory for the parameters and point the individual tensors to the right places
+void point_parameters(ParameterTensors* params, size_t* param_sizes, float* params_memory) {
+    // assign all the tensors
+    float** ptrs[] = {
+        &params->wte, &params->wpe, &params->ln1w, &params->ln1b, &params->qkvw, &params->qkvb,
+        &params->attprojw, &params->attprojb, &params->ln2w, &params->ln2b, &params->fcw, &params->fcb,
+        &params->fcprojw, &params->fcprojb, &params->lnfw, &params->lnfb
+    };
+    float* params_memory_iterator = params_memory;
+    for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+        *(ptrs[i]) = params_memory_iterator;
+        params_memory_iterator += param_sizes[i];
+    }
+}
 float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes) {
     size_t num_parameters = 0;
     for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
         num_parameters += param_sizes[i];
     }
-    // malloc all parameters all at once
-    float* params_memory = malloc(num_parameters * sizeof(float));
-    // assign all the tensors
+    // malloc all parameters all at once, first touched with the split of the flat loops
+    // over them (the optimizer, gpt2_zero_grad)
+    float* params_memory = (float*)alloc_large(num_parameters * sizeof(float));
+    alloc_zero(params_memory, num_parameters * sizeof(float), 1);
+    point_parameters(params, param_sizes, params_memory);
+    return params_memory;
+}
+
+// the parameter tensors that the forward matmuls can also read from packed or quantized
+// copies (see gpt2_forward), so that inference can drop their original layout
+static const int packable_parameters[NUM_PARAMETER_TENSORS] = {1, 0, 0, 0, 1, 0, 1, 0, 0, 0, 1, 0, 1, 0, 0, 0};
+
+void point_unpackable_parameters(ParameterTensors* params, size_t* param_sizes, float* params_memory) {
+    // same as point_parameters, but only for the tensors that are not packable,
+    // which are laid out back to back. the packable tensors are set to NULL
     float** ptrs[] = {
         &params->wte, &params->wpe, &params->ln1w, &params->ln1b, &params->qkvw, &params->qkvb,
         &params->attprojw, &params->attprojb, &params->ln2w, &params->ln2b, &params->fcw, &params->fcb,
@@ -490,12 +1594,34 @@ float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes
     };
     float* params_memory_iterator = params_memory;
     for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
-        *(ptrs[i]) = params_memory_iterator;
-        params_memory_iterator += param_sizes[i];
+        if (packable_parameters[i]) {
+            *(ptrs[i]) = NULL;
+        } else {
+            *(ptrs[i]) = params_memory_iterator;
+            params_memory_iterator += param_sizes[i];
+        }
+    }
+}
+float* malloc_and_point_unpackable_parameters(ParameterTensors* params, size_t* param_sizes) {
+    size_t num_parameters = 0;
+    for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+        if (!packable_parameters[i]) { num_parameters += param_sizes[i]; }
     }
+    float* params_memory = (float*)alloc_large(num_parameters * sizeof(float));
+    alloc_zero(params_memory, num_parameters * sizeof(float), 1);
+    point_unpackable_parameters(params, param_sizes, params_memory);
     return params_memory;
 }
 
+// the bf16 copies of the packed matmul weights in mixed precision mode, see gpt2_pack_weights
+typedef struct {
+    bf16* wte;
+    bf16* qkvw;
+    bf16* attprojw;
+    bf16* fcw;
+    bf16* fcprojw;
+} PackedTensorsBF16;
+
 #define NUM_ACTIVATION_TENSORS 23
 typedef struct {
     float* encoded; // (B, T, C)
@@ -504,8 +1630,8 @@ typedef struct {
     float* ln1_rstd; // (L, B, T)
     float* qkv; // (L, B, T, 3*C)
     float* atty; // (L, B, T, C)
-    float* preatt; // (L, B, NH, T, T)
-    float* att; // (L, B, NH, T, T)
+    float* preatt; // (L, B, NH, T, T), or the (L, B, NH, T) row maxima with flash attention
+    float* att; // (L, B, NH, T, T), or the (L, B, NH, T) row sums with flash attention
     float* attproj; // (L, B, T, C)
     float* residual2; // (L, B, T, C)
     float* ln2; // (L, B, T, C)
@@ -518,8 +1644,8 @@ typedef struct {
     float* lnf; // (B, T, C)
     float* lnf_mean; // (B, T)
     float* lnf_rstd; // (B, T)
-    float* logits; // (B, T, V)
-    float* probs; // (B, T, V)
+    float* logits; // (B, T, V), or the (B, T) log-sum-exp of every row with the fused classifier
+    float* probs; // (B, T, V), or (B, V) for the last position of every row with the fused classifier
     float* losses; // (B, T)
 } ActivationTensors;
 
@@ -528,7 +1654,8 @@ float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes)
     for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
         num_activations += act_sizes[i];
     }
-    float* acts_memory = malloc(num_activations * sizeof(float));
+    // not touched yet, see first_touch_activations
+    float* acts_memory = (float*)alloc_large(num_activations * sizeof(float));
     float** ptrs[] = {
         &acts->encoded, &acts->ln1, &acts->ln1_mean, &acts->ln1_rstd, &acts->qkv, &acts->atty,
         &acts->preatt, &acts->att, &acts->attproj, &acts->residual2, &acts->ln2, &acts->ln2_mean,
@@ -543,6 +1670,18 @@ float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes)
     return acts_memory;
 }
 
+void first_touch_activations(float* acts_memory, size_t* act_sizes, size_t* layer_sizes) {
+    // zero every tensor one layer at a time, each layer split over the threads like the
+    // kernels split its (b,t) rows, so that the pages of a thread's rows are local to it.
+    // layer_sizes holds the size of one layer of every tensor, or is NULL for one part each
+    float* iterator = acts_memory;
+    for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+        size_t slices = layer_sizes != NULL && layer_sizes[i] > 0 ? act_sizes[i] / layer_sizes[i] : 1;
+        alloc_zero(iterator, act_sizes[i] * sizeof(float), slices);
+        iterator += act_sizes[i];
+    }
+}
+
 typedef struct {
     int max_seq_len; // max sequence length, e.g. 1024
     int vocab_size; // vocab size, e.g. 50257
@@ -558,29 +1697,138 @@ typedef struct {
     size_t param_sizes[NUM_PARAMETER_TENSORS];
     float* params_memory;
     int num_parameters;
-    // gradients of the weights
-    ParameterTensors grads;
-    float* grads_memory;
-    // buffers for the AdamW optimizer
-    float* m_memory;
-    float* v_memory;
     // the activations of the model, and their sizes
     ActivationTensors acts;
     size_t act_sizes[NUM_ACTIVATION_TENSORS];
     float* acts_memory;
     int num_activations;
+#ifndef INFERENCE_ONLY
+    // gradients of the weights
+    ParameterTensors grads;
+    float* grads_memory;
+    // buffers for the AdamW optimizer, in the precision of optimizer_bits (see gpt2_update)
+    void* m_memory;
+    void* v_memory;
+    float* optimizer_scales; // with 8-bit state, the scales of m and v of every ADAMW_BLOCK
+    int optimizer_bits; // 32 = fp32 AdamW m and v, 16 = bf16, 8 = 8-bit blocks
+    int grad_accum_steps; // micro-batches whose gradients add up to one optimizer step, see gpt2_backward
     // gradients of the activations
     ActivationTensors grads_acts;
     float* grads_acts_memory;
+    // with untied embeddings (see gpt2_untie_embeddings) the gradient of wte only comes from the
+    // encoder, so it only has the rows of the tokens trained on since the last gpt2_zero_grad
+    int untied_embeddings;
+    EmbeddingRows embedding_rows; // the wte rows of the current batch, for encoder_backward_rows
+    int* embedding_rows_memory;
+    int num_wte_rows;
+    int* wte_rows; // (V) the rows of grads.wte that are not zero, in the order they were written
+    unsigned char* wte_row_marks; // (V) 1 for the rows in wte_rows
+    int* wte_row_blocks; // scratch of gpt2_update, the ADAMW_BLOCKs that hold those rows
+#endif
     // other run state configuration
     int batch_size; // the batch size (B) of current forward pass
     int seq_len; // the sequence length (T) of current forward pass
+    int batch_capacity; // the largest B the activations are currently allocated for
+    int seq_capacity; // the largest T the activations are currently allocated for
     int* inputs; // the input tokens for the current forward pass
     int* targets; // the target tokens for the current forward pass
     float mean_loss; // after a forward pass with targets, will be populated with the mean loss
+    // run options, set these before the first forward pass
+    int flash_attention; // 1 = tiled online-softmax attention, no (T,T) activations are stored
+    int fused_classifier; // 1 = chunked lm-head + softmax + crossentropy, no (B,T,V) activations
+    int mixed_precision; // 1 = bf16 weights in the forward matmuls and bf16 saved activations
+    // activation checkpointing, trading memory of the saved activations for recompute in the backward pass
+    int recompute; // 0 = off, 1 = recompute the attention and gelu internals, 2 = recompute whole layers
+    int recompute_every; // with recompute = 2, every k-th layer is recomputed from its input residual
+    int inference_only; // 1 = forward only, the layer activations live in a fixed arena, see gpt2_point_inference_activations
+    float* lm_head; // (V, C) the lm-head weight with untied embeddings, NULL when it is wte
+    // optional copies of the big matmul weights in the GEMM panel layout, see gpt2_pack_weights
+    ParameterTensors packed; // only wte, qkvw, attprojw, fcw, fcprojw are set
+    float* packed_memory;
+    int packed_only; // 1 = the original layout of those weights was dropped (inference only)
+    PackedTensorsBF16 packed_bf16; // in mixed precision mode the packed copies are bf16 instead
+    bf16* packed_bf16_memory;
+    // in mixed precision mode the large per-layer activations of every layer are stashed
+    // here in bf16, and acts only holds one layer of them in fp32, see gpt2_stash_layer
+    bf16* acts_bf16_memory;
+    size_t acts_bf16_layer_size; // number of bf16 values per layer
+    // optional weight-only quantized copies of the packable weights, see gpt2_quantize_weights
+    // quantized[0] is wte, and quantized[1 + 4*l + k] are the qkvw, attprojw, fcw, fcprojw of layer l
+    QuantizedWeight* quantized;
+    char* quantized_memory;
+    size_t quantized_bytes;
+    // the checkpoint file when it was mapped instead of read, see gpt2_build_from_checkpoint_mmap
+    // params_memory and quantized_memory then point into it
+    void* mapped_memory;
+    size_t mapped_bytes;
+    // the blocks of the KV caches of incremental decoding, see KVCache
+    KVPool kv_pool;
+    // scratch of gpt2_decode_batch: the residual stream and one layer's buffers for the new
+    // rows, where each row goes, and the logits and probabilities of the rows that go through
+    // the lm-head (the last one of every sequence, or the last few for gpt2_decode_rows)
+    float* decode_memory;
+    int decode_capacity; // the most rows decode_memory holds
+    int** decode_tables; // (rows) the block table of the sequence of every row
+    int* decode_positions; // (rows) the position of every row in its sequence
+    int decode_head_capacity; // the most rows decode_logits holds
+    float* decode_logits; // (S*R,V)
+    float* decode_probs; // (S*R,V)
 } GPT2;
 
-void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
+size_t gpt2_quantized_bytes(GPT2Config config, int bits, int group_size) {
+    // the bytes of the quantized copies of wte and of the four matmul weights of every layer
+    int C = config.channels;
+    if ((bits != 8 && bits != 4) || group_size <= 0 || C % group_size != 0) {
+        printf("Error: unsupported quantization int%d with group size %d\n", bits, group_size);
+        exit(1);
+    }
+    size_t bytes = quantized_weight_bytes(C, config.vocab_size, bits, group_size);
+    bytes += config.num_layers * (quantized_weight_bytes(C, 3*C, bits, group_size)
+                                  + quantized_weight_bytes(C, C, bits, group_size)
+                                  + quantized_weight_bytes(C, 4*C, bits, group_size)
+                                  + quantized_weight_bytes(4*C, C, bits, group_size));
+    return bytes;
+}
+
+void gpt2_point_quantized(GPT2 *model, int bits, int group_size, char* memory) {
+    // allocate (or with memory != NULL, point into memory) the quantized copies of wte and of
+    // the four matmul weights of every layer
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    // the (K, N) = (in, out) shapes of the quantized matrices, in the order of model->quantized
+    int num_quantized = 1 + 4 * L;
+    int shapes[5][2] = { {C, V}, {C, 3*C}, {C, C}, {C, 4*C}, {4*C, C} };
+    model->quantized_bytes = gpt2_quantized_bytes(model->config, bits, group_size);
+    model->quantized = (QuantizedWeight*)malloc(num_quantized * sizeof(QuantizedWeight));
+    if (memory == NULL) {
+        memory = (char*)alloc_large(model->quantized_bytes);
+        alloc_zero(memory, model->quantized_bytes, 1);
+    }
+    model->quantized_memory = memory;
+    char* iterator = model->quantized_memory;
+    for (int i = 0; i < num_quantized; i++) {
+        int* shape = shapes[i == 0 ? 0 : 1 + (i - 1) % 4];
+        quantized_weight_point(&model->quantized[i], iterator, shape[0], shape[1], bits, group_size);
+        iterator += quantized_weight_bytes(shape[0], shape[1], bits, group_size);
+    }
+}
+
+// how gpt2_build_from_checkpoint_mmap gets the parameters out of the checkpoint file
+#define CHECKPOINT_READ 0 // read them into private memory
+#define CHECKPOINT_MMAP 1 // map the file, pages are read in on first touch
+#define CHECKPOINT_MMAP_POPULATE 2 // map the file and read it all in right away
+// in version 3 checkpoints the parameters start at a multiple of this many bytes
+#define CHECKPOINT_ALIGN 4096
+
+int gpt2_is_mapped(GPT2 *model, void* ptr) {
+    // whether ptr points into the mapped checkpoint file rather than into malloc'd memory
+    char* p = (char*)ptr;
+    char* base = (char*)model->mapped_memory;
+    return base != NULL && p >= base && p < base + model->mapped_bytes;
+}
+
+void gpt2_build_from_checkpoint_mmap(GPT2 *model, char* checkpoint_path, int load) {
 
     // read in model from a checkpoint file
     FILE *model_file = fopen(checkpoint_path, "rb");
@@ -588,7 +1836,18 @@ void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
     int model_header[256];
     fread(model_header, sizeof(int), 256, model_file);
     if (model_header[0] != 20240326) { printf("Bad magic model file"); exit(1); }
-    if (model_header[1] != 1) { printf("Bad version in model file"); exit(1); }
+    // version 1 is fp32 and version 2 weight-only quantized, with the parameters right after the
+    // 1024 byte header. version 3 is either one (header[7] is the bits, 0 for fp32), with the
+    // parameters at the page aligned byte offset header[9] (see gpt2_write_quantized_checkpoint)
+    int version = model_header[1];
+    if (version < 1 || version > 3) { printf("Bad version in model file"); exit(1); }
+    int bits = version == 1 ? 0 : model_header[7];
+    int group_size = model_header[8];
+    size_t params_offset = version == 3 ? (size_t)model_header[9] : 256 * sizeof(int);
+    if (version == 3 && (model_header[9] < 256 * (int)sizeof(int) || model_header[9] % CHECKPOINT_ALIGN != 0)) {
+        printf("Error: bad parameter offset %d in model file\n", model_header[9]);
+        exit(1);
+    }
 
     // read in hyperparameters
     int maxT, V, L, NH, C;
@@ -603,6 +1862,9 @@ void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
     printf("num_layers: %d\n", L);
     printf("num_heads: %d\n", NH);
     printf("channels: %d\n", C);
+    kernels_init();
+    printf("kernels: %s\n", kernels.name);
+    alloc_init();
 
     // allocate space for all the parameters and read them in
     model->param_sizes[0] = V * C; // wte
@@ -630,22 +1892,578 @@ void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
     printf("num_parameters: %zu\n", num_parameters);
     model->num_parameters = num_parameters;
 
-    // read in all the parameters from file
-    model->params_memory = malloc_and_point_parameters(&model->params, model->param_sizes);
-    fread(model->params_memory, sizeof(float), num_parameters, model_file);
-    fclose(model_file);
+    // the file must hold all the parameters: fp32 ones, or in a quantized checkpoint only the
+    // unpackable ones in fp32 and then the quantized weights
+    size_t num_stored = num_parameters; // the number of fp32 parameters in the file
+    size_t quantized_file_bytes = 0;
+    if (bits != 0) {
+        num_stored = 0;
+        for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+            if (!packable_parameters[i]) { num_stored += model->param_sizes[i]; }
+        }
+        quantized_file_bytes = gpt2_quantized_bytes(model->config, bits, group_size);
+    }
+    fseek(model_file, 0, SEEK_END);
+    size_t file_bytes = ftell(model_file);
+    size_t needed_bytes = params_offset + num_stored * sizeof(float) + quantized_file_bytes;
+    if (file_bytes < needed_bytes) {
+        printf("Error: model file has %zu bytes, its parameters need %zu\n", file_bytes, needed_bytes);
+        exit(1);
+    }
+
+    // read in all the parameters from file, or map it and point the parameters into the mapping
+    // the mapping is private, so N processes that only read the weights share one copy of them
+    // in the page cache, and gpt2_update writes to copy-on-write pages of its own process
+    model->mapped_memory = NULL;
+    model->mapped_bytes = 0;
+    if (load != CHECKPOINT_READ) {
+        model->mapped_bytes = file_bytes;
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (load == CHECKPOINT_MMAP_POPULATE) { flags |= MAP_POPULATE; }
+#endif
+        void* mapping = mmap(NULL, model->mapped_bytes, PROT_READ | PROT_WRITE, flags, fileno(model_file), 0);
+        if (mapping == MAP_FAILED) { printf("Error mapping model file\n"); exit(1); }
+        if (load == CHECKPOINT_MMAP_POPULATE) { madvise(mapping, model->mapped_bytes, MADV_WILLNEED); }
+        model->mapped_memory = mapping;
+    }
+    float* file_params = model->mapped_memory != NULL ? (float*)((char*)model->mapped_memory + params_offset) : NULL;
+    if (bits == 0 && file_params != NULL) {
+        model->params_memory = file_params;
+        point_parameters(&model->params, model->param_sizes, file_params);
+    } else if (bits == 0) {
+        model->params_memory = malloc_and_point_parameters(&model->params, model->param_sizes);
+    } else {
+        // only the unpackable tensors are stored in fp32, the quantized ones follow below
+        if (file_params != NULL) {
+            model->params_memory = file_params;
+            point_unpackable_parameters(&model->params, model->param_sizes, file_params);
+        } else {
+            model->params_memory = malloc_and_point_unpackable_parameters(&model->params, model->param_sizes);
+        }
+    }
+    if (file_params == NULL) {
+        fseek(model_file, params_offset, SEEK_SET);
+        fread(model->params_memory, sizeof(float), num_stored, model_file);
+    }
 
     // other inits
     model->acts_memory = NULL;
+#ifndef INFERENCE_ONLY
     model->grads_memory = NULL;
     model->m_memory = NULL;
     model->v_memory = NULL;
+    model->optimizer_scales = NULL;
+    model->optimizer_bits = 32;
+    model->grad_accum_steps = 1;
     model->grads_acts_memory = NULL;
+    model->untied_embeddings = 0;
+    model->embedding_rows_memory = NULL;
+    model->num_wte_rows = 0;
+    model->wte_rows = NULL;
+    model->wte_row_marks = NULL;
+    model->wte_row_blocks = NULL;
+#endif
     model->inputs = NULL;
     model->targets = NULL;
     model->batch_size = 0;
     model->seq_len = 0;
+    model->batch_capacity = 0;
+    model->seq_capacity = 0;
     model->mean_loss = -1.0f; // -1.0f will designate no loss
+    model->flash_attention = 0;
+    model->fused_classifier = 0;
+    model->mixed_precision = 0;
+    model->recompute = 0;
+    model->recompute_every = 1;
+#ifdef INFERENCE_ONLY
+    model->inference_only = 1;
+#else
+    model->inference_only = 0;
+#endif
+    model->lm_head = NULL;
+    memset(&model->packed, 0, sizeof(ParameterTensors));
+    model->packed_memory = NULL;
+    model->packed_only = 0;
+    memset(&model->packed_bf16, 0, sizeof(PackedTensorsBF16));
+    model->packed_bf16_memory = NULL;
+    model->acts_bf16_memory = NULL;
+    model->quantized = NULL;
+    model->quantized_memory = NULL;
+    model->quantized_bytes = 0;
+    model->decode_memory = NULL;
+    model->decode_capacity = 0;
+    memset(&model->kv_pool, 0, sizeof(KVPool));
+    model->kv_pool.block_floats = (size_t)model->config.num_layers * 2 * KV_BLOCK * model->config.channels;
+    model->decode_tables = NULL;
+    model->decode_positions = NULL;
+    model->decode_head_capacity = 0;
+    model->decode_logits = NULL;
+    model->decode_probs = NULL;
+
+    if (bits != 0) {
+        // the quantized weights directly follow the fp32 ones
+        printf("quantized: int%d, group size %d\n", bits, group_size);
+        gpt2_point_quantized(model, bits, group_size, file_params != NULL ? (char*)(file_params + num_stored) : NULL);
+        if (file_params == NULL) { fread(model->quantized_memory, 1, model->quantized_bytes, model_file); }
+        model->packed_only = 1;
+        model->inference_only = 1; // this model can only forward anyway
+    }
+    fclose(model_file);
+}
+
+void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
+    gpt2_build_from_checkpoint_mmap(model, checkpoint_path, CHECKPOINT_READ);
+}
+
+void gpt2_pack_weights(GPT2 *model) {
+    // (re)pack wte and the four per-layer matmul weights into the panel layout of
+    // gemm_prepack_b, so that the forward matmuls read them without any packing.
+    // in mixed precision mode the packed copies are stored in bf16 instead of fp32.
+    // the first call allocates the packed copies; gpt2_update calls this again after
+    // every step, which keeps the packed copies in sync with the updated weights
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    if (model->packed_only) { return; } // nothing to pack from anymore
+    if (model->lm_head != NULL) { printf("Error: untied embeddings can't be packed\n"); exit(1); }
+    size_t packed_sizes[5] = {
+        gemm_packed_size(C, V), // wte
+        L * gemm_packed_size(C, 3*C), // qkvw
+        L * gemm_packed_size(C, C), // attprojw
+        L * gemm_packed_size(C, 4*C), // fcw
+        L * gemm_packed_size(4*C, C), // fcprojw
+    };
+    size_t num_packed = 0;
+    for (int i = 0; i < 5; i++) { num_packed += packed_sizes[i]; }
+    ParameterTensors params = model->params;
+    if (model->mixed_precision) {
+        if (model->packed_bf16_memory == NULL) {
+            bf16** ptrs[5] = {
+                &model->packed_bf16.wte, &model->packed_bf16.qkvw, &model->packed_bf16.attprojw,
+                &model->packed_bf16.fcw, &model->packed_bf16.fcprojw
+            };
+            model->packed_bf16_memory = (bf16*)alloc_large(num_packed * sizeof(bf16));
+            alloc_zero(model->packed_bf16_memory, num_packed * sizeof(bf16), 1);
+            bf16* iterator = model->packed_bf16_memory;
+            for (int i = 0; i < 5; i++) {
+                *(ptrs[i]) = iterator;
+                iterator += packed_sizes[i];
+            }
+        }
+        // every weight (OC, C) is used as the C x OC matrix weight^T in the forward matmul
+        PackedTensorsBF16 packed = model->packed_bf16;
+        gemm_prepack_b_bf16(packed.wte, params.wte, 1, C, C, V);
+        for (int l = 0; l < L; l++) {
+            gemm_prepack_b_bf16(packed.qkvw + l * gemm_packed_size(C, 3*C), params.qkvw + l * 3*C * C, 1, C, C, 3*C);
+            gemm_prepack_b_bf16(packed.attprojw + l * gemm_packed_size(C, C), params.attprojw + l * C * C, 1, C, C, C);
+            gemm_prepack_b_bf16(packed.fcw + l * gemm_packed_size(C, 4*C), params.fcw + l * 4*C * C, 1, C, C, 4*C);
+            gemm_prepack_b_bf16(packed.fcprojw + l * gemm_packed_size(4*C, C), params.fcprojw + l * C * 4*C, 1, 4*C, 4*C, C);
+        }
+        return;
+    }
+    if (model->packed_memory == NULL) {
+        float** ptrs[5] = {
+            &model->packed.wte, &model->packed.qkvw, &model->packed.attprojw,
+            &model->packed.fcw, &model->packed.fcprojw
+        };
+        model->packed_memory = (float*)alloc_large(num_packed * sizeof(float));
+        alloc_zero(model->packed_memory, num_packed * sizeof(float), 1);
+        float* iterator = model->packed_memory;
+        for (int i = 0; i < 5; i++) {
+            *(ptrs[i]) = iterator;
+            iterator += packed_sizes[i];
+        }
+    }
+    // every weight (OC, C) is used as the C x OC matrix weight^T in the forward matmul
+    ParameterTensors packed = model->packed;
+    gemm_prepack_b(packed.wte, params.wte, 1, C, C, V);
+    for (int l = 0; l < L; l++) {
+        gemm_prepack_b(packed.qkvw + l * gemm_packed_size(C, 3*C), params.qkvw + l * 3*C * C, 1, C, C, 3*C);
+        gemm_prepack_b(packed.attprojw + l * gemm_packed_size(C, C), params.attprojw + l * C * C, 1, C, C, C);
+        gemm_prepack_b(packed.fcw + l * gemm_packed_size(C, 4*C), params.fcw + l * 4*C * C, 1, C, C, 4*C);
+        gemm_prepack_b(packed.fcprojw + l * gemm_packed_size(4*C, C), params.fcprojw + l * C * 4*C, 1, 4*C, 4*C, C);
+    }
+}
+
+void gpt2_drop_unpacked_weights(GPT2 *model) {
+    // for inference only: the packed copies replace the original layout entirely.
+    // the remaining (small) parameter tensors are compacted into a new, smaller buffer
+    // and the five packed tensors are set to NULL in model->params
+    if (model->packed_only) { return; }
+    if (model->packed_memory == NULL && model->packed_bf16_memory == NULL && model->quantized == NULL) {
+        gpt2_pack_weights(model);
+    }
+    float* old_memory = model->params_memory;
+    ParameterTensors old = model->params;
+    model->params_memory = malloc_and_point_unpackable_parameters(&model->params, model->param_sizes);
+    float** old_ptrs[] = {
+        &old.wte, &old.wpe, &old.ln1w, &old.ln1b, &old.qkvw, &old.qkvb,
+        &old.attprojw, &old.attprojb, &old.ln2w, &old.ln2b, &old.fcw, &old.fcb,
+        &old.fcprojw, &old.fcprojb, &old.lnfw, &old.lnfb
+    };
+    float** ptrs[] = {
+        &model->params.wte, &model->params.wpe, &model->params.ln1w, &model->params.ln1b, &model->params.qkvw, &model->params.qkvb,
+        &model->params.attprojw, &model->params.attprojb, &model->params.ln2w, &model->params.ln2b, &model->params.fcw, &model->params.fcb,
+        &model->params.fcprojw, &model->params.fcprojb, &model->params.lnfw, &model->params.lnfb
+    };
+    for (int i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+        if (!packable_parameters[i]) { memcpy(*(ptrs[i]), *(old_ptrs[i]), model->param_sizes[i] * sizeof(float)); }
+    }
+    if (!gpt2_is_mapped(model, old_memory)) { free_large(old_memory); }
+    model->packed_only = 1;
+}
+
+void gpt2_quantize_weights(GPT2 *model, int bits, int group_size) {
+    // for inference only: weight-only quantization of wte (the lm-head) and the four matmul
+    // weights of every layer, to int8 or int4 with one fp32 scale per group_size input
+    // channels of every output channel. the fp32 originals are dropped afterwards
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    if (model->packed_only) { printf("Error: the weights were already packed for inference only\n"); exit(1); }
+    if (model->lm_head != NULL) { printf("Error: untied embeddings can't be quantized\n"); exit(1); }
+    gpt2_point_quantized(model, bits, group_size, NULL);
+    ParameterTensors params = model->params;
+    quantize_weight(&model->quantized[0], params.wte);
+    for (int l = 0; l < L; l++) {
+        quantize_weight(&model->quantized[1 + 4*l + 0], params.qkvw + l * 3*C * C);
+        quantize_weight(&model->quantized[1 + 4*l + 1], params.attprojw + l * C * C);
+        quantize_weight(&model->quantized[1 + 4*l + 2], params.fcw + l * 4*C * C);
+        quantize_weight(&model->quantized[1 + 4*l + 3], params.fcprojw + l * C * 4*C);
+    }
+    // the quantized copies take precedence over any packed ones, which are not needed anymore
+    free_large(model->packed_memory);
+    free_large(model->packed_bf16_memory);
+    model->packed_memory = NULL;
+    model->packed_bf16_memory = NULL;
+    memset(&model->packed, 0, sizeof(ParameterTensors));
+    memset(&model->packed_bf16, 0, sizeof(PackedTensorsBF16));
+    gpt2_drop_unpacked_weights(model);
+}
+
+void gpt2_write_quantized_checkpoint(GPT2 *model, const char* checkpoint_path) {
+    // version 3 of the checkpoint format: the usual header (plus the bits and group size in
+    // slots 7 and 8, and the offset of the parameters in slot 9), zero padding up to that page
+    // aligned offset, then the unpackable parameters in fp32 in their usual order, then the
+    // quantized weights exactly as they are laid out in model->quantized_memory
+    if (model->quantized == NULL) { printf("Error: the model is not quantized\n"); exit(1); }
+    FILE *model_file = fopen(checkpoint_path, "wb");
+    if (model_file == NULL) { printf("Error opening model file for writing\n"); exit(1); }
+    int model_header[256];
+    memset(model_header, 0, sizeof(model_header));
+    model_header[0] = 20240326;
+    model_header[1] = 3;
+    model_header[2] = model->config.max_seq_len;
+    model_header[3] = model->config.vocab_size;
+    model_header[4] = model->config.num_layers;
+    model_header[5] = model->config.num_heads;
+    model_header[6] = model->config.channels;
+    model_header[7] = model->quantized[0].bits;
+    model_header[8] = model->quantized[0].group_size;
+    model_header[9] = CHECKPOINT_ALIGN;
+    fwrite(model_header, sizeof(int), 256, model_file);
+    char padding[CHECKPOINT_ALIGN - sizeof(model_header)];
+    memset(padding, 0, sizeof(padding));
+    fwrite(padding, 1, sizeof(padding), model_file);
+    size_t num_unpackable = 0;
+    for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+        if (!packable_parameters[i]) { num_unpackable += model->param_sizes[i]; }
+    }
+    fwrite(model->params_memory, sizeof(float), num_unpackable, model_file);
+    fwrite(model->quantized_memory, 1, model->quantized_bytes, model_file);
+    fclose(model_file);
+}
+
+void gpt2_stash_layer(GPT2 *model, int l, int B, int T, int restore) {
+    // in mixed precision mode the large activations of layer l are saved for the backward
+    // pass in bf16: the forward pass computes every layer in the single fp32 layer slot of
+    // acts and then stashes it (restore = 0). the backward pass restores one layer at a time
+    // (restore = 1), and as its input residual it also needs the residual3 of layer l-1,
+    // which it receives in the (otherwise unused) residual3 slot
+    ActivationTensors acts = model->acts;
+    size_t BTC = (size_t)B * T * model->config.channels;
+    int NH = model->config.num_heads;
+    float* ptrs[] = { acts.ln1, acts.qkv, acts.atty, acts.att, acts.residual2, acts.ln2, acts.fch, acts.fch_gelu, acts.residual3 };
+    size_t sizes[] = { BTC, 3*BTC, BTC, model->flash_attention ? 0 : (size_t)B * NH * T * T, BTC, BTC, 4*BTC, 4*BTC, BTC };
+    int num_tensors = sizeof(sizes) / sizeof(sizes[0]);
+    bf16* stash = model->acts_bf16_memory + l * model->acts_bf16_layer_size;
+    for (int i = 0; i < num_tensors; i++) {
+        if (!restore) {
+            bf16_from_float(stash, ptrs[i], sizes[i]);
+        } else if (i < num_tensors - 1) {
+            float_from_bf16(ptrs[i], stash, sizes[i]);
+        } else if (l > 0) {
+            // residual3 is the last tensor of every layer, so its previous layer is one layer back
+            float_from_bf16(ptrs[i], stash - model->acts_bf16_layer_size, sizes[i]);
+        }
+        stash += sizes[i];
+    }
+}
+
+void gpt2_point_inference_activations(GPT2 *model) {
+    // in inference only mode every activation of a layer is dead once the layer's output is
+    // added to the residual stream, so all layers run through the same three buffers: the
+    // residual stream (encoded), which the residual adds update in place, a (B,T,C) and a
+    // (B,T,4C) buffer that every step reads from one of and writes into the other. the
+    // gelu runs in place in the wide one, and the statistics that only the backward pass
+    // reads are not stored at all (NULL)
+    ActivationTensors* acts = &model->acts;
+    float* ping = acts->ln1;
+    float* pong = acts->qkv;
+    acts->residual2 = acts->encoded;
+    acts->residual3 = acts->encoded;
+    acts->ln1 = ping; // -> qkv (pong) -> atty (ping) -> attproj (pong), added to the residual
+    acts->atty = ping;
+    acts->attproj = pong;
+    acts->ln2 = ping; // -> fch (pong) -> fch_gelu (pong, in place) -> fcproj (ping), added to the residual
+    acts->fch = pong;
+    acts->fch_gelu = pong;
+    acts->fcproj = ping;
+    acts->lnf = ping;
+    acts->ln1_mean = acts->ln1_rstd = NULL;
+    acts->ln2_mean = acts->ln2_rstd = NULL;
+    acts->lnf_mean = acts->lnf_rstd = NULL;
+    if (model->flash_attention) { acts->preatt = acts->att = NULL; }
+    if (!model->fused_classifier) { acts->probs = acts->logits; }
+}
+
+void gpt2_layer_slots(GPT2 *model, int l, int* state_slot, int* internal_slot) {
+    // the large per-layer activations don't always keep all L layers. the layer state
+    // (ln1, qkv, residual2, ln2, fch) of layer l lives at *state_slot, and its internals
+    // (atty, preatt, att, fch_gelu, and the attproj, fcproj that backward never reads)
+    // at *internal_slot. called with l = L, it returns the number of slots of each instead
+    int L = model->config.num_layers;
+    int k = model->recompute_every;
+    if (model->mixed_precision || model->inference_only) {
+        // one layer in fp32, the others are stashed in bf16 (see gpt2_stash_layer) or not needed
+        *state_slot = *internal_slot = l == L ? 1 : 0;
+    } else if (model->recompute == 1) {
+        // the internals are recomputed from qkv and fch by the backward pass of every layer
+        *state_slot = l;
+        *internal_slot = l == L ? 1 : 0;
+    } else if (model->recompute == 2) {
+        // the recomputed layers (l % k == 0) all share one slot after the stored layers
+        int num_stored = L - (L + k - 1) / k;
+        *state_slot = *internal_slot = l == L ? num_stored + 1 : l % k == 0 ? num_stored : l - l / k - 1;
+    } else {
+        *state_slot = *internal_slot = l;
+    }
+}
+
+void gpt2_forward_layer(GPT2 *model, int l, int B, int T) {
+    // the forward pass of transformer block l, from its input residual (the residual3 of
+    // layer l-1, or encoded) into the activation slots of the layer
+    int C = model->config.channels;
+    int NH = model->config.num_heads;
+    ParameterTensors params = model->params;
+    ActivationTensors acts = model->acts;
+    int att_size = model->flash_attention ? NH * T : NH * T * T; // per (b) slice of preatt/att
+    // the pre-packed copies of the matmul weights, NULL where not available
+    ParameterTensors packed = model->packed;
+    PackedTensorsBF16 packed_bf16 = model->packed_bf16;
+    int use_packed = model->packed_memory != NULL;
+    int use_bf16 = model->packed_bf16_memory != NULL;
+    QuantizedWeight* quantized = model->quantized;
+    // the slots of this layer in the large per-layer activations
+    int one_residual = model->mixed_precision || model->inference_only; // residual3 holds one layer
+    int ls, lr;
+    gpt2_layer_slots(model, l, &ls, &lr);
+    int la = model->flash_attention ? l : lr; // the flash attention statistics are always kept per layer
+    float* residual = l == 0 ? acts.encoded : acts.residual3 + (one_residual ? 0 : (l-1) * B * T * C);
+
+    // get the pointers of the weights for this layer
+    float* l_ln1w = params.ln1w + l * C;
+    float* l_ln1b = params.ln1b + l * C;
+    float* l_qkvw = params.qkvw + l * 3*C * C;
+    float* l_qkvb = params.qkvb + l * 3*C;
+    float* l_attprojw = params.attprojw + l * C * C;
+    float* l_attprojb = params.attprojb + l * C;
+    float* l_ln2w = params.ln2w + l * C;
+    float* l_ln2b = params.ln2b + l * C;
+    float* l_fcw = params.fcw + l * 4*C * C;
+    float* l_fcb = params.fcb + l * 4*C;
+    float* l_fcprojw = params.fcprojw + l * C * 4*C;
+    float* l_fcprojb = params.fcprojb + l * C;
+    // and of their pre-packed copies
+    float* lp_qkvw = use_packed ? packed.qkvw + l * gemm_packed_size(C, 3*C) : NULL;
+    float* lp_attprojw = use_packed ? packed.attprojw + l * gemm_packed_size(C, C) : NULL;
+    float* lp_fcw = use_packed ? packed.fcw + l * gemm_packed_size(C, 4*C) : NULL;
+    float* lp_fcprojw = use_packed ? packed.fcprojw + l * gemm_packed_size(4*C, C) : NULL;
+    bf16* lh_qkvw = use_bf16 ? packed_bf16.qkvw + l * gemm_packed_size(C, 3*C) : NULL;
+    bf16* lh_attprojw = use_bf16 ? packed_bf16.attprojw + l * gemm_packed_size(C, C) : NULL;
+    bf16* lh_fcw = use_bf16 ? packed_bf16.fcw + l * gemm_packed_size(C, 4*C) : NULL;
+    bf16* lh_fcprojw = use_bf16 ? packed_bf16.fcprojw + l * gemm_packed_size(4*C, C) : NULL;
+    QuantizedWeight* lq = quantized != NULL ? quantized + 1 + 4*l : NULL; // qkvw, attprojw, fcw, fcprojw
+
+    // get the pointers of the activations for this layer
+    // (the statistics for the backward pass are NULL in inference only mode)
+    float* l_ln1 = acts.ln1 + ls * B * T * C;
+    float* l_ln1_mean = acts.ln1_mean != NULL ? acts.ln1_mean + l * B * T : NULL;
+    float* l_ln1_rstd = acts.ln1_rstd != NULL ? acts.ln1_rstd + l * B * T : NULL;
+    float* l_qkv = acts.qkv + ls * B * T * 3*C;
+    float* l_atty = acts.atty + lr * B * T * C;
+    float* l_preatt = acts.preatt != NULL ? acts.preatt + la * B * att_size : NULL;
+    float* l_att = acts.att != NULL ? acts.att + la * B * att_size : NULL;
+    float* l_attproj = acts.attproj + lr * B * T * C;
+    float* l_residual2 = acts.residual2 + ls * B * T * C;
+    float* l_ln2 = acts.ln2 + ls * B * T * C;
+    float* l_ln2_mean = acts.ln2_mean != NULL ? acts.ln2_mean + l * B * T : NULL;
+    float* l_ln2_rstd = acts.ln2_rstd != NULL ? acts.ln2_rstd + l * B * T : NULL;
+    float* l_fch = acts.fch + ls * B * T * 4*C;
+    float* l_fch_gelu = acts.fch_gelu + lr * B * T * 4*C;
+    float* l_fcproj = acts.fcproj + lr * B * T * C;
+    float* l_residual3 = acts.residual3 + (one_residual ? 0 : l) * B * T * C;
+
+    // now do the forward pass
+    kernels.layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
+    matmul_forward_packed(l_qkv, l_ln1, l_qkvw, lp_qkvw, lh_qkvw, lq ? lq + 0 : NULL, l_qkvb, B, T, C, 3*C);
+    if (model->flash_attention) {
+        attention_forward_flash(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
+    } else {
+        attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
+    }
+    matmul_forward_packed(l_attproj, l_atty, l_attprojw, lp_attprojw, lh_attprojw, lq ? lq + 1 : NULL, l_attprojb, B, T, C, C);
+    kernels.residual_forward(l_residual2, residual, l_attproj, B*T*C);
+    kernels.layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C);
+    matmul_forward_packed(l_fch, l_ln2, l_fcw, lp_fcw, lh_fcw, lq ? lq + 2 : NULL, l_fcb, B, T, C, 4*C);
+    kernels.gelu_forward(l_fch_gelu, l_fch, B*T*4*C);
+    matmul_forward_packed(l_fcproj, l_fch_gelu, l_fcprojw, lp_fcprojw, lh_fcprojw, lq ? lq + 3 : NULL, l_fcprojb, B, T, 4*C, C);
+    kernels.residual_forward(l_residual3, l_residual2, l_fcproj, B*T*C);
+}
+
+int gpt2_capacity_bucket(int n, int max) {
+    // the next power of two of n, but no more than max (unless n itself is)
+    int c = 1;
+    while (c < n) { c *= 2; }
+    return c > max && n <= max ? max : c;
+}
+
+void gpt2_activation_layer_sizes(GPT2 *model, size_t* layer_sizes) {
+    // the size of one layer of every activation tensor, see first_touch_activations.
+    // the tensors from ln1 up to residual3 hold a (B,T,...) slice per layer (or slot)
+    int L = model->config.num_layers;
+    for (int i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+        layer_sizes[i] = i >= 1 && i <= 16 ? model->act_sizes[i] / L : model->act_sizes[i];
+    }
+}
+
+void gpt2_allocate_activations(GPT2 *model, int B, int T) {
+    // plan and allocate the activations (and the inputs/targets cache) for up to B,T
+    // the activation gradients follow lazily in gpt2_backward, from the same act_sizes
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int NH = model->config.num_heads;
+    int C = model->config.channels;
+    model->batch_capacity = B;
+    model->seq_capacity = T;
+    model->act_sizes[0] = B * T * C; // encoded
+    model->act_sizes[1] = L * B * T * C; // ln1
+    model->act_sizes[2] = L * B * T;  // ln1_mean
+    model->act_sizes[3] = L * B * T;  // ln1_rstd
+    model->act_sizes[4] = L * B * T * 3*C; // qkv
+    model->act_sizes[5] = L * B * T * C;  // atty
+    // with flash attention, only two statistics per query row are kept instead of (T,T)
+    int att_size = model->flash_attention ? NH * T : NH * T * T;
+    model->act_sizes[6] = L * B * att_size;  // preatt
+    model->act_sizes[7] = L * B * att_size;  // att
+    model->act_sizes[8] = L * B * T * C; // attproj
+    model->act_sizes[9] = L * B * T * C; // residual2
+    model->act_sizes[10] = L * B * T * C; // ln2
+    model->act_sizes[11] = L * B * T; // ln2_mean
+    model->act_sizes[12] = L * B * T; // ln2_rstd
+    model->act_sizes[13] = L * B * T * 4*C; // fch
+    model->act_sizes[14] = L * B * T * 4*C; // fch_gelu
+    model->act_sizes[15] = L * B * T * C; // fcproj
+    model->act_sizes[16] = L * B * T * C; // residual3
+    model->act_sizes[17] = B * T * C; // lnf
+    model->act_sizes[18] = B * T; // lnf_mean
+    model->act_sizes[19] = B * T; // lnf_rstd
+    // the fused classifier only keeps a log-sum-exp per row, plus probs for sampling
+    model->act_sizes[20] = model->fused_classifier ? B * T : B * T * V; // logits
+    model->act_sizes[21] = model->fused_classifier ? B * V : B * T * V; // probs
+    model->act_sizes[22] = B * T; // losses
+    size_t num_activations = 0;
+    for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+        num_activations += model->act_sizes[i];
+    }
+    printf("num_activations: %zu\n", num_activations);
+    model->num_activations = num_activations;
+    size_t acts_sizes[NUM_ACTIVATION_TENSORS];
+    memcpy(acts_sizes, model->act_sizes, sizeof(acts_sizes));
+    size_t num_bf16 = 0;
+    if (model->inference_only) {
+        // nothing of a layer is read once the next layer starts, so the layers share a
+        // fixed arena instead, which gpt2_point_inference_activations lays out
+        memset(acts_sizes, 0, sizeof(acts_sizes));
+        acts_sizes[0] = B * T * C; // encoded: the residual stream, updated in place
+        acts_sizes[1] = B * T * C; // ln1: the narrow ping-pong buffer
+        acts_sizes[4] = B * T * 4*C; // qkv: the wide ping-pong buffer
+        if (!model->flash_attention) {
+            acts_sizes[6] = B * NH * T * T; // preatt, for one layer
+            acts_sizes[7] = B * NH * T * T; // att, for one layer
+        }
+        acts_sizes[20] = model->act_sizes[20]; // logits, which probs overwrite in place without the fused classifier
+        acts_sizes[21] = model->fused_classifier ? model->act_sizes[21] : 0; // probs
+        acts_sizes[22] = B * T; // losses
+    } else {
+        // the large per-layer tensors don't always keep all L layers, see gpt2_layer_slots
+        if (model->recompute && (model->mixed_precision || model->recompute_every < 1)) {
+            printf("Error: recompute needs fp32 activations and recompute_every >= 1\n");
+            exit(1);
+        }
+        int state_slots, internal_slots;
+        gpt2_layer_slots(model, L, &state_slots, &internal_slots);
+        int state[] = {1, 4, 9, 10, 13}; // ln1, qkv, residual2, ln2, fch
+        int internal[] = {5, 8, 14, 15, 6, 7}; // atty, attproj, fch_gelu, fcproj, and preatt/att without flash attention
+        for (int i = 0; i < 5; i++) { acts_sizes[state[i]] = acts_sizes[state[i]] / L * state_slots; }
+        for (int i = 0; i < (model->flash_attention ? 4 : 6); i++) {
+            acts_sizes[internal[i]] = acts_sizes[internal[i]] / L * internal_slots;
+        }
+        if (model->mixed_precision) {
+            // every layer is stashed in bf16 instead, and residual3 also gets a single slot
+            acts_sizes[16] /= L;
+            model->acts_bf16_layer_size = (size_t)B * T * 16*C + (model->flash_attention ? 0 : (size_t)B * NH * T * T);
+            num_bf16 = L * model->acts_bf16_layer_size;
+            model->acts_bf16_memory = (bf16*)alloc_large(num_bf16 * sizeof(bf16));
+            alloc_zero(model->acts_bf16_memory, num_bf16 * sizeof(bf16), L);
+        }
+    }
+    size_t num_fp32 = 0;
+    for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) { num_fp32 += acts_sizes[i]; }
+    printf("activation memory: %.1f MiB (%zu fp32 + %zu bf16)\n",
+           (num_fp32 * sizeof(float) + num_bf16 * sizeof(bf16)) / 1048576.0, num_fp32, num_bf16);
+    model->acts_memory = malloc_and_point_activations(&model->acts, acts_sizes);
+    if (model->inference_only) {
+        // the arena buffers are reused by every layer with different row widths, so they
+        // are touched as a whole
+        first_touch_activations(model->acts_memory, acts_sizes, NULL);
+        gpt2_point_inference_activations(model);
+    } else {
+        size_t layer_sizes[NUM_ACTIVATION_TENSORS];
+        gpt2_activation_layer_sizes(model, layer_sizes);
+        first_touch_activations(model->acts_memory, acts_sizes, layer_sizes);
+    }
+    // also create memory for caching inputs and targets
+    model->inputs = malloc(B * T * sizeof(int));
+    model->targets = malloc(B * T * sizeof(int)); // might be unused if we never have targets but it's small
+}
+
+void gpt2_free_activations(GPT2 *model) {
+    // release everything that gpt2_allocate_activations and gpt2_backward sized for the old B,T
+    free_large(model->acts_memory);
+    free_large(model->acts_bf16_memory);
+#ifndef INFERENCE_ONLY
+    free_large(model->grads_acts_memory);
+    free(model->embedding_rows_memory);
+    model->grads_acts_memory = NULL;
+    model->embedding_rows_memory = NULL;
+#endif
+    free(model->inputs);
+    free(model->targets);
+    model->acts_memory = NULL;
+    model->acts_bf16_memory = NULL;
+    model->inputs = NULL;
+    model->targets = NULL;
 }
 
 void gpt2_forward(GPT2 *model, int* inputs, int* targets, int B, int T) {
@@ -656,61 +2474,34 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, int B, int T) {
         printf("Error: model was not initialized properly.\n");
         exit(1);
     }
+#ifdef INFERENCE_ONLY
+    if (!model->inference_only) {
+        printf("Error: this build only forwards in inference only mode\n");
+        exit(1);
+    }
+#endif
 
     // convenience parameters
     int V = model->config.vocab_size;
     int L = model->config.num_layers;
-    int NH = model->config.num_heads;
     int C = model->config.channels;
 
-    // allocate space for all the activations if needed (done here, lazily)
-    if(model->acts_memory == NULL) {
-        // record the current B,T as well
-        model->batch_size = B;
-        model->seq_len = T;
-        // and now allocate the space
-        model->act_sizes[0] = B * T * C; // encoded
-        model->act_sizes[1] = L * B * T * C; // ln1
-        model->act_sizes[2] = L * B * T;  // ln1_mean
-        model->act_sizes[3] = L * B * T;  // ln1_rstd
-        model->act_sizes[4] = L * B * T * 3*C; // qkv
-        model->act_sizes[5] = L * B * T * C;  // atty
-        model->act_sizes[6] = L * B * NH * T * T;  // preatt
-        model->act_sizes[7] = L * B * NH * T * T;  // att
-        model->act_sizes[8] = L * B * T * C; // attproj
-        model->act_sizes[9] = L * B * T * C; // residual2
-        model->act_sizes[10] = L * B * T * C; // ln2
-        model->act_sizes[11] = L * B * T; // ln2_mean
-        model->act_sizes[12] = L * B * T; // ln2_rstd
-        model->act_sizes[13] = L * B * T * 4*C; // fch
-        model->act_sizes[14] = L * B * T * 4*C; // fch_gelu
-        model->act_sizes[15] = L * B * T * C; // fcproj
-        model->act_sizes[16] = L * B * T * C; // residual3
-        model->act_sizes[17] = B * T * C; // lnf
-        model->act_sizes[18] = B * T; // lnf_mean
-        model->act_sizes[19] = B * T; // lnf_rstd
-        model->act_sizes[20] = B * T * V; // logits
-        model->act_sizes[21] = B * T * V; // probs
-        model->act_sizes[22] = B * T; // losses
-        size_t num_activations = 0;
-        for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
-            num_activations += model->act_sizes[i];
-        }
-        printf("num_activations: %zu\n", num_activations);
-        model->num_activations = num_activations;
-        model->acts_memory = malloc_and_point_activations(&model->acts, model->act_sizes);
-        // also create memory for caching inputs and targets
-        model->inputs = malloc(B * T * sizeof(int));
-        model->targets = malloc(B * T * sizeof(int)); // might be unused if we never have targets but it's small
-    } else {
-        // validate B,T is no larger than what was previously allocated
-        // in principle, we could re-allocate a larger chunk of memory, for now we just error out
-        if (B > model->batch_size || T > model->seq_len) {
-            printf("Error: batch size or sequence length is inadequately large\n");
-            printf("Model: B=%d T=%d, Desired: B=%d T=%d\n", model->batch_size, model->seq_len, B, T);
-            exit(1);
-        }
+    // allocate space for all the activations if needed (done here, lazily), and plan them
+    // again with larger capacities when B or T outgrows what was allocated
+    if (model->acts_memory == NULL) {
+        gpt2_allocate_activations(model, B, T);
+    } else if (B > model->batch_capacity || T > model->seq_capacity) {
+        // each dimension that doesn't fit grows to its next power of two bucket, so that a
+        // workload of mixed shapes only re-plans a few times
+        int batch_capacity = B > model->batch_capacity ? gpt2_capacity_bucket(B, INT_MAX) : model->batch_capacity;
+        int seq_capacity = T > model->seq_capacity ? gpt2_capacity_bucket(T, model->config.max_seq_len) : model->seq_capacity;
+        printf("growing activations: B=%d T=%d -> B=%d T=%d\n", model->batch_capacity, model->seq_capacity, batch_capacity, seq_capacity);
+        gpt2_free_activations(model);
+        gpt2_allocate_activations(model, batch_capacity, seq_capacity);
     }
+    // record the current B,T as well
+    model->batch_size = B;
+    model->seq_len = T;
 
     // cache the inputs/targets
     memcpy(model->inputs, inputs, B * T * sizeof(int));
@@ -718,67 +2509,52 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, int B, int T) {
         memcpy(model->targets, targets, B * T * sizeof(int));
     }
 
+    // mixed precision runs the forward matmuls on bf16 copies of the weights
+    if (model->mixed_precision && model->packed_bf16_memory == NULL) { gpt2_pack_weights(model); }
+
     // forward pass
     ParameterTensors params = model->params; // for brevity
     ActivationTensors acts = model->acts;
+    ParameterTensors packed = model->packed;
+    PackedTensorsBF16 packed_bf16 = model->packed_bf16;
+    QuantizedWeight* quantized = model->quantized;
+    int mp = model->mixed_precision;
     float* residual;
-    encoder_forward(acts.encoded, inputs, params.wte, params.wpe, B, T, C); // encoding goes into residual[0]
+    if (model->packed_only) {
+        encoder_forward_packed(acts.encoded, inputs, packed.wte, packed_bf16.wte, quantized,
+                               params.wpe, B, T, C); // encoding goes into residual[0]
+    } else {
+        encoder_forward(acts.encoded, inputs, params.wte, params.wpe, B, T, C); // encoding goes into residual[0]
+    }
     for (int l = 0; l < L; l++) {
-
-        residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
-
-        // get the pointers of the weights for this layer
-        float* l_ln1w = params.ln1w + l * C;
-        float* l_ln1b = params.ln1b + l * C;
-        float* l_qkvw = params.qkvw + l * 3*C * C;
-        float* l_qkvb = params.qkvb + l * 3*C;
-        float* l_attprojw = params.attprojw + l * C * C;
-        float* l_attprojb = params.attprojb + l * C;
-        float* l_ln2w = params.ln2w + l * C;
-        float* l_ln2b = params.ln2b + l * C;
-        float* l_fcw = params.fcw + l * 4*C * C;
-        float* l_fcb = params.fcb + l * 4*C;
-        float* l_fcprojw = params.fcprojw + l * C * 4*C;
-        float* l_fcprojb = params.fcprojb + l * C;
-
-        // get the pointers of the activations for this layer
-        float* l_ln1 = acts.ln1 + l * B * T * C;
-        float* l_ln1_mean = acts.ln1_mean + l * B * T;
-        float* l_ln1_rstd = acts.ln1_rstd + l * B * T;
-        float* l_qkv = acts.qkv + l * B * T * 3*C;
-        float* l_atty = acts.atty + l * B * T * C;
-        float* l_preatt = acts.preatt + l * B * NH * T * T;
-        float* l_att = acts.att + l * B * NH * T * T;
-        float* l_attproj = acts.attproj + l * B * T * C;
-        float* l_residual2 = acts.residual2 + l * B * T * C;
-        float* l_ln2 = acts.ln2 + l * B * T * C;
-        float* l_ln2_mean = acts.ln2_mean + l * B * T;
-        float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
-        float* l_fch = acts.fch + l * B * T * 4*C;
-        float* l_fch_gelu = acts.fch_gelu + l * B * T * 4*C;
-        float* l_fcproj = acts.fcproj + l * B * T * C;
-        float* l_residual3 = acts.residual3 + l * B * T * C;
-
-        // now do the forward pass
-        layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
-        matmul_forward(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, 3*C);
-        attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
-        matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
-        residual_forward(l_residual2, residual, l_attproj, B*T*C);
-        layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C);
-        matmul_forward(l_fch, l_ln2, l_fcw, l_fcb, B, T, C, 4*C);
-        gelu_forward(l_fch_gelu, l_fch, B*T*4*C);
-        matmul_forward(l_fcproj, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4*C, C);
-        residual_forward(l_residual3, l_residual2, l_fcproj, B*T*C);
-    }
-    residual = acts.residual3 + (L-1) * B * T * C; // last residual is in residual3
-    layernorm_forward(acts.lnf, acts.lnf_mean, acts.lnf_rstd, residual, params.lnfw, params.lnfb, B, T, C);
-    matmul_forward(acts.logits, acts.lnf, params.wte, NULL, B, T, C, V);
-    softmax_forward(acts.probs, acts.logits, B, T, V);
+        gpt2_forward_layer(model, l, B, T);
+        // save this layer for the backward pass, only needed when there are targets
+        if (mp && targets != NULL && !model->inference_only) { gpt2_stash_layer(model, l, B, T, 0); }
+    }
+    residual = acts.residual3 + (mp || model->inference_only ? 0 : (L-1) * B * T * C); // last residual is in residual3
+    kernels.layernorm_forward(acts.lnf, acts.lnf_mean, acts.lnf_rstd, residual, params.lnfw, params.lnfb, B, T, C);
+    float* lm_head = model->lm_head != NULL ? model->lm_head : params.wte;
+    if (model->fused_classifier) {
+        if (targets != NULL) {
+            fused_classifier_forward(acts.losses, acts.logits, acts.lnf, lm_head, packed.wte, packed_bf16.wte,
+                                     quantized, targets, B, T, C, V);
+        } else {
+            // for sampling, the probabilities at the last position of every row: (B,V)
+            // the rows of lnf at t = T-1 are T*C apart, which the GEMM takes as a stride
+            gemm_weight(B, V, C, acts.lnf + (T-1) * C, T * C, lm_head, packed.wte, packed_bf16.wte, quantized,
+                        acts.probs, V, NULL);
+            kernels.softmax_forward(acts.probs, acts.probs, B, 1, V);
+        }
+    } else {
+        matmul_forward_packed(acts.logits, acts.lnf, lm_head, packed.wte, packed_bf16.wte, quantized, NULL, B, T, C, V);
+        kernels.softmax_forward(acts.probs, acts.logits, B, T, V);
+    }
 
     // also forward the cross-entropy loss function if we have the targets
     if (targets != NULL) {
-        crossentropy_forward(model->acts.losses, model->acts.probs, targets, B, T, V);
+        if (!model->fused_classifier) {
+            crossentropy_forward(model->acts.losses, model->acts.probs, targets, B, T, V);
+        }
         // for convenience also evaluate the mean loss
         float mean_loss = 0.0f;
         for (int i=0; i<B*T; i++) { mean_loss += model->acts.losses[i]; }
@@ -790,9 +2566,429 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, int B, int T) {
     }
 }
 
+// ----------------------------------------------------------------------------
+// incremental decoding: gpt2_forward recomputes every position of the sequence, while
+// generation only needs the next token. gpt2_decode instead keeps the keys and values of
+// all positions so far in a KVCache, one per sequence, and forwards only the new tokens
+
+void kv_cache_init(KVCache* cache, GPT2* model, int capacity) {
+    // a sequence of up to capacity positions. it takes no blocks until it gets tokens
+    int maxT = model->config.max_seq_len;
+    if (capacity <= 0 || capacity > maxT) { capacity = maxT; }
+    cache->pool = &model->kv_pool;
+    cache->capacity = capacity;
+    cache->len = 0;
+    cache->num_blocks = 0;
+    cache->table = (int*)malloc(((capacity + KV_BLOCK - 1) / KV_BLOCK) * sizeof(int));
+}
+
+void kv_cache_reserve(KVCache* cache, int len) {
+    // take the blocks for positions up to len-1
+    while (cache->num_blocks * KV_BLOCK < len) {
+        cache->table[cache->num_blocks++] = kv_pool_take(cache->pool);
+    }
+}
+
+void kv_cache_reset(KVCache* cache) {
+    // start a new sequence, giving all the blocks back to the pool
+    for (int i = 0; i < cache->num_blocks; i++) { kv_pool_give(cache->pool, cache->table[i]); }
+    cache->num_blocks = 0;
+    cache->len = 0;
+}
+
+void kv_cache_free(KVCache* cache) {
+    kv_cache_reset(cache);
+    free(cache->table);
+    cache->table = NULL;
+}
+
+void gpt2_decode_layer(GPT2 *model, int l, int N, float* residual, float* ping, float* pong) {
+    // transformer block l for the N new rows of gpt2_decode_batch, in place on their
+    // residual (N,C). ping (N,C) and pong (N,4C) hold the rest, like the inference arena
+    int C = model->config.channels;
+    int NH = model->config.num_heads;
+    ParameterTensors params = model->params;
+    int use_packed = model->packed_memory != NULL;
+    int use_bf16 = model->packed_bf16_memory != NULL;
+    QuantizedWeight* lq = model->quantized != NULL ? model->quantized + 1 + 4*l : NULL; // qkvw, attprojw, fcw, fcprojw
+    float* lp_qkvw = use_packed ? model->packed.qkvw + l * gemm_packed_size(C, 3*C) : NULL;
+    float* lp_attprojw = use_packed ? model->packed.attprojw + l * gemm_packed_size(C, C) : NULL;
+    float* lp_fcw = use_packed ? model->packed.fcw + l * gemm_packed_size(C, 4*C) : NULL;
+    float* lp_fcprojw = use_packed ? model->packed.fcprojw + l * gemm_packed_size(4*C, C) : NULL;
+    bf16* lh_qkvw = use_bf16 ? model->packed_bf16.qkvw + l * gemm_packed_size(C, 3*C) : NULL;
+    bf16* lh_attprojw = use_bf16 ? model->packed_bf16.attprojw + l * gemm_packed_size(C, C) : NULL;
+    bf16* lh_fcw = use_bf16 ? model->packed_bf16.fcw + l * gemm_packed_size(C, 4*C) : NULL;
+    bf16* lh_fcprojw = use_bf16 ? model->packed_bf16.fcprojw + l * gemm_packed_size(4*C, C) : NULL;
+    float** blocks = model->kv_pool.blocks;
+    size_t layer_offset = (size_t)l * 2 * KV_BLOCK * C; // of the keys of this layer in a block
+
+    // ln1 into ping, qkv into pong, and append the keys and values of the new rows
+    kernels.layernorm_forward(ping, NULL, NULL, residual, params.ln1w + l * C, params.ln1b + l * C, 1, N, C);
+    matmul_forward_packed(pong, ping, params.qkvw + l * 3*C * C, lp_qkvw, lh_qkvw, lq ? lq + 0 : NULL,
+                          params.qkvb + l * 3*C, 1, N, C, 3*C);
+    for (int n = 0; n < N; n++) {
+        int t = model->decode_positions[n];
+        float* key = blocks[model->decode_tables[n][t / KV_BLOCK]] + layer_offset + (t % KV_BLOCK) * C;
+        memcpy(key, pong + n * 3*C + C, C * sizeof(float));
+        memcpy(key + KV_BLOCK * C, pong + n * 3*C + 2*C, C * sizeof(float));
+    }
+    // attention into ping, its projection into pong, added to the residual
+    attention_forward_cached(ping, pong, blocks, model->decode_tables, model->decode_positions,
+                             layer_offset, N, C, NH);
+    matmul_forward_packed(pong, ping, params.attprojw + l * C * C, lp_attprojw, lh_attprojw, lq ? lq + 1 : NULL,
+                          params.attprojb + l * C, 1, N, C, C);
+    kernels.residual_forward(residual, residual, pong, N*C);
+    // the MLP: ln2 into ping, fc and gelu in pong, the projection into ping
+    kernels.layernorm_forward(ping, NULL, NULL, residual, params.ln2w + l * C, params.ln2b + l * C, 1, N, C);
+    matmul_forward_packed(pong, ping, params.fcw + l * 4*C * C, lp_fcw, lh_fcw, lq ? lq + 2 : NULL,
+                          params.fcb + l * 4*C, 1, N, C, 4*C);
+    kernels.gelu_forward(pong, pong, N*4*C);
+    matmul_forward_packed(ping, pong, params.fcprojw + l * C * 4*C, lp_fcprojw, lh_fcprojw, lq ? lq + 3 : NULL,
+                          params.fcprojb + l * C, 1, N, 4*C, C);
+    kernels.residual_forward(residual, residual, ping, N*C);
+}
+
+float* gpt2_decode_heads(GPT2 *model, KVCache** caches, int* tokens, int* counts, int S, int R) {
+    // forward new tokens of S sequences in one pass: sequence s brings counts[s] tokens (a
+    // prefill of its prompt, or the one token it generated last), which follow each other in
+    // tokens and go at positions caches[s]->len onwards. their keys and values are appended to
+    // the caches. returns the probabilities (S*R,V) of the tokens that follow the last R new
+    // tokens of each sequence; the logits are in model->decode_logits.
+    // all the rows go through the matmuls together, so the weights are read once per call
+    if (model->params_memory == NULL) {
+        printf("Error: model was not initialized properly.\n");
+        exit(1);
+    }
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    int N = 0;
+    for (int s = 0; s < S; s++) {
+        if (counts[s] < R || caches[s]->len + counts[s] > caches[s]->capacity) {
+            printf("Error: %d tokens don't fit in the KV cache (%d of %d positions used)\n",
+                   counts[s], caches[s]->len, caches[s]->capacity);
+            exit(1);
+        }
+        N += counts[s];
+    }
+
+    // the scratch grows with the most rows (of the largest prefill) and sequences of any call
+    if (N > model->decode_capacity) {
+        free(model->decode_memory);
+        free(model->decode_tables);
+        free(model->decode_positions);
+        model->decode_capacity = N;
+        model->decode_memory = (float*)malloc((size_t)N * 6 * C * sizeof(float));
+        model->decode_tables = (int**)malloc(N * sizeof(int*));
+        model->decode_positions = (int*)malloc(N * sizeof(int));
+    }
+    if (S * R > model->decode_head_capacity) {
+        free(model->decode_logits);
+        model->decode_head_capacity = S * R;
+        model->decode_logits = (float*)malloc(2 * (size_t)S * R * V * sizeof(float));
+        model->decode_probs = model->decode_logits + (size_t)S * R * V;
+    }
+    float* residual = model->decode_memory; // (N,C)
+    float* ping = residual + N * C; // (N,C)
+    float* pong = ping + N * C; // (N,4C)
+
+    // mixed precision runs the forward matmuls on bf16 copies of the weights
+    if (model->mixed_precision && model->packed_bf16_memory == NULL) { gpt2_pack_weights(model); }
+
+    // the embeddings of the new rows, and where each of them goes
+    ParameterTensors params = model->params;
+    ParameterTensors packed = model->packed;
+    PackedTensorsBF16 packed_bf16 = model->packed_bf16;
+    QuantizedWeight* quantized = model->quantized;
+    for (int s = 0, n = 0; s < S; n += counts[s], s++) {
+        float* wpe = params.wpe + caches[s]->len * C; // the new rows start at position len
+        if (model->packed_only) {
+            encoder_forward_packed(residual + n * C, tokens + n, packed.wte, packed_bf16.wte, quantized, wpe, 1, counts[s], C);
+        } else {
+            encoder_forward(residual + n * C, tokens + n, params.wte, wpe, 1, counts[s], C);
+        }
+        kv_cache_reserve(caches[s], caches[s]->len + counts[s]);
+        for (int i = 0; i < counts[s]; i++) {
+            model->decode_tables[n + i] = caches[s]->table;
+            model->decode_positions[n + i] = caches[s]->len + i;
+        }
+    }
+    for (int l = 0; l < L; l++) {
+        gpt2_decode_layer(model, l, N, residual, ping, pong);
+    }
+
+    // the final layernorm and the lm-head only for the last R rows of every sequence
+    for (int s = 0, n = 0; s < S; s++) {
+        n += counts[s];
+        caches[s]->len += counts[s];
+        kernels.layernorm_forward(ping + s * R * C, NULL, NULL, residual + (n-R) * C, params.lnfw, params.lnfb, 1, R, C);
+    }
+    float* lm_head = model->lm_head != NULL ? model->lm_head : params.wte;
+    gemm_weight(S * R, V, C, ping, C, lm_head, packed.wte, packed_bf16.wte, quantized, model->decode_logits, V, NULL);
+    kernels.softmax_forward(model->decode_probs, model->decode_logits, 1, S * R, V);
+    return model->decode_probs;
+}
+
+float* gpt2_decode_batch(GPT2 *model, KVCache** caches, int* tokens, int* counts, int S) {
+    // the probabilities (S,V) of the token that follows each of the S sequences
+    return gpt2_decode_heads(model, caches, tokens, counts, S, 1);
+}
+
+float* gpt2_decode(GPT2 *model, KVCache* cache, int* tokens, int N) {
+    // gpt2_decode_batch of one sequence: forward its N new tokens (N > 1 is a prefill of the
+    // prompt, after that every call is one generated token), and return the probabilities (V)
+    // of the token that follows
+    return gpt2_decode_batch(model, &cache, tokens, &N, 1);
+}
+
+float* gpt2_decode_rows(GPT2 *model, KVCache* cache, int* tokens, int N, int R) {
+    // like gpt2_decode, but returns the probabilities (R,V) of the tokens that follow each of
+    // the last R new tokens: the distributions of R consecutive positions, from one pass. this
+    // is how speculative decoding checks several drafted tokens at once
+    return gpt2_decode_heads(model, &cache, tokens, &N, 1, R);
+}
+
+void kv_cache_truncate(KVCache* cache, int len) {
+    // drop the positions from len on, e.g. the drafted tokens that were rejected, giving the
+    // blocks past them back. a block that is kept in part and also held by someone else (the
+    // PrefixCache) is copied first, since the sequence writes into it again
+    if (len >= cache->len) { return; }
+    KVPool* pool = cache->pool;
+    int keep = (len + KV_BLOCK - 1) / KV_BLOCK;
+    for (int i = keep; i < cache->num_blocks; i++) { kv_pool_give(pool, cache->table[i]); }
+    cache->num_blocks = keep;
+    cache->len = len;
+    if (len % KV_BLOCK != 0 && pool->refs[cache->table[keep-1]] > 1) {
+        int block = kv_pool_take(pool);
+        memcpy(pool->blocks[block], pool->blocks[cache->table[keep-1]], pool->block_floats * sizeof(float));
+        kv_pool_give(pool, cache->table[keep-1]);
+        cache->table[keep-1] = block;
+    }
+}
+
+// prefix caching: requests that begin with the same tokens (a system prompt, a preamble)
+// share the keys and values of them. the PrefixCache keeps the full KV blocks of earlier
+// sequences in a radix tree over their token ids, with one node per block of KV_BLOCK
+// tokens, and a new sequence starts from the blocks of its longest cached prefix instead of
+// forwarding it. the blocks are shared, not copied: a sequence only ever writes past its
+// matched prefix, into blocks of its own, so a cached block is never written again
+
+typedef struct {
+    int tokens[KV_BLOCK]; // the tokens whose keys and values the block holds
+    unsigned long long hash; // of the tokens, to skip most of the other children quickly
+    int block; // in the KVPool
+    int parent, child, sibling; // the links of the tree, -1 = none
+    long long last_used; // when it was last matched or inserted, for the LRU eviction
+} PrefixNode;
+
+typedef struct {
+    KVPool* pool;
+    int max_nodes; // the most blocks kept, beyond that the least recently used leaves go
+    PrefixNode* nodes; // (max_nodes + 1) node 0 is the root, the empty prefix
+    int* free_nodes; // (max_nodes) the unused nodes, as a stack
+    int num_free_nodes;
+    long long clock; // counts the matches and inserts
+    // counters: lookups and their prompt tokens, hits and the tokens they skipped
+    long long lookups, lookup_tokens, hits, hit_tokens, inserted, evicted;
+} PrefixCache;
+
+void prefix_cache_init(PrefixCache* pc, GPT2* model, int max_blocks) {
+    memset(pc, 0, sizeof(PrefixCache));
+    pc->pool = &model->kv_pool;
+    pc->max_nodes = max_blocks;
+    pc->nodes = (PrefixNode*)malloc((max_blocks + 1) * sizeof(PrefixNode));
+    pc->free_nodes = (int*)malloc((max_blocks > 0 ? max_blocks : 1) * sizeof(int));
+    pc->nodes[0].parent = pc->nodes[0].child = pc->nodes[0].sibling = -1;
+    pc->nodes[0].block = -1;
+    for (int i = max_blocks; i >= 1; i--) {
+        pc->nodes[i].block = -1;
+        pc->free_nodes[pc->num_free_nodes++] = i;
+    }
+}
+
+void prefix_cache_free(PrefixCache* pc) {
+    for (int i = 1; i <= pc->max_nodes; i++) {
+        if (pc->nodes[i].block >= 0) { kv_pool_give(pc->pool, pc->nodes[i].block); }
+    }
+    free(pc->nodes);
+    free(pc->free_nodes);
+}
+
+unsigned long long prefix_hash(int* tokens) {
+    // FNV-1a over the token ids of a block
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < KV_BLOCK; i++) {
+        hash = (hash ^ (unsigned int)tokens[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int prefix_child(PrefixCache* pc, int node, int* tokens, unsigned long long hash) {
+    // the child of node that continues with the KV_BLOCK tokens, or -1
+    for (int c = pc->nodes[node].child; c >= 0; c = pc->nodes[c].sibling) {
+        if (pc->nodes[c].hash == hash && memcmp(pc->nodes[c].tokens, tokens, sizeof(pc->nodes[c].tokens)) == 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+int prefix_cache_evict(PrefixCache* pc) {
+    // drop the least recently used leaf whose block no sequence holds, except the nodes
+    // touched by the current insert. returns 0 if there is none
+    int victim = -1;
+    for (int i = 1; i <= pc->max_nodes; i++) {
+        PrefixNode* node = &pc->nodes[i];
+        if (node->block < 0 || node->child >= 0 || pc->pool->refs[node->block] > 1 || node->last_used == pc->clock) { continue; }
+        if (victim < 0 || node->last_used < pc->nodes[victim].last_used) { victim = i; }
+    }
+    if (victim < 0) { return 0; }
+    PrefixNode* node = &pc->nodes[victim];
+    int* link = &pc->nodes[node->parent].child;
+    while (*link != victim) { link = &pc->nodes[*link].sibling; }
+    *link = node->sibling;
+    kv_pool_give(pc->pool, node->block);
+    node->block = -1;
+    pc->free_nodes[pc->num_free_nodes++] = victim;
+    pc->evicted++;
+    return 1;
+}
+
+int prefix_cache_match(PrefixCache* pc, KVCache* cache, int* tokens, int n) {
+    // start the empty cache from the longest cached prefix of tokens[0..n-1], in whole blocks.
+    // returns the number of tokens matched, which are then in the cache (cache->len)
+    // a prompt has to leave at least its last token out, which gets forwarded for the logits
+    long long now = ++pc->clock;
+    int node = 0;
+    for (int b = 0; (b + 1) * KV_BLOCK <= n && (b + 1) * KV_BLOCK <= cache->capacity; b++) {
+        int* block_tokens = tokens + b * KV_BLOCK;
+        int child = prefix_child(pc, node, block_tokens, prefix_hash(block_tokens));
+        if (child < 0) { break; }
+        node = child;
+        pc->nodes[node].last_used = now;
+        kv_pool_ref(pc->pool, pc->nodes[node].block);
+        cache->table[cache->num_blocks++] = pc->nodes[node].block;
+    }
+    cache->len = cache->num_blocks * KV_BLOCK;
+    pc->lookups++;
+    pc->lookup_tokens += n;
+    if (cache->len > 0) { pc->hits++; }
+    pc->hit_tokens += cache->len;
+    return cache->len;
+}
+
+void prefix_cache_insert(PrefixCache* pc, KVCache* cache, int* tokens) {
+    // add the full blocks of the sequence in cache, whose tokens are tokens[0..cache->len-1]
+    long long now = ++pc->clock;
+    int node = 0;
+    for (int b = 0; b < cache->len / KV_BLOCK; b++) {
+        int* block_tokens = tokens + b * KV_BLOCK;
+        unsigned long long hash = prefix_hash(block_tokens);
+        int child = prefix_child(pc, node, block_tokens, hash);
+        if (child < 0) {
+            if (pc->num_free_nodes == 0 && !prefix_cache_evict(pc)) { return; } // full of blocks in use
+            child = pc->free_nodes[--pc->num_free_nodes];
+            PrefixNode* added = &pc->nodes[child];
+            memcpy(added->tokens, block_tokens, sizeof(added->tokens));
+            added->hash = hash;
+            added->block = cache->table[b];
+            kv_pool_ref(pc->pool, added->block);
+            added->parent = node;
+            added->child = -1;
+            added->sibling = pc->nodes[node].child;
+            pc->nodes[node].child = child;
+            pc->inserted++;
+        }
+        node = child;
+        pc->nodes[node].last_used = now;
+    }
+}
+
+#ifndef INFERENCE_ONLY
+void gpt2_untie_embeddings(GPT2 *model) {
+    // give the lm-head its own weight, a copy of wte for a start. it goes after the other
+    // parameters, so the gradients and the optimizer cover it like any other tensor, and wte
+    // is left with the gradient of the encoder only, which gpt2_zero_grad and gpt2_update
+    // handle by rows. for fp32 training: call it before the first backward pass, and without
+    // packed, bf16 or quantized weights, whose copies of wte would still be the lm-head
+    if (model->untied_embeddings) { return; }
+    if (model->inference_only || model->grads_memory != NULL || model->mixed_precision
+        || model->packed_memory != NULL || model->packed_bf16_memory != NULL || model->quantized != NULL) {
+        printf("Error: untied embeddings need an fp32 model that hasn't trained yet\n");
+        exit(1);
+    }
+    size_t num_parameters = model->num_parameters;
+    size_t VC = model->param_sizes[0];
+    float* params_memory = (float*)alloc_large((num_parameters + VC) * sizeof(float));
+    alloc_zero(params_memory, (num_parameters + VC) * sizeof(float), 1);
+    memcpy(params_memory, model->params_memory, num_parameters * sizeof(float));
+    memcpy(params_memory + num_parameters, model->params.wte, VC * sizeof(float));
+    if (!gpt2_is_mapped(model, model->params_memory)) { free_large(model->params_memory); }
+    model->params_memory = params_memory;
+    point_parameters(&model->params, model->param_sizes, params_memory);
+    model->lm_head = params_memory + num_parameters;
+    model->num_parameters = num_parameters + VC;
+    model->untied_embeddings = 1;
+}
+
 void gpt2_zero_grad(GPT2 *model) {
-    if(model->grads_memory != NULL) { memset(model->grads_memory, 0, model->num_parameters * sizeof(float)); }
-    if(model->grads_acts_memory != NULL) { memset(model->grads_acts_memory, 0, model->num_activations * sizeof(float)); }
+    // zeroed in parallel, with the same split as their first touch
+    // the activation gradients don't need it, their backward kernels write them first
+    if (model->grads_memory == NULL) { return; }
+    if (!model->untied_embeddings) {
+        alloc_zero(model->grads_memory, model->num_parameters * sizeof(float), 1);
+        return;
+    }
+    // with untied embeddings only the rows of grads.wte that the encoder wrote need it
+    size_t C = model->config.channels;
+    size_t VC = model->param_sizes[0];
+    #pragma omp parallel for
+    for (int r = 0; r < model->num_wte_rows; r++) {
+        int row = model->wte_rows[r];
+        memset(model->grads.wte + row * C, 0, C * sizeof(float));
+        model->wte_row_marks[row] = 0;
+    }
+    model->num_wte_rows = 0;
+    alloc_zero(model->grads_memory + VC, (model->num_parameters - VC) * sizeof(float), 1);
+}
+
+void gpt2_encoder_backward(GPT2 *model, float* dout, int B, int T) {
+    // the encoder's part of the gradients of wte and wpe. with untied embeddings that is all
+    // of dwte: the few rows of the batch are scattered on their own, and kept in wte_rows
+    // for gpt2_zero_grad and gpt2_update, which then skip all the other rows
+    int C = model->config.channels;
+    if (!model->untied_embeddings) {
+        encoder_backward(model->grads.wte, model->grads.wpe, dout, model->inputs, B, T, C);
+        return;
+    }
+    // lazily allocate the row index of the batch (again after gpt2_forward grew the
+    // activations) with its (V) scratch all -1, and the rows of the step
+    size_t V = model->config.vocab_size;
+    if (model->embedding_rows_memory == NULL) {
+        size_t BT = (size_t)model->batch_capacity * model->seq_capacity;
+        model->embedding_rows_memory = (int*)malloc((3 * BT + 1 + V) * sizeof(int));
+        EmbeddingRows* er = &model->embedding_rows;
+        er->rows = model->embedding_rows_memory;
+        er->offsets = er->rows + BT;
+        er->positions = er->offsets + BT + 1;
+        er->slot = er->positions + BT;
+        for (size_t i = 0; i < V; i++) { er->slot[i] = -1; }
+    }
+    if (model->wte_rows == NULL) {
+        model->wte_rows = (int*)malloc(V * sizeof(int));
+        model->wte_row_marks = (unsigned char*)calloc(V, 1);
+        model->num_wte_rows = 0;
+    }
+    EmbeddingRows* er = &model->embedding_rows;
+    embedding_rows_build(er, model->inputs, B * T);
+    encoder_backward_rows(model->grads.wte, model->grads.wpe, dout, er, B, T, C);
+    for (int r = 0; r < er->num_rows; r++) {
+        int row = er->rows[r];
+        if (!model->wte_row_marks[row]) {
+            model->wte_row_marks[row] = 1;
+            model->wte_rows[model->num_wte_rows++] = row;
+        }
+    }
 }
 
 void gpt2_backward(GPT2 *model) {
@@ -802,12 +2998,49 @@ void gpt2_backward(GPT2 *model) {
         printf("Error: must forward with targets before backward\n");
         exit(1);
     }
+    if (model->packed_only || model->inference_only) {
+        printf("Error: the model was set up for inference only\n");
+        exit(1);
+    }
 
     // lazily allocate the memory for gradients of the weights and activations, if needed
+    // (the activation gradients again after gpt2_forward grew the activations)
+    // (num_parameters also counts the lm-head with untied embeddings)
     if (model->grads_memory == NULL) {
-        model->grads_memory = malloc_and_point_parameters(&model->grads, model->param_sizes);
-        model->grads_acts_memory = malloc_and_point_activations(&model->grads_acts, model->act_sizes);
-        gpt2_zero_grad(model);
+        size_t grads_bytes = (size_t)model->num_parameters * sizeof(float);
+        model->grads_memory = (float*)alloc_large(grads_bytes);
+        alloc_zero(model->grads_memory, grads_bytes, 1);
+        point_parameters(&model->grads, model->param_sizes, model->grads_memory);
+    }
+    if (model->grads_acts_memory == NULL) {
+        // every activation gradient inside a layer is written once and dead by the end of
+        // that layer, so the layers take turns on one (B,T) slot of each instead of L of
+        // them. what does cross the layers is the gradient of the residual stream, which
+        // lives in grads_acts.encoded (see below), and the tensors that are aliases of
+        // another one get no memory of their own
+        size_t BT = (size_t)model->batch_capacity * model->seq_capacity;
+        size_t C = model->config.channels;
+        size_t NH = model->config.num_heads;
+        size_t T = model->seq_capacity;
+        size_t sizes[NUM_ACTIVATION_TENSORS] = {0};
+        sizes[0] = BT * C; // encoded: the residual stream, also residual2/3, attproj and fcproj
+        sizes[1] = BT * C; // ln1
+        sizes[4] = BT * 3*C; // qkv
+        sizes[5] = BT * C; // atty
+        if (!model->flash_attention) {
+            sizes[6] = BT / T * NH * T * T; // preatt
+            sizes[7] = BT / T * NH * T * T; // att
+        }
+        sizes[10] = BT * C; // ln2
+        sizes[14] = BT * 4*C; // fch_gelu, also fch (gelu_backward works in place)
+        sizes[17] = BT * C; // lnf
+        sizes[20] = model->fused_classifier ? 0 : BT * model->config.vocab_size; // logits
+        sizes[22] = BT; // losses
+        size_t num_grads_acts = 0;
+        for (int i = 0; i < NUM_ACTIVATION_TENSORS; i++) { num_grads_acts += sizes[i]; }
+        printf("activation gradient memory: %.1f MiB\n", num_grads_acts * sizeof(float) / 1048576.0);
+        model->grads_acts_memory = malloc_and_point_activations(&model->grads_acts, sizes);
+        first_touch_activations(model->grads_acts_memory, sizes, NULL);
     }
 
     // convenience shortcuts
@@ -823,23 +3056,53 @@ void gpt2_backward(GPT2 *model) {
     ParameterTensors grads = model->grads;
     ActivationTensors acts = model->acts;
     ActivationTensors grads_acts = model->grads_acts;
+    int att_size = model->flash_attention ? NH * T : NH * T * T; // per (b) slice of preatt/att
+
+    // dresidual is the gradient of the residual stream. the residual connections pass it
+    // on unchanged, so it is also the gradient of fcproj and attproj as it stands, and
+    // the layernorms add theirs into it in place. it is the only activation gradient
+    // with several writers, so the only one that gets zeroed
+    float* dresidual = grads_acts.encoded;
+    alloc_zero(dresidual, (size_t)B * T * C * sizeof(float), 1);
 
     // we kick off the chain rule by filling in dlosses with 1.0f/(B*T)
     // technically this is a small, inline backward() pass of calculating
     // total, final loss as the mean over all losses over all (B,T) positions in the batch
-    float dloss_mean = 1.0f / (B*T);
+    // with gradient accumulation the loss is the mean over all grad_accum_steps micro-batches
+    // instead. every weight gradient is added into grads, so the caller zeroes them before
+    // the first micro-batch only and calls gpt2_update after the last one
+    if (model->grad_accum_steps < 1) {
+        printf("Error: grad_accum_steps must be at least 1\n");
+        exit(1);
+    }
+    float dloss_mean = 1.0f / ((float)B * T * model->grad_accum_steps);
     for (int i = 0; i < B*T; i++) { grads_acts.losses[i] = dloss_mean; }
 
-    crossentropy_softmax_backward(grads_acts.logits, grads_acts.losses, acts.probs, model->targets, B, T, V);
-    matmul_backward(grads_acts.lnf, grads.wte, NULL, grads_acts.logits, acts.lnf, params.wte, B, T, C, V);
-    float* residual = acts.residual3 + (L-1) * B * T * C; // last layer's residual
-    float* dresidual = grads_acts.residual3 + (L-1) * B * T * C; // write to last layer's residual
-    layernorm_backward(dresidual, grads.lnfw, grads.lnfb, grads_acts.lnf, residual, params.lnfw, acts.lnf_mean, acts.lnf_rstd, B, T, C);
+    // with untied embeddings the lm-head is the last tensor of the parameters, see gpt2_untie_embeddings
+    float* lm_head = model->untied_embeddings ? model->lm_head : params.wte;
+    float* dlm_head = model->untied_embeddings ? model->grads_memory + (model->lm_head - model->params_memory) : grads.wte;
+    if (model->fused_classifier) {
+        fused_classifier_backward(grads_acts.lnf, dlm_head, grads_acts.losses, acts.logits,
+                                  acts.lnf, lm_head, model->packed.wte, model->packed_bf16.wte, NULL, model->targets, B, T, C, V);
+    } else {
+        kernels.crossentropy_softmax_backward(grads_acts.logits, grads_acts.losses, acts.probs, model->targets, B, T, V);
+        matmul_backward(grads_acts.lnf, dlm_head, NULL, grads_acts.logits, acts.lnf, lm_head, B, T, C, V);
+    }
+    // in mixed precision the large per-layer activations share one layer slot (see gpt2_layer_slots),
+    // which still holds the last layer in fp32 here
+    int mp = model->mixed_precision;
+    float* residual = acts.residual3 + (mp ? 0 : (L-1) * B * T * C); // last layer's residual
+    kernels.layernorm_backward(dresidual, grads.lnfw, grads.lnfb, grads_acts.lnf, residual, params.lnfw, acts.lnf_mean, acts.lnf_rstd, B, T, C);
 
     for (int l = L-1; l >= 0; l--) {
 
-        residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
-        dresidual = l == 0 ? grads_acts.encoded : grads_acts.residual3 + (l-1) * B * T * C;
+        int ls, lr;
+        gpt2_layer_slots(model, l, &ls, &lr);
+        int la = model->flash_attention ? l : lr;
+        if (mp) { gpt2_stash_layer(model, l, B, T, 1); }
+        // activation checkpointing: recompute what the forward pass didn't keep of this layer
+        if (model->recompute == 2 && l % model->recompute_every == 0) { gpt2_forward_layer(model, l, B, T); }
+        residual = l == 0 ? acts.encoded : acts.residual3 + (mp ? 0 : (l-1) * B * T * C);
 
         // get the pointers of the weights for this layer
         float* l_ln1w = params.ln1w + l * C;
@@ -862,89 +3125,264 @@ void gpt2_backward(GPT2 *model) {
         float* dl_fcprojw = grads.fcprojw + l * C * 4*C;
         float* dl_fcprojb = grads.fcprojb + l * C;
         // get the pointers of the activations for this layer
-        float* l_ln1 = acts.ln1 + l * B * T * C;
+        float* l_ln1 = acts.ln1 + ls * B * T * C;
         float* l_ln1_mean = acts.ln1_mean + l * B * T;
         float* l_ln1_rstd = acts.ln1_rstd + l * B * T;
-        float* l_qkv = acts.qkv + l * B * T * 3*C;
-        float* l_atty = acts.atty + l * B * T * C;
-        float* l_att = acts.att + l * B * NH * T * T;
-        float* l_residual2 = acts.residual2 + l * B * T * C;
-        float* l_ln2 = acts.ln2 + l * B * T * C;
+        float* l_qkv = acts.qkv + ls * B * T * 3*C;
+        float* l_atty = acts.atty + lr * B * T * C;
+        float* l_preatt = acts.preatt + la * B * att_size;
+        float* l_att = acts.att + la * B * att_size;
+        float* l_residual2 = acts.residual2 + ls * B * T * C;
+        float* l_ln2 = acts.ln2 + ls * B * T * C;
         float* l_ln2_mean = acts.ln2_mean + l * B * T;
         float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
-        float* l_fch = acts.fch + l * B * T * 4*C;
-        float* l_fch_gelu = acts.fch_gelu + l * B * T * 4*C;
-        // get the pointers of the gradients of the activations for this layer
-        float* dl_ln1 = grads_acts.ln1 + l * B * T * C;
-        float* dl_qkv = grads_acts.qkv + l * B * T * 3*C;
-        float* dl_atty = grads_acts.atty + l * B * T * C;
-        float* dl_preatt = grads_acts.preatt + l * B * NH * T * T;
-        float* dl_att = grads_acts.att + l * B * NH * T * T;
-        float* dl_attproj = grads_acts.attproj + l * B * T * C;
-        float* dl_residual2 = grads_acts.residual2 + l * B * T * C;
-        float* dl_ln2 = grads_acts.ln2 + l * B * T * C;
-        float* dl_fch = grads_acts.fch + l * B * T * 4*C;
-        float* dl_fch_gelu = grads_acts.fch_gelu + l * B * T * 4*C;
-        float* dl_fcproj = grads_acts.fcproj + l * B * T * C;
-        float* dl_residual3 = grads_acts.residual3 + l * B * T * C;
-
-        // backprop this layer
-        residual_backward(dl_residual2, dl_fcproj, dl_residual3, B*T*C);
-        matmul_backward(dl_fch_gelu, dl_fcprojw, dl_fcprojb, dl_fcproj, l_fch_gelu, l_fcprojw, B, T, 4*C, C);
-        gelu_backward(dl_fch, l_fch, dl_fch_gelu, B*T*4*C);
+        float* l_fch = acts.fch + ls * B * T * 4*C;
+        float* l_fch_gelu = acts.fch_gelu + lr * B * T * 4*C;
+        if (model->recompute == 1) {
+            if (model->flash_attention) {
+                attention_forward_flash(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
+            } else {
+                attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
+            }
+            kernels.gelu_forward(l_fch_gelu, l_fch, B*T*4*C);
+        }
+        // get the pointers of the gradients of the activations for this layer, which all
+        // layers share (see the allocation above). att_size is the (b) stride of preatt/att
+        float* dl_ln1 = grads_acts.ln1;
+        float* dl_qkv = grads_acts.qkv;
+        float* dl_atty = grads_acts.atty;
+        float* dl_preatt = grads_acts.preatt;
+        float* dl_att = grads_acts.att;
+        float* dl_ln2 = grads_acts.ln2;
+        float* dl_fch_gelu = grads_acts.fch_gelu;
+        float* dl_fch = grads_acts.fch_gelu;
+
+        // backprop this layer. every kernel is the first writer of its dinp, except for
+        // the layernorms, which accumulate into dresidual
+        matmul_backward(dl_fch_gelu, dl_fcprojw, dl_fcprojb, dresidual, l_fch_gelu, l_fcprojw, B, T, 4*C, C);
+        kernels.gelu_backward(dl_fch, l_fch, dl_fch_gelu, B*T*4*C);
         matmul_backward(dl_ln2, dl_fcw, dl_fcb, dl_fch, l_ln2, l_fcw, B, T, C, 4*C);
-        layernorm_backward(dl_residual2, dl_ln2w, dl_ln2b, dl_ln2, l_residual2, l_ln2w, l_ln2_mean, l_ln2_rstd, B, T, C);
-        residual_backward(dresidual, dl_attproj, dl_residual2, B*T*C);
-        matmul_backward(dl_atty, dl_attprojw, dl_attprojb, dl_attproj, l_atty, l_attprojw, B, T, C, C);
-        attention_backward(dl_qkv, dl_preatt, dl_att, dl_atty, l_qkv, l_att, B, T, C, NH);
+        kernels.layernorm_backward(dresidual, dl_ln2w, dl_ln2b, dl_ln2, l_residual2, l_ln2w, l_ln2_mean, l_ln2_rstd, B, T, C);
+        matmul_backward(dl_atty, dl_attprojw, dl_attprojb, dresidual, l_atty, l_attprojw, B, T, C, C);
+        if (model->flash_attention) {
+            attention_backward_flash(dl_qkv, dl_atty, l_qkv, l_preatt, l_att, B, T, C, NH);
+        } else {
+            attention_backward(dl_qkv, dl_preatt, dl_att, dl_atty, l_qkv, l_att, B, T, C, NH);
+        }
         matmul_backward(dl_ln1, dl_qkvw, dl_qkvb, dl_qkv, l_ln1, l_qkvw, B, T, C, 3*C);
-        layernorm_backward(dresidual, dl_ln1w, dl_ln1b, dl_ln1, residual, l_ln1w, l_ln1_mean, l_ln1_rstd, B, T, C);
+        kernels.layernorm_backward(dresidual, dl_ln1w, dl_ln1b, dl_ln1, residual, l_ln1w, l_ln1_mean, l_ln1_rstd, B, T, C);
+    }
+    gpt2_encoder_backward(model, dresidual, B, T);
+}
+
+// the AdamW moments can be kept in less than fp32. with 16 bits they are bf16, with 8 bits
+// they are split into blocks of ADAMW_BLOCK values with one fp32 scale each. the 8-bit
+// codes are relative to the largest value of the block, on a square root scale for the
+// signed m and a fourth root scale for v: most of a block is far below its maximum, and a
+// linear code would round those entries to zero. v is rounded up, so that the denominator
+// of the update never shrinks from the rounding (which would blow up the steps of the
+// parameters whose v rounds to zero). the optimizer widens every block to fp32, updates it
+// and narrows it again, so only the storage changes
+#define ADAMW_BLOCK 256
+
+void adamw_state_widen(GPT2 *model, size_t block, int n, float* m, float* v) {
+    size_t i0 = block * ADAMW_BLOCK;
+    if (model->optimizer_bits == 16) {
+        bf16* m16 = (bf16*)model->m_memory + i0;
+        bf16* v16 = (bf16*)model->v_memory + i0;
+        for (int i = 0; i < n; i++) { m[i] = bf16_to_float(m16[i]); v[i] = bf16_to_float(v16[i]); }
+    } else {
+        int8_t* m8 = (int8_t*)model->m_memory + i0;
+        uint8_t* v8 = (uint8_t*)model->v_memory + i0;
+        float m_scale = model->optimizer_scales[2 * block];
+        float v_scale = model->optimizer_scales[2 * block + 1];
+        for (int i = 0; i < n; i++) {
+            float qm = (float)m8[i];
+            float qv = (float)v8[i] * v8[i];
+            m[i] = qm * fabsf(qm) * m_scale;
+            v[i] = qv * qv * v_scale;
+        }
     }
-    encoder_backward(grads.wte, grads.wpe, grads_acts.encoded, model->inputs, B, T, C);
+}
+
+void adamw_state_narrow(GPT2 *model, size_t block, int n, float* m, float* v) {
+    size_t i0 = block * ADAMW_BLOCK;
+    if (model->optimizer_bits == 16) {
+        bf16* m16 = (bf16*)model->m_memory + i0;
+        bf16* v16 = (bf16*)model->v_memory + i0;
+        for (int i = 0; i < n; i++) { m16[i] = float_to_bf16(m[i]); v16[i] = float_to_bf16(v[i]); }
+    } else {
+        int8_t* m8 = (int8_t*)model->m_memory + i0;
+        uint8_t* v8 = (uint8_t*)model->v_memory + i0;
+        float m_max, v_max;
+        kernels.adamw_codes(m, v, n, &m_max, &v_max);
+        // m rounds to the nearest code and v up (integer casts: roundf and ceilf are
+        // library calls without SSE4.1, and the casts vectorize)
+        for (int i = 0; i < n; i++) {
+            int qm = (int)(m[i] + (m[i] < 0.0f ? -0.5f : 0.5f));
+            int qv = (int)v[i];
+            qv += (float)qv < v[i];
+            m8[i] = (int8_t)qm;
+            v8[i] = (uint8_t)(qv < 255 ? qv : 255);
+        }
+        model->optimizer_scales[2 * block] = m_max / (127.0f * 127.0f);
+        model->optimizer_scales[2 * block + 1] = v_max / (255.0f * 255.0f * 255.0f * 255.0f);
+    }
+}
+
+void adamw_step_block(GPT2 *model, size_t block, int* runs, int num_runs, float learning_rate, float beta1, float beta2,
+                      float beta1_correction, float beta2_correction, float eps, float weight_decay) {
+    // one AdamW step of the parameters [runs[2*r], runs[2*r+1]) of a block, with its moments
+    // widened to fp32 around it when they are stored in less
+    size_t i0 = block * ADAMW_BLOCK;
+    int n = model->num_parameters - i0 < ADAMW_BLOCK ? (int)(model->num_parameters - i0) : ADAMW_BLOCK;
+    float* params = model->params_memory + i0;
+    float* grads = model->grads_memory + i0;
+    float m_block[ADAMW_BLOCK], v_block[ADAMW_BLOCK];
+    float* m = model->optimizer_bits == 32 ? (float*)model->m_memory + i0 : m_block;
+    float* v = model->optimizer_bits == 32 ? (float*)model->v_memory + i0 : v_block;
+    if (model->optimizer_bits != 32) { adamw_state_widen(model, block, n, m, v); }
+    for (int r = 0; r < num_runs; r++) {
+        int lo = runs[2 * r], hi = runs[2 * r + 1];
+        kernels.adamw_update(params + lo, grads + lo, m + lo, v + lo, hi - lo,
+                             learning_rate, beta1, beta2, beta1_correction, beta2_correction, eps, weight_decay);
+    }
+    if (model->optimizer_bits != 32) { adamw_state_narrow(model, block, n, m, v); }
+}
+
+int wte_row_runs(GPT2 *model, size_t block, int* runs) {
+    // with untied embeddings, the runs of a block that take a step: the rows of wte that
+    // the encoder wrote since gpt2_zero_grad, and all of the tensors after wte
+    size_t i0 = block * ADAMW_BLOCK;
+    int n = model->num_parameters - i0 < ADAMW_BLOCK ? (int)(model->num_parameters - i0) : ADAMW_BLOCK;
+    size_t C = model->config.channels;
+    size_t VC = model->param_sizes[0];
+    int num_runs = 0;
+    for (int j = 0; j < n;) {
+        size_t i = i0 + j;
+        size_t row_end = (i / C + 1) * C - i0;
+        int end = i >= VC || row_end > (size_t)n ? n : (int)row_end;
+        if (i >= VC || model->wte_row_marks[i / C]) {
+            if (num_runs > 0 && runs[2 * num_runs - 1] == j) { runs[2 * num_runs - 1] = end; }
+            else { runs[2 * num_runs] = j; runs[2 * num_runs + 1] = end; num_runs++; }
+        }
+        j = end;
+    }
+    return num_runs;
+}
+
+int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
 }
 
 void gpt2_update(GPT2 *model, float learning_rate, float beta1, float beta2, float eps, float weight_decay, int t) {
     // reference: https://pytorch.org/docs/stable/generated/torch.optim.AdamW.html
+    if (model->packed_only || model->inference_only) {
+        printf("Error: the model was set up for inference only\n");
+        exit(1);
+    }
+    int bits = model->optimizer_bits;
+    size_t num_parameters = model->num_parameters;
+    size_t num_blocks = (num_parameters + ADAMW_BLOCK - 1) / ADAMW_BLOCK;
 
     // lazily allocate the memory for m_memory and v_memory
     if (model->m_memory == NULL) {
-        model->m_memory = (float*)calloc(model->num_parameters, sizeof(float));
-        model->v_memory = (float*)calloc(model->num_parameters, sizeof(float));
+        if (bits != 32 && bits != 16 && bits != 8) {
+            printf("Error: optimizer_bits must be 32, 16 or 8\n");
+            exit(1);
+        }
+        size_t state_bytes = num_parameters * (bits / 8);
+        model->m_memory = alloc_large(state_bytes);
+        model->v_memory = alloc_large(state_bytes);
+        alloc_zero(model->m_memory, state_bytes, 1);
+        alloc_zero(model->v_memory, state_bytes, 1);
+        if (bits == 8) { model->optimizer_scales = (float*)calloc(2 * num_blocks, sizeof(float)); }
+        printf("optimizer state memory: %.1f MiB\n",
+               (2 * state_bytes + (bits == 8 ? 2 * num_blocks * sizeof(float) : 0)) / 1048576.0);
     }
 
-    for (int i = 0; i < model->num_parameters; i++) {
-        float param = model->params_memory[i];
-        float grad = model->grads_memory[i];
-
-        // update the first moment (momentum)
-        float m = beta1 * model->m_memory[i] + (1.0f - beta1) * grad;
-        // update the second moment (RMSprop)
-        float v = beta2 * model->v_memory[i] + (1.0f - beta2) * grad * grad;
-        // bias-correct both moments
-        float m_hat = m / (1.0f - powf(beta1, t));
-        float v_hat = v / (1.0f - powf(beta2, t));
+    // the bias corrections only depend on the step
+    float beta1_correction = 1.0f - powf(beta1, t);
+    float beta2_correction = 1.0f - powf(beta2, t);
+
+    // with untied embeddings the blocks of wte only step the rows that the encoder wrote since
+    // gpt2_zero_grad. this is a lazy AdamW for wte: the other rows keep their weights and
+    // moments until a batch uses them again. the rows give the blocks that hold them, and the
+    // block that wte shares with wpe (if any) also steps all of its wpe part
+    size_t dense_block_start = 0;
+    int num_row_blocks = 0;
+    if (model->untied_embeddings) {
+        size_t C = model->config.channels;
+        size_t VC = model->param_sizes[0];
+        dense_block_start = (VC + ADAMW_BLOCK - 1) / ADAMW_BLOCK;
+        if (model->wte_row_blocks == NULL) { model->wte_row_blocks = (int*)malloc(dense_block_start * sizeof(int)); }
+        int* blocks = model->wte_row_blocks;
+        qsort(model->wte_rows, model->num_wte_rows, sizeof(int), compare_ints);
+        for (int r = 0; r < model->num_wte_rows; r++) {
+            size_t row = model->wte_rows[r];
+            int first = (int)(row * C / ADAMW_BLOCK);
+            int last = (int)(((row + 1) * C - 1) / ADAMW_BLOCK);
+            if (num_row_blocks > 0 && first <= blocks[num_row_blocks - 1]) { first = blocks[num_row_blocks - 1] + 1; }
+            for (int b = first; b <= last; b++) { blocks[num_row_blocks++] = b; }
+        }
+        int shared = (int)(VC / ADAMW_BLOCK);
+        if (VC % ADAMW_BLOCK != 0 && (num_row_blocks == 0 || blocks[num_row_blocks - 1] != shared)) {
+            blocks[num_row_blocks++] = shared;
+        }
+        #pragma omp parallel for schedule(static)
+        for (int k = 0; k < num_row_blocks; k++) {
+            int runs[2 * ADAMW_BLOCK];
+            int num_runs = wte_row_runs(model, blocks[k], runs);
+            adamw_step_block(model, blocks[k], runs, num_runs, learning_rate, beta1, beta2,
+                             beta1_correction, beta2_correction, eps, weight_decay);
+        }
+    }
 
-        // update
-        model->m_memory[i] = m;
-        model->v_memory[i] = v;
-        model->params_memory[i] -= learning_rate * (m_hat / (sqrtf(v_hat) + eps) + weight_decay * param);
+    // a single pass over params, grads, m and v, in blocks that are split over the threads
+    // like the first touch of these buffers
+    #pragma omp parallel for schedule(static)
+    for (size_t block = dense_block_start; block < num_blocks; block++) {
+        size_t i0 = block * ADAMW_BLOCK;
+        int runs[2] = {0, num_parameters - i0 < ADAMW_BLOCK ? (int)(num_parameters - i0) : ADAMW_BLOCK};
+        adamw_step_block(model, block, runs, 1, learning_rate, beta1, beta2,
+                         beta1_correction, beta2_correction, eps, weight_decay);
     }
+
+    // keep the packed copies of the matmul weights in sync
+    if (model->packed_memory != NULL || model->packed_bf16_memory != NULL) { gpt2_pack_weights(model); }
 }
+#endif // INFERENCE_ONLY
 
 void gpt2_free(GPT2 *model) {
-    free(model->params_memory);
-    free(model->grads_memory);
-    free(model->m_memory);
-    free(model->v_memory);
-    free(model->acts_memory);
-    free(model->grads_acts_memory);
+    if (!gpt2_is_mapped(model, model->params_memory)) { free_large(model->params_memory); }
+    if (!gpt2_is_mapped(model, model->quantized_memory)) { free_large(model->quantized_memory); }
+    if (model->mapped_memory != NULL) { munmap(model->mapped_memory, model->mapped_bytes); }
+    free_large(model->packed_memory);
+    free_large(model->packed_bf16_memory);
+    free_large(model->acts_bf16_memory);
+    free(model->quantized);
+#ifndef INFERENCE_ONLY
+    free_large(model->grads_memory);
+    free_large(model->m_memory);
+    free_large(model->v_memory);
+    free(model->optimizer_scales);
+    free_large(model->grads_acts_memory);
+    free(model->embedding_rows_memory);
+    free(model->wte_rows);
+    free(model->wte_row_marks);
+    free(model->wte_row_blocks);
+#endif
+    free_large(model->acts_memory);
+    free(model->decode_memory);
+    free(model->decode_tables);
+    free(model->decode_positions);
+    free(model->decode_logits);
+    kv_pool_free(&model->kv_pool);
     free(model->inputs);
     free(model->targets);
 }
 
-#ifndef TESTING
-// if we are TESTING (see test_gpt2.c), we'll skip the int main below
-
 // ----------------------------------------------------------------------------
 // data loader lite
 // returns random batches of data from a file of integers
@@ -1046,13 +3484,198 @@ int sample_mult(float* probabilities, int n, float coin) {
     return n - 1; // in case of rounding errors
 }
 
+// ----------------------------------------------------------------------------
+// speculative decoding: a small draft model proposes the next k tokens one at a time, and
+// the target model checks all of them in one pass (gpt2_decode_rows), which costs about as
+// much as forwarding one token since the pass is bound by reading the weights. drafted token
+// x is kept with probability min(1, p(x)/q(x)), where p and q are the target and draft
+// distributions at its position; the first rejected one is replaced by a sample of
+// max(0, p - q), renormalized, and if all k are kept the target's distribution after them
+// gives one more token for free. every token then is distributed exactly as if it was
+// sampled from the target alone (Leviathan et al. 2023), only the number of passes changes
+
+typedef struct {
+    GPT2* target;
+    GPT2* draft; // with the vocabulary of the target
+    KVCache target_cache;
+    KVCache draft_cache;
+    int k; // the tokens drafted per step
+    float* draft_probs; // (k,V) the draft distribution of every drafted token
+    float* residual; // (V) max(0, p - q) of a rejected token
+    // statistics
+    long long steps;
+    long long drafted;
+    long long accepted;
+} Speculator;
+
+void speculator_init(Speculator* sp, GPT2* target, GPT2* draft, int k, int capacity) {
+    // caches for sequences of up to capacity tokens in both models
+    if (draft->config.vocab_size != target->config.vocab_size) {
+        printf("Error: the draft model has a vocabulary of %d tokens, the target of %d\n",
+               draft->config.vocab_size, target->config.vocab_size);
+        exit(1);
+    }
+    if (k < 1) { k = 1; }
+    int V = target->config.vocab_size;
+    sp->target = target;
+    sp->draft = draft;
+    kv_cache_init(&sp->target_cache, target, capacity);
+    kv_cache_init(&sp->draft_cache, draft, capacity);
+    sp->k = k;
+    sp->draft_probs = (float*)malloc((size_t)k * V * sizeof(float));
+    sp->residual = (float*)malloc(V * sizeof(float));
+    sp->steps = 0;
+    sp->drafted = 0;
+    sp->accepted = 0;
+}
+
+void speculator_reset(Speculator* sp) {
+    // start a new sequence
+    kv_cache_reset(&sp->target_cache);
+    kv_cache_reset(&sp->draft_cache);
+}
+
+void speculator_free(Speculator* sp) {
+    kv_cache_free(&sp->target_cache);
+    kv_cache_free(&sp->draft_cache);
+    free(sp->draft_probs);
+    free(sp->residual);
+}
+
+int speculator_step(Speculator* sp, int* tokens, int n, int max_new, unsigned long long* rng_state) {
+    // the sequence is tokens[0..n-1] (n >= 1), and the caches hold a prefix of it, so the
+    // first step prefills the prompt. appends 1 to min(k+1, max_new) tokens sampled from the
+    // target at tokens[n..], and returns how many. tokens[n..n+max_new-1] must exist, the
+    // drafted tokens go there before they are checked
+    GPT2* target = sp->target;
+    GPT2* draft = sp->draft;
+    KVCache* tc = &sp->target_cache;
+    KVCache* dc = &sp->draft_cache;
+    int V = target->config.vocab_size;
+    int k = sp->k < max_new - 1 ? sp->k : max_new - 1;
+    if (n + k > tc->capacity || n + k > dc->capacity) {
+        printf("Error: %d tokens don't fit in the KV caches of %d positions\n", n + k, tc->capacity);
+        exit(1);
+    }
+
+    // draft k tokens. the draft catches up with the sequence first, then gets its own samples
+    for (int i = 0; i < k; i++) {
+        float* q = gpt2_decode(draft, dc, tokens + dc->len, n + i - dc->len);
+        memcpy(sp->draft_probs + (size_t)i * V, q, V * sizeof(float));
+        tokens[n + i] = sample_mult(q, V, random_f32(rng_state));
+    }
+    // the target distributions after the last token and after each of the drafted ones
+    int rows = n + k - tc->len;
+    float* p = gpt2_decode_rows(target, tc, tokens + tc->len, rows, k + 1);
+
+    // accept the drafted tokens up to the first rejection
+    int accepted = 0;
+    int next = -1;
+    for (int i = 0; i < k && next < 0; i++) {
+        float* pi = p + (size_t)i * V;
+        float* qi = sp->draft_probs + (size_t)i * V;
+        int x = tokens[n + i];
+        // x is kept with probability p(x) / q(x), as r < p/q written without the division
+        if (random_f32(rng_state) * qi[x] < pi[x]) {
+            accepted++;
+        } else {
+            float sum = 0.0f;
+            for (int j = 0; j < V; j++) {
+                sp->residual[j] = pi[j] > qi[j] ? pi[j] - qi[j] : 0.0f;
+                sum += sp->residual[j];
+            }
+            float* dist = pi; // p == q up to rounding, then the residual is empty
+            if (sum > 0.0f) {
+                for (int j = 0; j < V; j++) { sp->residual[j] /= sum; }
+                dist = sp->residual;
+            }
+            next = sample_mult(dist, V, random_f32(rng_state));
+        }
+    }
+    if (next < 0) { next = sample_mult(p + (size_t)k * V, V, random_f32(rng_state)); }
+    tokens[n + accepted] = next;
+
+    // the caches forget the positions past the accepted tokens; the new token goes into
+    // both at the next step
+    kv_cache_truncate(tc, n + accepted);
+    kv_cache_truncate(dc, n + accepted);
+    sp->steps++;
+    sp->drafted += k;
+    sp->accepted += accepted;
+    return accepted + 1;
+}
+
+#ifndef TESTING
+// if we are TESTING (see test_gpt2.c), we'll skip the int main below
+
+// ----------------------------------------------------------------------------
+// CLI
+
+void error_usage() {
+    fprintf(stderr, "Usage:   ./train_gpt2 [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -a <int>    attention: 0 = reference, 1 = flash (default = 0)\n");
+    fprintf(stderr, "  -c <int>    classifier: 0 = reference, 1 = fused, no (B,T,V) buffers (default = 0)\n");
+    fprintf(stderr, "  -p <int>    pre-pack the matmul weights into the GEMM panel layout at load (default = 0)\n");
+    fprintf(stderr, "  -b <int>    mixed precision: bf16 forward weights and saved activations (default = 0)\n");
+    fprintf(stderr, "  -r <int>    recompute: 0 = off, 1 = attention and gelu internals, 2 = whole layers (default = 0)\n");
+    fprintf(stderr, "  -k <int>    with -r 2, recompute every k-th layer (default = 1)\n");
+    fprintf(stderr, "  -m <int>    checkpoint: 0 = read, 1 = mmap, 2 = mmap and populate (default = 0)\n");
+    fprintf(stderr, "  -o <int>    optimizer state: 32 = fp32, 16 = bf16, 8 = 8-bit blocks (default = 32)\n");
+    fprintf(stderr, "  -d <int>    total batch size in tokens per optimizer step, a multiple of B*T (default = B*T)\n");
+    fprintf(stderr, "  -u <int>    untied embeddings: the lm-head gets its own copy of wte (default = 0)\n");
+    exit(EXIT_FAILURE);
+}
+
 // ----------------------------------------------------------------------------
 // main training loop
-int main() {
+int main(int argc, char *argv[]) {
+
+    // read in the (optional) command line arguments
+    int flash_attention = 0;
+    int fused_classifier = 0;
+    int pack_weights = 0;
+    int mixed_precision = 0;
+    int recompute = 0;
+    int recompute_every = 1;
+    int checkpoint_load = CHECKPOINT_READ;
+    int optimizer_bits = 32;
+    int total_batch_size = -1; // tokens per optimizer step, -1 = one micro-batch
+    int untied_embeddings = 0;
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        if (argv[i][0] != '-' || strlen(argv[i]) != 2) { error_usage(); } // must be -x
+        if (argv[i][1] == 'a') { flash_attention = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'c') { fused_classifier = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'p') { pack_weights = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'b') { mixed_precision = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'r') { recompute = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'k') { recompute_every = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'm') { checkpoint_load = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'o') { optimizer_bits = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'd') { total_batch_size = atoi(argv[i+1]); }
+        else if (argv[i][1] == 'u') { untied_embeddings = atoi(argv[i+1]); }
+        else { error_usage(); }
+    }
 
     // build the GPT-2 model from a checkpoint
     GPT2 model;
-    gpt2_build_from_checkpoint(&model, "gpt2_124M.bin");
+    gpt2_build_from_checkpoint_mmap(&model, "gpt2_124M.bin", checkpoint_load);
+    model.flash_attention = flash_attention;
+    model.fused_classifier = fused_classifier;
+    model.mixed_precision = mixed_precision;
+    model.recompute = recompute;
+    model.recompute_every = recompute_every;
+    model.optimizer_bits = optimizer_bits;
+    if (untied_embeddings) { gpt2_untie_embeddings(&model); }
+    if (pack_weights) { gpt2_pack_weights(&model); }
+    printf("attention: %s\n", flash_attention ? "flash" : "reference");
+    printf("classifier: %s\n", fused_classifier ? "fused" : "reference");
+    printf("precision: %s\n", mixed_precision ? "bf16 storage, fp32 math" : "fp32");
+    if (recompute == 1) { printf("recompute: attention and gelu internals\n"); }
+    if (recompute == 2) { printf("recompute: every %d-th layer\n", recompute_every); }
+    printf("optimizer state: %s\n", optimizer_bits == 32 ? "fp32" : optimizer_bits == 16 ? "bf16" : "8-bit blocks");
+    printf("embeddings: %s\n", untied_embeddings ? "untied, row-sparse wte gradient" : "tied");
 
     // build the DataLoaders from tokens files. for now use tiny_shakespeare if available, else tiny_stories
     char* tiny_stories_train = "data/TinyStories_train.bin";
@@ -1071,10 +3694,24 @@ int main() {
     printf("val dataset num_batches: %d\n", val_loader.num_batches);
     int val_num_batches = 10;
 
+    // gradient accumulation: every step runs grad_accum_steps micro-batches of B*T tokens,
+    // reusing the same activations, and then a single optimizer update
+    if (total_batch_size == -1) { total_batch_size = B * T; }
+    if (total_batch_size <= 0 || total_batch_size % (B * T) != 0) {
+        printf("Error: the total batch size %d must be a multiple of B*T = %d\n", total_batch_size, B * T);
+        exit(1);
+    }
+    int grad_accum_steps = total_batch_size / (B * T);
+    model.grad_accum_steps = grad_accum_steps;
+    printf("total batch size: %d tokens, %d micro-batch%s of %d\n",
+           total_batch_size, grad_accum_steps, grad_accum_steps > 1 ? "es" : "", B * T);
+
     // some memory for generating samples from the model
     unsigned long long rng_state = 1337;
     const int gen_max_length = 64; // during inference step we'll generate sequences of this many tokens
     int gen_tokens[gen_max_length];
+    KVCache gen_cache;
+    kv_cache_init(&gen_cache, &model, gen_max_length);
 
     // train
     struct timespec start, end;
@@ -1096,13 +3733,10 @@ int main() {
         // once in a while do model inference to print generated text
         if (step > 0 && step % 20 == 0) {
             gen_tokens[0] = GPT2_EOT; // the GPT-2 EOT token kicks off the generation
+            kv_cache_reset(&gen_cache);
             for (int t = 1; t < gen_max_length; t++) {
-                // note that inference is wasteful here because
-                // for each t, we re-compute all activations between 0 and t
-                // leaving this alone because you want separate code for inference anyway
-                // the inference here is just for sanity checking purposes
-                gpt2_forward(&model, gen_tokens, NULL, 1, t);
-                float* probs = model.acts.probs + (t-1) * model.config.vocab_size;
+                // only the newest token goes through the model, the earlier ones are in the KV cache
+                float* probs = gpt2_decode(&model, &gen_cache, gen_tokens + t - 1, 1);
                 float coin = random_f32(&rng_state);
                 int next_token = sample_mult(probs, model.config.vocab_size, coin);
                 gen_tokens[t] = next_token;
@@ -1116,19 +3750,25 @@ int main() {
 
         // do a training step
         clock_gettime(CLOCK_MONOTONIC, &start);
-        dataloader_next_batch(&train_loader);
-        gpt2_forward(&model, train_loader.inputs, train_loader.targets, B, T);
+        float train_loss = 0.0f;
         gpt2_zero_grad(&model);
-        gpt2_backward(&model);
+        for (int micro_step = 0; micro_step < grad_accum_steps; micro_step++) {
+            dataloader_next_batch(&train_loader);
+            gpt2_forward(&model, train_loader.inputs, train_loader.targets, B, T);
+            gpt2_backward(&model);
+            train_loss += model.mean_loss;
+        }
+        train_loss /= grad_accum_steps;
         gpt2_update(&model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.0f, step+1);
         clock_gettime(CLOCK_MONOTONIC, &end);
         double time_elapsed_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
-        printf("step %d: train loss %f (took %f ms)\n", step, model.mean_loss, time_elapsed_s * 1000);
+        printf("step %d: train loss %f (took %f ms)\n", step, train_loss, time_elapsed_s * 1000);
     }
 
     // free
     dataloader_free(&train_loader);
     dataloader_free(&val_loader);
+    kv_cache_free(&gen_cache);
     gpt2_free(&model);
     return 0;
 }
@@ -244,23 +244,31 @@ def write_tensors(model_tensors, L, file):
     write_fp32(model_tensors["transformer.ln_f.weight"], file) # (C, )
     write_fp32(model_tensors["transformer.ln_f.bias"], file) # (C, )
 
-def write_model(model, filename):
+def write_model(model, filename, version=1):
     # everything we need to instantiate the model
     # 1) header is: version int, GPTConfig ints, padding to 1024 bytes
+    # version 1 is what every loader reads (train_gpt2.c, train_gpt2.cu, trainGPT2.c).
+    # version 3 puts the parameters at a page aligned offset, for mmap in train_gpt2.c only
+    assert version in (1, 3)
     header = torch.zeros(256, dtype=torch.int32)
     header[0] = 20240326 # magic
-    header[1] = 1 # checkpoint version = 1
+    header[1] = version # checkpoint version
     header[2] = model.config.block_size
     header[3] = model.config.vocab_size
     header[4] = model.config.n_layer
     header[5] = model.config.n_head
     header[6] = model.config.n_embd
+    if version == 3:
+        header[7] = 0 # fp32 parameters (the bits of quantized checkpoints)
+        header[9] = 4096 # byte offset of the parameters
     # 2) the parameters on CPU are next
     params = {name: param.cpu() for name, param in model.named_parameters()}
     # now write
     with open(filename, "wb") as file:
         # header
         file.write(header.numpy().tobytes())
+        if version == 3:
+            file.write(bytes(4096 - 1024)) # zero padding up to the parameters
         # model parameters
         write_tensors(params, model.config.n_layer, file)
     print(f"wrote {filename}")
@@ -308,6 +316,7 @@ if __name__ == "__main__":
     parser.add_argument("--num_iterations", type=int, default=10, help="number of iterations to run")
     parser.add_argument("--batch_size", type=int, default=4, help="batch size")
     parser.add_argument("--sequence_length", type=int, default=64, help="sequence length")
+    parser.add_argument("--checkpoint_version", type=int, default=1, help="1 = loads everywhere, 3 = page aligned for mmap (C only)")
     args = parser.parse_args()
     B, T = args.batch_size, args.sequence_length
     assert 1 <= T <= 1024
@@ -383,7 +392,7 @@ if __name__ == "__main__":
             loss.backward()
             # on the first iteration only, save the state dict to file for later reference
             if i == 0 and args.write_tensors:
-                write_model(model, "gpt2_124M.bin")
+                write_model(model, "gpt2_124M.bin", args.checkpoint_version)
                 write_state(model, x, y, logits, loss, "gpt2_124M_debug_state.bin")
             optimizer.step()
         if device == "mps":